@@ -0,0 +1,28 @@
+#ifndef BENCH_H__
+#define BENCH_H__
+
+// Tiny shared helpers for the benchmark programs. Not part of the library.
+// Define _POSIX_C_SOURCE before including anything else, -std=c11 hides clock_gettime otherwise.
+
+#include <stddef.h>
+#include <time.h>
+
+///
+/// Monotonic wall clock
+/// \return Seconds since some fixed point
+///
+static inline double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+///
+/// Keeps the optimizer from discarding a computed value
+/// \param value The value to sink
+///
+static inline void bench_sink(size_t value) {
+    __asm__ volatile("" : : "r"(value) : "memory");
+}
+
+#endif
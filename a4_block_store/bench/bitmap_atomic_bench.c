@@ -0,0 +1,119 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bitmap.h"
+#include "bench.h"
+
+// Multi-threaded stress for the lock-free bitmap operations
+// First every thread claims bits until the map is full and we check nobody got the same bit twice,
+// then every thread runs claim/release pairs for a fixed time to measure throughput.
+
+#define BENCH_BITS ((size_t) 1 << 20)
+#define BENCH_SECONDS 0.5
+
+struct worker {
+    pthread_t thread;
+    bitmap_t *bitmap;
+    size_t hint;
+    size_t *claimed;  // stress: the bits this thread got
+    size_t count;     // stress: how many it got, throughput: operations done
+};
+
+static void *stress_worker(void *arg) {
+    struct worker *worker = (struct worker *) arg;
+    size_t bit;
+    while ((bit = bitmap_find_zero_and_set(worker->bitmap, worker->hint)) != SIZE_MAX) {
+        worker->claimed[worker->count++] = bit;
+    }
+    return NULL;
+}
+
+static void *throughput_worker(void *arg) {
+    struct worker *worker = (struct worker *) arg;
+    const double stop = bench_now() + BENCH_SECONDS;
+    while (bench_now() < stop) {
+        // Batches so the clock isn't the thing we measure
+        for (int rep = 0; rep < 256; ++rep) {
+            const size_t bit = bitmap_find_zero_and_set(worker->bitmap, worker->hint);
+            if (bit == SIZE_MAX || !bitmap_test_and_reset(worker->bitmap, bit)) {
+                fprintf(stderr, "claim/release of %zu went wrong\n", bit);
+                exit(EXIT_FAILURE);
+            }
+        }
+        worker->count += 256;
+    }
+    return NULL;
+}
+
+static void stress(size_t threads) {
+    bitmap_t *bitmap       = bitmap_create(BENCH_BITS);
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    uint8_t *seen          = calloc(BENCH_BITS, 1);
+    if (!bitmap || !workers || !seen) {
+        fprintf(stderr, "allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t idx = 0; idx < threads; ++idx) {
+        workers[idx].bitmap  = bitmap;
+        workers[idx].hint    = 0;  // Everyone fights over the same words, the worst case
+        workers[idx].claimed = malloc(BENCH_BITS * sizeof(size_t));
+        pthread_create(&workers[idx].thread, NULL, stress_worker, &workers[idx]);
+    }
+    size_t total = 0;
+    for (size_t idx = 0; idx < threads; ++idx) {
+        pthread_join(workers[idx].thread, NULL);
+        for (size_t claim = 0; claim < workers[idx].count; ++claim) {
+            if (seen[workers[idx].claimed[claim]]++) {
+                fprintf(stderr, "bit %zu claimed twice\n", workers[idx].claimed[claim]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        total += workers[idx].count;
+        free(workers[idx].claimed);
+    }
+    if (total != BENCH_BITS) {
+        fprintf(stderr, "claimed %zu of %zu bits\n", total, BENCH_BITS);
+        exit(EXIT_FAILURE);
+    }
+    free(seen);
+    free(workers);
+    bitmap_destroy(bitmap);
+}
+
+static double throughput(size_t threads, bool spread) {
+    bitmap_t *bitmap       = bitmap_create(BENCH_BITS);
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    if (!bitmap || !workers) {
+        fprintf(stderr, "allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    // Half full so the searches have some work to do
+    for (size_t bit = 0; bit < BENCH_BITS; bit += 2) {
+        bitmap_set(bitmap, bit);
+    }
+    for (size_t idx = 0; idx < threads; ++idx) {
+        workers[idx].bitmap = bitmap;
+        workers[idx].hint   = spread ? idx * (BENCH_BITS / threads) : 0;
+        pthread_create(&workers[idx].thread, NULL, throughput_worker, &workers[idx]);
+    }
+    size_t total = 0;
+    for (size_t idx = 0; idx < threads; ++idx) {
+        pthread_join(workers[idx].thread, NULL);
+        total += workers[idx].count;
+    }
+    free(workers);
+    bitmap_destroy(bitmap);
+    return (double) total / BENCH_SECONDS;
+}
+
+// Optional argument is the largest thread count, default 16
+int main(int argc, char **argv) {
+    const size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+    printf("%-8s %18s %18s\n", "threads", "shared_hint_ops/s", "spread_hint_ops/s");
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        stress(threads);
+        printf("%-8zu %18.0f %18.0f\n", threads, throughput(threads, false), throughput(threads, true));
+    }
+    return EXIT_SUCCESS;
+}
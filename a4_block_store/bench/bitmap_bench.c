@@ -0,0 +1,173 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "bench.h"
+
+// The bitmap microbenchmark suite: set/reset/test, ffs/ffz, total_set and for_each
+// over sizes from 2^8 bits up and a handful of densities.
+// Output is one JSON object per line so runs can be saved and diffed against a baseline:
+//  {"op":"ffz","bits":65536,"density":0.984375,"popcount":"default","ns_per_op":12.5,"ops":4194304}
+// Every op is repeated until BENCH_MIN_SECONDS have gone by, so small sizes aren't all timer noise.
+
+#define BENCH_PROBES ((size_t) 1 << 16)
+#define BENCH_MIN_SECONDS 0.05
+
+struct bench_case {
+    bitmap_t *bitmap;
+    const size_t *probes;  // Random bits for set/reset/test
+};
+
+// Each op runs one batch and says how many operations that was
+typedef size_t (*bench_op)(const struct bench_case *);
+
+static size_t op_set(const struct bench_case *bench) {
+    for (size_t idx = 0; idx < BENCH_PROBES; ++idx) {
+        bitmap_set(bench->bitmap, bench->probes[idx]);
+    }
+    return BENCH_PROBES;
+}
+
+static size_t op_reset(const struct bench_case *bench) {
+    for (size_t idx = 0; idx < BENCH_PROBES; ++idx) {
+        bitmap_reset(bench->bitmap, bench->probes[idx]);
+    }
+    return BENCH_PROBES;
+}
+
+static size_t op_test(const struct bench_case *bench) {
+    size_t hits = 0;
+    for (size_t idx = 0; idx < BENCH_PROBES; ++idx) {
+        hits += bitmap_test(bench->bitmap, bench->probes[idx]);
+    }
+    bench_sink(hits);
+    return BENCH_PROBES;
+}
+
+static size_t op_ffs(const struct bench_case *bench) {
+    bench_sink(bitmap_ffs(bench->bitmap));
+    return 1;
+}
+
+static size_t op_ffz(const struct bench_case *bench) {
+    bench_sink(bitmap_ffz(bench->bitmap));
+    return 1;
+}
+
+static size_t op_total_set(const struct bench_case *bench) {
+    bench_sink(bitmap_total_set(bench->bitmap));
+    return 1;
+}
+
+static void count_bit(size_t bit, void *arg) {
+    *(size_t *) arg += bit;
+}
+
+static size_t op_for_each(const struct bench_case *bench) {
+    size_t sum = 0;
+    bitmap_for_each(bench->bitmap, count_bit, &sum);
+    bench_sink(sum);
+    return 1;
+}
+
+// Read-only ops go first, set and reset last since they change the map
+static const struct {
+    const char *name;
+    bench_op op;
+} bench_ops[] = {
+    {"test", op_test}, {"ffs", op_ffs}, {"ffz", op_ffz}, {"total_set", op_total_set},
+    {"for_each", op_for_each}, {"set", op_set}, {"reset", op_reset},
+};
+
+// Densities are 2^-k or 1 - 2^-k so the map can be built a word at a time by and-ing random words
+static const struct {
+    int and_words;  // Each bit is set with probability 2^-and_words, 0 means empty
+    bool invert;
+} bench_densities[] = {
+    {0, false}, {6, false}, {1, false}, {6, true}, {0, true},
+};
+
+static uint64_t bench_rand(uint64_t *state) {
+    // xorshift64, plenty for filling maps
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static double time_op(bench_op op, const struct bench_case *bench, size_t *ops) {
+    *ops               = 0;
+    const double start = bench_now();
+    double elapsed;
+    // Double the batch between clock reads so a fast op isn't timing clock_gettime
+    for (size_t batch = 1;; batch <<= 1) {
+        for (size_t rep = 0; rep < batch; ++rep) {
+            *ops += op(bench);
+        }
+        elapsed = bench_now() - start;
+        if (elapsed >= BENCH_MIN_SECONDS) {
+            return elapsed;
+        }
+    }
+}
+
+static void bench_size(size_t bits, const char *popcount) {
+    const size_t words = (bits + 63) / 64;
+    uint64_t *data     = (uint64_t *) malloc(words * sizeof(uint64_t));
+    size_t *probes     = (size_t *) malloc(BENCH_PROBES * sizeof(size_t));
+    if (!data || !probes) {
+        fprintf(stderr, "allocation for %zu bits failed\n", bits);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t state = 88172645463325252ull;
+    for (size_t idx = 0; idx < BENCH_PROBES; ++idx) {
+        probes[idx] = (size_t) (bench_rand(&state) % bits);
+    }
+
+    for (size_t density = 0; density < sizeof(bench_densities) / sizeof(bench_densities[0]); ++density) {
+        const int and_words = bench_densities[density].and_words;
+        const bool invert   = bench_densities[density].invert;
+        for (size_t idx = 0; idx < words; ++idx) {
+            uint64_t word = and_words ? ~(uint64_t) 0 : 0;
+            for (int round = 0; round < and_words; ++round) {
+                word &= bench_rand(&state);
+            }
+            data[idx] = invert ? ~word : word;
+        }
+        // Overlay rather than import so 2^32 bits doesn't need the memory twice
+        struct bench_case bench = {bitmap_overlay(bits, data), probes};
+        if (!bench.bitmap) {
+            fprintf(stderr, "bitmap overlay for %zu bits failed\n", bits);
+            exit(EXIT_FAILURE);
+        }
+        const double fraction = (double) bitmap_total_set(bench.bitmap) / (double) bits;
+
+        for (size_t op = 0; op < sizeof(bench_ops) / sizeof(bench_ops[0]); ++op) {
+            size_t ops;
+            const double elapsed = time_op(bench_ops[op].op, &bench, &ops);
+            printf("{\"op\":\"%s\",\"bits\":%zu,\"density\":%.6f,\"popcount\":\"%s\",\"ns_per_op\":%.3f,\"ops\":%zu}\n",
+                   bench_ops[op].name, bits, fraction, popcount, elapsed * 1e9 / (double) ops, ops);
+            fflush(stdout);
+        }
+        bitmap_destroy(bench.bitmap);
+    }
+    free(probes);
+    free(data);
+}
+
+// Optional arguments are the smallest and largest power of two to test, default 2^8 to 2^24
+// Going all the way to 2^32 needs 512MiB and takes a while, mostly in for_each
+int main(int argc, char **argv) {
+    const size_t min_shift = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+    const size_t max_shift = argc > 2 ? strtoul(argv[2], NULL, 10) : 24;
+    // Record which popcount the library was told to use, the numbers aren't comparable otherwise
+    const char *popcount = getenv("BITMAP_POPCOUNT");
+    if (!popcount || !*popcount || strpbrk(popcount, "\"\\")) {
+        popcount = "default";
+    }
+    for (size_t shift = min_shift; shift <= max_shift; shift += 4) {
+        bench_size((size_t) 1 << shift, popcount);
+    }
+    return EXIT_SUCCESS;
+}
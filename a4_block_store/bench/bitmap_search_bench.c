@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include "bitmap.h"
+#include "bench.h"
+
+// Compares ffs/ffz against the old bit-at-a-time scan on multi-million bit maps, for both
+// flat and hierarchical bitmaps. The worst case for the scans is a nearly full (ffz)
+// or nearly empty (ffs) map, so that's what we build. 0 means the legacy scan was skipped.
+
+// The pre-word-storage implementation, kept here as the baseline
+static size_t legacy_ffz(const bitmap_t *const bitmap) {
+    size_t result = 0;
+    const size_t bits = bitmap_get_bits(bitmap);
+    for (; result < bits && bitmap_test(bitmap, result); ++result) {
+    }
+    return (result == bits ? SIZE_MAX : result);
+}
+
+static size_t legacy_ffs(const bitmap_t *const bitmap) {
+    size_t result = 0;
+    const size_t bits = bitmap_get_bits(bitmap);
+    for (; result < bits && !bitmap_test(bitmap, result); ++result) {
+    }
+    return (result == bits ? SIZE_MAX : result);
+}
+
+static double time_search(size_t (*search)(const bitmap_t *const), const bitmap_t *bitmap, size_t expect, int reps) {
+    double start = bench_now();
+    for (int rep = 0; rep < reps; ++rep) {
+        size_t found = search(bitmap);
+        if (found != expect) {
+            fprintf(stderr, "search returned %zu, expected %zu\n", found, expect);
+            exit(EXIT_FAILURE);
+        }
+        bench_sink(found);
+    }
+    return (bench_now() - start) / reps;
+}
+
+// Builds the worst case for each search in both flavours and times them
+static void bench_size(size_t bits, int reps) {
+    bitmap_t *flat = bitmap_create(bits);
+    bitmap_t *hier = bitmap_create_hierarchical(bits);
+    if (!flat || !hier) {
+        fprintf(stderr, "bitmap creation for %zu bits failed\n", bits);
+        exit(EXIT_FAILURE);
+    }
+
+    // Nearly full, only the last bit is free
+    bitmap_format(flat, 0xFF);
+    bitmap_reset(flat, bits - 1);
+    bitmap_format(hier, 0xFF);
+    bitmap_reset(hier, bits - 1);
+    // The per-bit scan takes minutes past 2^28, don't bother
+    double legacy = bits <= ((size_t) 1 << 28) ? time_search(legacy_ffz, flat, bits - 1, reps) : 0;
+    double word   = time_search(bitmap_ffz, flat, bits - 1, reps);
+    double tree   = time_search(bitmap_ffz, hier, bits - 1, reps);
+    printf("%-10zu %-4s %14.0f %14.0f %14.0f\n", bits, "ffz", legacy * 1e9, word * 1e9, tree * 1e9);
+
+    // Nearly empty, only the last bit is used
+    bitmap_format(flat, 0x00);
+    bitmap_set(flat, bits - 1);
+    bitmap_format(hier, 0x00);
+    bitmap_set(hier, bits - 1);
+    legacy = bits <= ((size_t) 1 << 28) ? time_search(legacy_ffs, flat, bits - 1, reps) : 0;
+    word   = time_search(bitmap_ffs, flat, bits - 1, reps);
+    tree   = time_search(bitmap_ffs, hier, bits - 1, reps);
+    printf("%-10zu %-4s %14.0f %14.0f %14.0f\n", bits, "ffs", legacy * 1e9, word * 1e9, tree * 1e9);
+
+    bitmap_destroy(flat);
+    bitmap_destroy(hier);
+}
+
+// Optional argument is the largest power of two to test, default 2^26
+int main(int argc, char **argv) {
+    const size_t max_shift = argc > 1 ? strtoul(argv[1], NULL, 10) : 26;
+    printf("%-10s %-4s %14s %14s %14s\n", "bits", "op", "legacy_ns", "word_ns", "hier_ns");
+    for (size_t shift = 20; shift <= max_shift; shift += 2) {
+        bench_size((size_t) 1 << shift, 5);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "block_store.h"
+#include "bench.h"
+
+// Allocate/release throughput on one shared device from 1 to 64 threads, with and without the
+// per-thread magazine caches. Each thread holds a handful of blocks at a time, like a writer
+// that allocates a few blocks, fills them and frees them again.
+
+#define BENCH_BLOCK_SIZE 64
+#define BENCH_BLOCKS ((size_t) 1 << 16)
+#define BENCH_SECONDS 0.5
+#define BENCH_HELD 8
+#define BENCH_MAGAZINE 64
+
+struct worker {
+    pthread_t thread;
+    block_store_t *bs;
+    size_t count;
+};
+
+static void *bench_worker(void *arg) {
+    struct worker *worker = (struct worker *) arg;
+    size_t held[BENCH_HELD];
+    const double stop = bench_now() + BENCH_SECONDS;
+    while (bench_now() < stop) {
+        // Batches so the clock isn't the thing we measure
+        for (int rep = 0; rep < 32; ++rep) {
+            for (size_t idx = 0; idx < BENCH_HELD; ++idx) {
+                held[idx] = block_store_allocate(worker->bs);
+                if (held[idx] == SIZE_MAX) {
+                    fprintf(stderr, "device ran out of blocks\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            for (size_t idx = 0; idx < BENCH_HELD; ++idx) {
+                block_store_release(worker->bs, held[idx]);
+            }
+        }
+        worker->count += 32 * BENCH_HELD * 2;
+    }
+    return NULL;
+}
+
+static double throughput(size_t threads, bool caches) {
+    block_store_t *bs      = block_store_create_ex(BENCH_BLOCK_SIZE, BENCH_BLOCKS);
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    if (!bs || !workers || (caches && !block_store_enable_caches(bs, BENCH_MAGAZINE))) {
+        fprintf(stderr, "setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t idx = 0; idx < threads; ++idx) {
+        workers[idx].bs = bs;
+        pthread_create(&workers[idx].thread, NULL, bench_worker, &workers[idx]);
+    }
+    size_t ops = 0;
+    for (size_t idx = 0; idx < threads; ++idx) {
+        pthread_join(workers[idx].thread, NULL);
+        ops += workers[idx].count;
+    }
+    // Everything went back, once the magazines are flushed the device is empty again
+    block_store_flush_caches(bs);
+    if (block_store_get_used_blocks(bs) != 0) {
+        fprintf(stderr, "%zu blocks leaked\n", block_store_get_used_blocks(bs));
+        exit(EXIT_FAILURE);
+    }
+    free(workers);
+    block_store_destroy(bs);
+    return (double) ops / BENCH_SECONDS;
+}
+
+// Optional argument is the largest thread count, default 64
+int main(int argc, char **argv) {
+    const size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    printf("%-8s %18s %18s\n", "threads", "fbm_ops/s", "magazine_ops/s");
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        printf("%-8zu %18.0f %18.0f\n", threads, throughput(threads, false), throughput(threads, true));
+    }
+    return EXIT_SUCCESS;
+}
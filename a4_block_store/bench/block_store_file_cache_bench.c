@@ -0,0 +1,78 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_store.h"
+#include "bench.h"
+
+// Random block reads and writes over a growing working set, first on an in-memory device and then
+// through a file with a fixed-size block cache in front of it. While the working set fits in the
+// cache the cached device should keep up with memory; past that every miss is a file read (plus a
+// write-back for dirty victims), and the hit rate and throughput fall off together.
+
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_BLOCKS ((size_t) 1 << 14)
+#define BENCH_CACHE_BLOCKS ((size_t) 1 << 10)
+#define BENCH_OPS 200000
+#define BENCH_FILE "file_cache_bench.bs"
+
+static size_t bench_rand(size_t *state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (size_t) (*state >> 33);
+}
+
+// One write in four, the rest reads, all inside the first working_set blocks
+static double bench_run(block_store_t *bs, const size_t working_set, unsigned char *buffer) {
+    size_t state = 1;
+    const double start = bench_now();
+    for (size_t op = 0; op < BENCH_OPS; ++op) {
+        const size_t id = bench_rand(&state) % working_set;
+        if (op % 4 == 0) {
+            buffer[0] = (unsigned char) op;
+            block_store_write(bs, id, buffer);
+        } else {
+            bench_sink(block_store_read(bs, id, buffer));
+        }
+    }
+    return BENCH_OPS / (bench_now() - start);
+}
+
+int main(void) {
+    unsigned char *buffer = (unsigned char *) malloc(BENCH_BLOCK_SIZE);
+    block_store_t *memory = block_store_create_ex(BENCH_BLOCK_SIZE, BENCH_BLOCKS);
+    remove(BENCH_FILE);
+    block_store_t *cached = block_store_open_cached(BENCH_FILE, BLOCK_STORE_OPEN_CREATE, BENCH_BLOCK_SIZE, BENCH_BLOCKS,
+                                                    BENCH_CACHE_BLOCKS);
+    if (!buffer || !memory || !cached) {
+        fprintf(stderr, "setup failed\n");
+        return EXIT_FAILURE;
+    }
+    memset(buffer, 0, BENCH_BLOCK_SIZE);
+    size_t first;
+    const size_t usable = block_store_get_free_blocks(memory) < block_store_get_free_blocks(cached)
+                              ? block_store_get_free_blocks(memory)
+                              : block_store_get_free_blocks(cached);
+    if (!block_store_allocate_extent(memory, usable, &first) || !block_store_allocate_extent(cached, usable, &first)) {
+        fprintf(stderr, "allocation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("cache holds %zu blocks\n", (size_t) BENCH_CACHE_BLOCKS);
+    printf("%12s %14s %14s %10s\n", "working_set", "memory_ops_s", "cached_ops_s", "hit_rate");
+    for (size_t working_set = BENCH_CACHE_BLOCKS / 4; working_set <= usable; working_set *= 2) {
+        block_store_cache_stats_t before, after;
+        block_store_get_cache_stats(cached, &before);
+        const double memory_rate = bench_run(memory, working_set, buffer);
+        const double cached_rate = bench_run(cached, working_set, buffer);
+        block_store_get_cache_stats(cached, &after);
+        const double hits = (double) (after.hits - before.hits);
+        const double lookups = hits + (double) (after.misses - before.misses);
+        printf("%12zu %14.0f %14.0f %9.1f%%\n", working_set, memory_rate, cached_rate, 100.0 * hits / lookups);
+    }
+
+    block_store_destroy(cached);
+    block_store_destroy(memory);
+    remove(BENCH_FILE);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_store.h"
+#include "bench.h"
+
+// Checkpoint cost against churn: after changing some number of random blocks we save the device
+// once with block_store_serialize and once with block_store_flush onto the previous image. Serialize
+// always writes the whole device, flush should write (and take) about as much as what changed.
+
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_BLOCKS ((size_t) 1 << 14)
+#define BENCH_SERIALIZE_FILE "flush_bench_full.bs"
+#define BENCH_FLUSH_FILE "flush_bench.bs"
+
+static size_t bench_rand(size_t *state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (size_t) (*state >> 33);
+}
+
+int main(void) {
+    block_store_t *bs = block_store_create_ex(BENCH_BLOCK_SIZE, BENCH_BLOCKS);
+    unsigned char *buffer = (unsigned char *) malloc(BENCH_BLOCK_SIZE);
+    size_t first;
+    if (!bs || !buffer || !block_store_allocate_extent(bs, block_store_get_free_blocks(bs), &first)) {
+        fprintf(stderr, "setup failed\n");
+        return EXIT_FAILURE;
+    }
+    const size_t usable = block_store_get_used_blocks(bs);
+    memset(buffer, 0, BENCH_BLOCK_SIZE);
+    remove(BENCH_FLUSH_FILE);
+    if (!block_store_flush(bs, BENCH_FLUSH_FILE)) {
+        fprintf(stderr, "first flush failed\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t state = 1;
+    printf("%8s %14s %14s %14s %14s\n", "changed", "serialize_ms", "serialize_kib", "flush_ms", "flush_kib");
+    for (size_t churn = 1; churn <= usable; churn *= 8) {
+        for (size_t i = 0; i < churn; ++i) {
+            buffer[0] = (unsigned char) i;
+            block_store_write(bs, bench_rand(&state) % usable, buffer);
+        }
+        double start = bench_now();
+        const size_t full = block_store_serialize(bs, BENCH_SERIALIZE_FILE);
+        const double serialize_ms = (bench_now() - start) * 1e3;
+        start = bench_now();
+        const size_t patched = block_store_flush(bs, BENCH_FLUSH_FILE);
+        const double flush_ms = (bench_now() - start) * 1e3;
+        printf("%8zu %14.3f %14zu %14.3f %14zu\n", churn, serialize_ms, full / 1024, flush_ms, patched / 1024);
+    }
+
+    block_store_destroy(bs);
+    free(buffer);
+    remove(BENCH_SERIALIZE_FILE);
+    remove(BENCH_FLUSH_FILE);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include "block_store.h"
+#include "bench.h"
+
+// Long-running churn under each allocation policy: extents of 1-64 blocks come and go at random
+// around a target fill level, then we report how fragmented the free space ended up and how
+// many allocations failed even though there were enough free blocks in total.
+// The buddy row runs the same stream in buddy mode, with power-of-two extents that get freed in bulk.
+
+#define BENCH_BLOCK_SIZE 64
+#define BENCH_BLOCKS ((size_t) 1 << 16)
+#define BENCH_OPS 500000
+#define BENCH_FILL 0.75
+
+struct extent {
+    size_t first, count;
+};
+
+static const struct {
+    const char *name;
+    BLOCK_STORE_POLICY policy;
+    bool buddy;
+} bench_policies[] = {
+    {"first_fit", BLOCK_STORE_FIRST_FIT, false},
+    {"next_fit", BLOCK_STORE_NEXT_FIT, false},
+    {"best_fit", BLOCK_STORE_BEST_FIT, false},
+    {"worst_fit", BLOCK_STORE_WORST_FIT, false},
+    {"buddy", BLOCK_STORE_FIRST_FIT, true},
+};
+
+// Deterministic so every policy sees the same request stream
+static size_t bench_rand(size_t *state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (size_t) (*state >> 33);
+}
+
+static void bench_policy(size_t which) {
+    block_store_t *bs = block_store_create_ex(BENCH_BLOCK_SIZE, BENCH_BLOCKS);
+    struct extent *live = (struct extent *) malloc(BENCH_BLOCKS * sizeof(struct extent));
+    if (!bs || !live || !block_store_set_policy(bs, bench_policies[which].policy) ||
+        (bench_policies[which].buddy && !block_store_enable_buddy(bs, 10))) {
+        fprintf(stderr, "setup for %s failed\n", bench_policies[which].name);
+        exit(EXIT_FAILURE);
+    }
+    const size_t target = (size_t) (block_store_get_block_count(bs) * BENCH_FILL);
+    size_t live_count = 0, used = 0, failed = 0;
+    size_t state = 1;
+
+    const double start = bench_now();
+    for (size_t op = 0; op < BENCH_OPS; ++op) {
+        // Allocate below the target, free above it, either way near it
+        const bool allocate = live_count == 0 || (bench_rand(&state) % 1000) < (used < target ? 550 : 450);
+        if (allocate) {
+            // Small extents are the common case
+            size_t count = 1 + (bench_rand(&state) % 64) * (bench_rand(&state) % 64) / 64;
+            if (bench_policies[which].buddy) {
+                // Round down to a power of two, so every policy sees roughly the same sizes
+                count = (size_t) 1 << (63 - __builtin_clzll((unsigned long long) count));
+            }
+            size_t first;
+            if (block_store_allocate_extent(bs, count, &first)) {
+                live[live_count].first = first;
+                live[live_count].count = count;
+                ++live_count;
+                used += count;
+            } else if (block_store_get_free_blocks(bs) >= count) {
+                ++failed;
+            }
+        } else {
+            const size_t victim = bench_rand(&state) % live_count;
+            block_store_release_extent(bs, live[victim].first, live[victim].count);
+            used -= live[victim].count;
+            live[victim] = live[--live_count];
+        }
+    }
+    const double elapsed = bench_now() - start;
+
+    block_store_fragmentation_t stats;
+    block_store_fragmentation_stats(bs, &stats);
+    printf("%-10s %10.0f %10zu %10zu %10zu %12zu\n", bench_policies[which].name, BENCH_OPS / elapsed, stats.free_blocks,
+           stats.free_runs, stats.largest_free_run, failed);
+
+    free(live);
+    block_store_destroy(bs);
+}
+
+int main(void) {
+    printf("%-10s %10s %10s %10s %10s %12s\n", "policy", "ops_per_s", "free", "free_runs", "largest", "failed_fits");
+    for (size_t which = 0; which < sizeof(bench_policies) / sizeof(bench_policies[0]); ++which) {
+        bench_policy(which);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,76 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "block_store.h"
+#include "bench.h"
+
+// Scans a cached device from front to back, sequentially and with a stride, with and without readahead.
+// The file's pages are dropped from the page cache before each scan (where the filesystem lets us), so
+// a miss is a real read. With readahead on the worker thread is fetching the next window while the scan
+// copies out the current one, so most reads should be prefetch hits rather than misses.
+
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_BLOCKS ((size_t) 1 << 15)
+#define BENCH_CACHE_BLOCKS ((size_t) 1 << 10)
+#define BENCH_WINDOW 256
+#define BENCH_FILE "readahead_bench.bs"
+
+static void bench_scan(const size_t stride, const bool readahead) {
+    block_store_t *bs = block_store_open_cached(BENCH_FILE, 0, BENCH_BLOCK_SIZE, BENCH_BLOCKS, BENCH_CACHE_BLOCKS);
+    if (!bs || (readahead && !block_store_enable_readahead(bs, BENCH_WINDOW))) {
+        fprintf(stderr, "setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+    // Cold start, as far as the kernel will go along with it
+    const int fd = open(BENCH_FILE, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    unsigned char *buffer = (unsigned char *) malloc(BENCH_BLOCK_SIZE);
+    const size_t usable = block_store_get_used_blocks(bs);
+    size_t reads = 0;
+    const double start = bench_now();
+    for (size_t id = 0; id < usable; id += stride, ++reads) {
+        bench_sink(block_store_read(bs, id, buffer));
+    }
+    const double elapsed = bench_now() - start;
+
+    block_store_cache_stats_t stats;
+    block_store_get_cache_stats(bs, &stats);
+    printf("%6zu %10s %12.0f %10llu %12llu\n", stride, readahead ? "on" : "off", reads / elapsed,
+           (unsigned long long) stats.misses, (unsigned long long) stats.prefetch_hits);
+    free(buffer);
+    block_store_destroy(bs);
+}
+
+int main(void) {
+    // Fill the whole device once, then sync it out
+    remove(BENCH_FILE);
+    block_store_t *bs = block_store_open_ex(BENCH_FILE, BLOCK_STORE_OPEN_CREATE, BENCH_BLOCK_SIZE, BENCH_BLOCKS);
+    unsigned char *buffer = (unsigned char *) malloc(BENCH_BLOCK_SIZE);
+    size_t first;
+    if (!bs || !buffer || !block_store_allocate_extent(bs, block_store_get_free_blocks(bs), &first)) {
+        fprintf(stderr, "setup failed\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t id = 0; id < block_store_get_used_blocks(bs); ++id) {
+        memset(buffer, (int) id, BENCH_BLOCK_SIZE);
+        block_store_write(bs, id, buffer);
+    }
+    block_store_sync(bs);
+    block_store_destroy(bs);
+    free(buffer);
+
+    printf("%6s %10s %12s %10s %12s\n", "stride", "readahead", "reads_per_s", "misses", "prefetch_hits");
+    for (size_t stride = 1; stride <= 8; stride *= 8) {
+        bench_scan(stride, false);
+        bench_scan(stride, true);
+    }
+    remove(BENCH_FILE);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "block_store.h"
+#include "bench.h"
+
+// Read/write throughput on one shared device at 1, 4, 16 and 64 threads, mostly reads of random
+// blocks. The baseline wraps every call in one global mutex, which is how callers had to share a
+// device before; the other runs use the sharded mode and no lock of their own, the last one with
+// optimistic (seqlock) reads on top.
+
+#define BENCH_BLOCK_SIZE 256
+#define BENCH_BLOCKS ((size_t) 1 << 14)
+#define BENCH_SHARDS 64
+#define BENCH_SECONDS 0.5
+#define BENCH_WRITE_PERCENT 5
+
+struct worker {
+    pthread_t thread;
+    block_store_t *bs;
+    pthread_mutex_t *global;  // NULL for the sharded run
+    size_t blocks;
+    size_t state;
+    size_t count;
+};
+
+static size_t bench_rand(size_t *state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (size_t) (*state >> 33);
+}
+
+static void *bench_worker(void *arg) {
+    struct worker *worker = (struct worker *) arg;
+    uint8_t buffer[BENCH_BLOCK_SIZE] = {0};
+    const double stop = bench_now() + BENCH_SECONDS;
+    while (bench_now() < stop) {
+        // Batches so the clock isn't the thing we measure
+        for (int rep = 0; rep < 256; ++rep) {
+            const size_t pick = bench_rand(&worker->state);
+            const size_t id = pick % worker->blocks;
+            if (worker->global) {
+                pthread_mutex_lock(worker->global);
+            }
+            const size_t bytes = (pick >> 20) % 100 < BENCH_WRITE_PERCENT ? block_store_write(worker->bs, id, buffer)
+                                                                           : block_store_read(worker->bs, id, buffer);
+            if (worker->global) {
+                pthread_mutex_unlock(worker->global);
+            }
+            if (bytes != BENCH_BLOCK_SIZE) {
+                fprintf(stderr, "access to block %zu failed\n", id);
+                exit(EXIT_FAILURE);
+            }
+        }
+        worker->count += 256;
+    }
+    return NULL;
+}
+
+static double throughput(size_t threads, bool sharded, bool seqlock) {
+    block_store_t *bs      = block_store_create_ex(BENCH_BLOCK_SIZE, BENCH_BLOCKS);
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    pthread_mutex_t global = PTHREAD_MUTEX_INITIALIZER;
+    if (!bs || !workers || (sharded && !block_store_enable_sharding(bs, BENCH_SHARDS)) ||
+        (seqlock && !block_store_enable_seqlock(bs, 1))) {
+        fprintf(stderr, "setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+    // Everything in use, so every access hits a real block
+    const size_t blocks = block_store_get_free_blocks(bs);
+    for (size_t id = 0; id < blocks; ++id) {
+        block_store_request(bs, id);
+    }
+    for (size_t idx = 0; idx < threads; ++idx) {
+        workers[idx].bs     = bs;
+        workers[idx].global = sharded ? NULL : &global;
+        workers[idx].blocks = blocks;
+        workers[idx].state  = idx + 1;
+        pthread_create(&workers[idx].thread, NULL, bench_worker, &workers[idx]);
+    }
+    size_t ops = 0;
+    for (size_t idx = 0; idx < threads; ++idx) {
+        pthread_join(workers[idx].thread, NULL);
+        ops += workers[idx].count;
+    }
+    free(workers);
+    block_store_destroy(bs);
+    return (double) ops / BENCH_SECONDS;
+}
+
+int main(void) {
+    static const size_t thread_counts[] = {1, 4, 16, 64};
+    printf("%-8s %18s %18s %18s\n", "threads", "global_mutex_ops/s", "sharded_ops/s", "seqlock_ops/s");
+    for (size_t idx = 0; idx < sizeof(thread_counts) / sizeof(thread_counts[0]); ++idx) {
+        printf("%-8zu %18.0f %18.0f %18.0f\n", thread_counts[idx], throughput(thread_counts[idx], false, false),
+               throughput(thread_counts[idx], true, false), throughput(thread_counts[idx], true, true));
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include "bitmap.h"
+#include "compressed_bitmap.h"
+#include "bench.h"
+
+// Memory and throughput of the compressed bitmap against the dense one, over a few shapes:
+// a sparse map, a nearly full one, a random half full one, and clustered runs.
+// Times are per operation: random test, random set+reset pairs, and one ffs/ffz.
+
+#define BENCH_OPS 1000000
+
+enum shape { SPARSE, NEARLY_FULL, HALF, CLUSTERED };
+static const char *const shape_names[] = {"sparse", "nearly_full", "half", "clustered"};
+
+// Deterministic so every run builds the same maps
+static size_t bench_rand(size_t *state) {
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (size_t) (*state >> 17);
+}
+
+static void fill(bitmap_t *bitmap, enum shape shape, size_t bits) {
+    size_t state = 42;
+    switch (shape) {
+        case SPARSE:
+            for (size_t count = bits / 1000; count; --count) {
+                bitmap_set(bitmap, bench_rand(&state) % bits);
+            }
+            break;
+        case NEARLY_FULL:
+            bitmap_format(bitmap, 0xFF);
+            for (size_t count = bits / 1000; count; --count) {
+                bitmap_reset(bitmap, bench_rand(&state) % bits);
+            }
+            break;
+        case HALF:
+            for (size_t bit = 0; bit < bits; ++bit) {
+                if (bench_rand(&state) & 1) {
+                    bitmap_set(bitmap, bit);
+                }
+            }
+            break;
+        case CLUSTERED:
+            // Runs of 100-1000 set bits with similar gaps, like a file system's extents
+            for (size_t bit = bench_rand(&state) % 1000; bit < bits;) {
+                const size_t length = 100 + bench_rand(&state) % 900;
+                bitmap_set_range(bitmap, bit, length < bits - bit ? length : bits - bit);
+                bit += length + 100 + bench_rand(&state) % 900;
+            }
+            break;
+    }
+}
+
+static void bench_shape(enum shape shape, size_t bits) {
+    bitmap_t *dense = bitmap_create(bits);
+    if (!dense) {
+        fprintf(stderr, "bitmap creation for %zu bits failed\n", bits);
+        exit(EXIT_FAILURE);
+    }
+    fill(dense, shape, bits);
+    cbitmap_t *compressed = cbitmap_from_bitmap(dense);
+    if (!compressed || cbitmap_total_set(compressed) != bitmap_total_set(dense)) {
+        fprintf(stderr, "compressing the %s map failed\n", shape_names[shape]);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t *probes = (size_t *) malloc(BENCH_OPS * sizeof(size_t));
+    if (!probes) {
+        exit(EXIT_FAILURE);
+    }
+    size_t state = 7;
+    for (size_t op = 0; op < BENCH_OPS; ++op) {
+        probes[op] = bench_rand(&state) % bits;
+    }
+
+    size_t hits    = 0;
+    double start   = bench_now();
+    for (size_t op = 0; op < BENCH_OPS; ++op) {
+        hits += bitmap_test(dense, probes[op]);
+    }
+    const double dense_test = (bench_now() - start) / BENCH_OPS;
+    start = bench_now();
+    for (size_t op = 0; op < BENCH_OPS; ++op) {
+        hits -= cbitmap_test(compressed, probes[op]);
+    }
+    const double compressed_test = (bench_now() - start) / BENCH_OPS;
+    if (hits) {
+        fprintf(stderr, "test results disagree on the %s map\n", shape_names[shape]);
+        exit(EXIT_FAILURE);
+    }
+    bench_sink(hits);
+
+    // Flip a bit and flip it back, so the map ends up as it started
+    start = bench_now();
+    for (size_t op = 0; op < BENCH_OPS; ++op) {
+        if (bitmap_test(dense, probes[op])) {
+            bitmap_reset(dense, probes[op]);
+            bitmap_set(dense, probes[op]);
+        } else {
+            bitmap_set(dense, probes[op]);
+            bitmap_reset(dense, probes[op]);
+        }
+    }
+    const double dense_update = (bench_now() - start) / BENCH_OPS;
+    start = bench_now();
+    for (size_t op = 0; op < BENCH_OPS; ++op) {
+        if (cbitmap_test(compressed, probes[op])) {
+            cbitmap_reset(compressed, probes[op]);
+            cbitmap_set(compressed, probes[op]);
+        } else {
+            cbitmap_set(compressed, probes[op]);
+            cbitmap_reset(compressed, probes[op]);
+        }
+    }
+    const double compressed_update = (bench_now() - start) / BENCH_OPS;
+    // Splits and merges can leave spare capacity behind
+    cbitmap_optimize(compressed);
+
+    start = bench_now();
+    bench_sink(bitmap_ffs(dense) + bitmap_ffz(dense));
+    const double dense_find = bench_now() - start;
+    start = bench_now();
+    bench_sink(cbitmap_ffs(compressed) + cbitmap_ffz(compressed));
+    const double compressed_find = bench_now() - start;
+
+    printf("%-12s %-10zu %12zu %12zu %12zu %9.1f %9.1f %9.1f %9.1f %10.0f %10.0f\n", shape_names[shape], bits,
+           bitmap_get_bytes(dense), cbitmap_memory_usage(compressed), cbitmap_serialized_size(compressed),
+           dense_test * 1e9, compressed_test * 1e9, dense_update * 1e9, compressed_update * 1e9, dense_find * 1e9,
+           compressed_find * 1e9);
+
+    free(probes);
+    cbitmap_destroy(compressed);
+    bitmap_destroy(dense);
+}
+
+// Optional argument is the bitmap size as a power of two, default 2^24
+int main(int argc, char **argv) {
+    const size_t shift = argc > 1 ? strtoul(argv[1], NULL, 10) : 24;
+    printf("%-12s %-10s %12s %12s %12s %9s %9s %9s %9s %10s %10s\n", "shape", "bits", "dense_B", "cbitmap_B",
+           "serial_B", "test_ns", "ctest_ns", "update_ns", "cupdate_ns", "find_ns", "cfind_ns");
+    for (int shape = SPARSE; shape <= CLUSTERED; ++shape) {
+        bench_shape((enum shape) shape, (size_t) 1 << shift);
+    }
+    return EXIT_SUCCESS;
+}
@@ -46,6 +46,83 @@ bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Atomically sets requested bit in bitmap
+///  The atomic operations are safe to race with each other on the same bitmap.
+///  Hierarchical bitmaps can't keep their summaries atomic, so they fall back
+///  to the plain (unsafe to share) operations.
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return State of the bit before it was set
+///
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically clears requested bit in bitmap
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+/// \return State of the bit before it was cleared
+///
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically finds a zero bit and sets it (lock-free, compare-and-swap on 64-bit words)
+///  Two racing callers never claim the same bit.
+/// \param bitmap The bitmap
+/// \param start_hint Search starts at the word holding this bit and wraps around
+///  (out of range means 0, use 0 for first fit)
+/// \return The claimed bit, SIZE_MAX on error/bitmap full
+///
+size_t bitmap_find_zero_and_set(bitmap_t *const bitmap, const size_t start_hint);
+
+///
+/// Atomically finds n zero bits and sets them, in one sweep of the bitmap
+///  All or nothing: if there aren't n free bits, the ones it took are cleared again before it returns.
+///  Racing callers never claim the same bit, but may briefly see each other's claims that get undone.
+/// \param bitmap The bitmap
+/// \param n Number of bits to claim
+/// \param bits Gets the claimed bits, in sweep order
+/// \param start_hint Search starts at the word holding this bit and wraps around
+/// \return true if all n bits were claimed, false on error/not enough free bits
+///
+bool bitmap_find_zeros_and_set(bitmap_t *const bitmap, const size_t n, size_t *const bits, const size_t start_hint);
+
+///
+/// Sets a contiguous range of bits, a word at a time
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Clears a contiguous range of bits, a word at a time
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Atomically sets a contiguous range of bits if all of them are clear
+///  Each word is claimed with a compare-and-swap; if any bit is already set, the words
+///  claimed so far are cleared again and nothing changes.
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set, the range must fit in the bitmap
+/// \return true if the range was claimed, false on error/some bit already set
+///
+bool bitmap_test_and_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Atomically clears a contiguous range of bits, a word at a time
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear, the range must fit in the bitmap
+/// \return true if every bit in the range was set before, false on error/some bit already clear
+///
+bool bitmap_test_and_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
 ///
 /// Flips all bits in the bitmap
 /// \param bitmap The bitmap to invert
@@ -66,12 +143,77 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find next set, for walking the set bits without a callback
+///  for (bit = bitmap_next_set(b, 0); bit != SIZE_MAX; bit = bitmap_next_set(b, bit + 1))
+/// \param bitmap The bitmap
+/// \param from The first bit to consider
+/// \return The first one bit address at or after from, SIZE_MAX on error/not found
+///
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Find next zero
+/// \param bitmap The bitmap
+/// \param from The first bit to consider
+/// \return The first zero bit address at or after from, SIZE_MAX on error/not found
+///
+size_t bitmap_next_zero(const bitmap_t *const bitmap, const size_t from);
+
+///
+/// Find a run of zeros
+///  Searches from the hint to the end, then wraps around to the start
+/// \param bitmap The bitmap
+/// \param n The length of the run, must be non-zero
+/// \param start_hint Where to start looking (out of range means 0)
+/// \return The first bit of the run, SIZE_MAX on error/not found
+///
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t n, const size_t start_hint);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
 /// \return the total number of bits that are set in the bitmap
 ///
 size_t bitmap_total_set(const bitmap_t *const bitmap);
+///
+/// Bulk boolean operations, dst = a op b
+///  All three bitmaps must have the same bit count, dst may be a or b.
+///  Bits past the end of dst are left alone. These use SIMD when the CPU has it.
+/// \param dst The bitmap to write the result to
+/// \param a The first operand
+/// \param b The second operand
+/// \return true on success, false on NULL or mismatched sizes
+///
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b);
+
+/// dst = a | b, see bitmap_and
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b);
+
+/// dst = a ^ b, see bitmap_and
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b);
+
+/// dst = a & ~b, see bitmap_and
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b);
+
+///
+/// Count-only bulk operations, the number of bits set in a op b without writing it anywhere
+///  (bitmap_xor_count of two snapshots is the number of blocks that changed)
+/// \param a The first operand
+/// \param b The second operand
+/// \return The number of set bits in the result, SIZE_MAX on NULL or mismatched sizes
+///
+size_t bitmap_and_count(const bitmap_t *const a, const bitmap_t *const b);
+
+/// Bits set in a | b, see bitmap_and_count
+size_t bitmap_or_count(const bitmap_t *const a, const bitmap_t *const b);
+
+/// Bits set in a ^ b, see bitmap_and_count
+size_t bitmap_xor_count(const bitmap_t *const a, const bitmap_t *const b);
+
+/// Bits set in a & ~b, see bitmap_and_count
+size_t bitmap_andnot_count(const bitmap_t *const a, const bitmap_t *const b);
+
 ///
 /// For each loop for all set bits
 ///  (Arguments passed to func are saved across calls)
@@ -81,6 +223,45 @@ size_t bitmap_total_set(const bitmap_t *const bitmap);
 ///
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
 
+///
+/// Batched for each loop for all set bits
+///  Same as bitmap_for_each, but func gets arrays of ascending bit numbers
+///  so there's one indirect call per batch instead of one per bit
+/// \param bitmap The bitmap
+/// \param func The function to apply (bit numbers, how many there are, and arg)
+/// \param args A generic pointer to pass to the called function
+///
+void bitmap_for_each_batch(const bitmap_t *const bitmap, void (*func)(const size_t *, size_t, void *), void *arg);
+
+///
+/// Builds a rank/select index for the bitmap, kept current by every later change
+///  Per-superblock counts (512 bits each) in a Fenwick tree: set/reset pay O(log n),
+///  rank, select and total_set become O(log n) plus one cache line.
+///  Like hierarchical bitmaps, the atomic operations lose their atomicity.
+///  Call bitmap_refresh if the data is changed behind the bitmap's back.
+/// \param bitmap The bitmap
+/// \return true if the index exists now, false on error
+///
+bool bitmap_enable_rank(bitmap_t *const bitmap);
+
+///
+/// Counts the set bits below the given bit (rank)
+///  Linear in the bit number without an index
+/// \param bitmap The bitmap
+/// \param bit The bit to stop at (not included), anything past the end counts the whole map
+/// \return Total set bits in [0, bit), SIZE_MAX on error
+///
+size_t bitmap_rank(const bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Finds the k-th set bit, counting from 0 (select)
+///  Linear in the bitmap size without an index
+/// \param bitmap The bitmap
+/// \param k Which set bit to find
+/// \return The bit address, SIZE_MAX on error/fewer than k + 1 bits set
+///
+size_t bitmap_select(const bitmap_t *const bitmap, const size_t k);
+
 ///
 /// Resets bitmap contents to the desired pattern
 /// (pattern not guarenteed accurate for final bits
@@ -111,6 +292,16 @@ size_t bitmap_get_bytes(const bitmap_t *const bitmap);
 ///
 bitmap_t *bitmap_create(const size_t n_bits);
 
+///
+/// Creates a hierarchical bitmap to contain n bits (zero initialized)
+///  Summary levels record which words are full and which are empty, so ffs and ffz
+///  walk down one word per level instead of scanning the data.
+///  set/reset/flip pay a little extra to keep the summaries current.
+/// \param n_bits
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_create_hierarchical(const size_t n_bits);
+
 ///
 /// Gets pointer to the internal data for exporting
 ///  Be sure to query the bit and byte size if it's unknown
@@ -133,12 +324,31 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 /// Creates a new bitmap using the provided data
 /// Note: This uses the given block of memory
 ///  and does not free this pointer on destruction
+///  The memory is accessed as 64-bit words, so it must be 8-byte aligned
+///  and padded out to a multiple of 8 bytes
 /// \param n_bits The number of bits in the bitmap
 /// \param bitmap_data The data to import
-/// \return New bitmap pointer, NULL on error
+/// \return New bitmap pointer, NULL on error (including misaligned data)
 ///
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
 
+///
+/// Creates a new hierarchical bitmap using the provided data
+///  Same rules as bitmap_overlay, the summaries are built from the data
+///  and owned by the bitmap
+/// \param n_bits The number of bits in the bitmap
+/// \param bitmap_data The data to import
+/// \return New bitmap pointer, NULL on error (including misaligned data)
+///
+bitmap_t *bitmap_overlay_hierarchical(const size_t n_bits, void *const bitmap_data);
+
+///
+/// Rebuilds any summary data after the bitmap's storage was changed behind its back
+///  (an overlaid buffer that was read from disk, for example). Does nothing for flat bitmaps.
+/// \param bitmap The bitmap
+///
+void bitmap_refresh(bitmap_t *const bitmap);
+
 ///
 /// Destructs and destroys bitmap object
 /// \param bitmap The bitmap
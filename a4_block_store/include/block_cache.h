@@ -0,0 +1,122 @@
+#ifndef BLOCK_CACHE_H__
+#define BLOCK_CACHE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct block_cache block_cache_t;
+
+// A fixed number of in-memory frames in front of a run of equal-sized blocks in a file
+// Replacement is CLOCK: every hit sets the frame's reference bit, and the hand clears bits until it
+//  finds a frame that wasn't touched since its last pass. Dirty frames are written back when they're
+//  evicted or flushed, never before.
+// Frames are found through an open addressed hash table, so lookups don't depend on the file size.
+// Blocks can also be prefetched, they're read in unreferenced so unused ones are evicted first.
+// Frame pointers are only good while the cache is locked, every call but create/destroy/flush/stats/
+//  prefetch expects the caller to hold the lock.
+
+// Counters, from block_cache_get_stats
+typedef struct {
+    uint64_t hits;          // Lookups that found the block in a frame
+    uint64_t misses;        // Lookups that had to read the block in
+    uint64_t evictions;     // Frames taken from another block
+    uint64_t writebacks;    // Dirty frames written to the file, on eviction or flush
+    uint64_t prefetches;    // Blocks read in by block_cache_prefetch
+    uint64_t prefetch_hits; // Lookups that found a prefetched block, the first time it was asked for
+} block_cache_stats_t;
+
+///
+/// Creates a cache over blocks [0, block_count) of a file, block k lives at base + k * block_size
+/// \param fd The file, the cache doesn't own or close it
+/// \param block_size Bytes per block
+/// \param block_count Number of blocks in the file past base
+/// \param base Byte offset of block 0
+/// \param capacity Number of frames, non-zero, no more than block_count are used
+/// \return New cache, NULL on error
+///
+block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t block_count, const off_t base,
+                                  const size_t capacity);
+
+///
+/// Locks the cache, frames stay put until it's unlocked
+/// \param cache The cache
+///
+void block_cache_lock(block_cache_t *const cache);
+
+///
+/// Unlocks the cache
+/// \param cache The cache
+///
+void block_cache_unlock(block_cache_t *const cache);
+
+///
+/// Gets the frame holding a block, reading it in (and evicting another) if it isn't cached
+///  The cache must be locked
+/// \param cache The cache
+/// \param block The block
+/// \param dirty Marks the frame for write-back, pass true if the caller is going to change it
+/// \return The block's data, NULL on error (bad block, or the file couldn't be read or written)
+///
+uint8_t *block_cache_frame(block_cache_t *const cache, const size_t block, const bool dirty);
+
+///
+/// Gets a frame for a block the caller is about to overwrite in full, like block_cache_frame but a miss
+///  doesn't read the block in, since every byte of it is going to be replaced
+///  The cache must be locked, and the caller must fill the whole frame before unlocking it
+/// \param cache The cache
+/// \param block The block
+/// \return The frame, marked for write-back, NULL on error (bad block, or the evicted block couldn't be written)
+///
+uint8_t *block_cache_frame_overwrite(block_cache_t *const cache, const size_t block);
+
+///
+/// Reads a block in ahead of time, if it isn't already cached
+///  The cache must not be locked, it's only held around the lookup and the insert and not the read
+///  Only one thread may prefetch at a time
+/// \param cache The cache
+/// \param block The block
+/// \return true if the block is cached now, false on error or if it lost a race with a write and was dropped
+///
+bool block_cache_prefetch(block_cache_t *const cache, const size_t block);
+
+///
+/// Writes every dirty frame back to the file, they stay cached
+/// \param cache The cache
+/// \return true if everything was written, false on error
+///
+bool block_cache_flush(block_cache_t *const cache);
+
+///
+/// Gets the number of frames, after clamping
+/// \param cache The cache
+/// \return The frame count, 0 on error
+///
+size_t block_cache_get_capacity(const block_cache_t *const cache);
+
+///
+/// Gets the hit/miss/eviction counters
+/// \param cache The cache
+/// \param stats Gets the counters
+/// \return true on success, false on error
+///
+bool block_cache_get_stats(block_cache_t *const cache, block_cache_stats_t *const stats);
+
+///
+/// Writes back whatever's dirty, then destructs and destroys the cache
+/// \param cache The cache
+/// \return true if the write-back worked (it's destroyed either way), false on error
+///
+bool block_cache_destroy(block_cache_t *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
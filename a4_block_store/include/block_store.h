@@ -5,8 +5,10 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 // Declaring the struct but not implementing in the header allows us to prevent users
 //  from using the object directly and monkeying with the contents
@@ -20,6 +22,80 @@ typedef struct block_store block_store_t;
 ///
 block_store_t *block_store_create();
 
+///
+/// This creates a new BS device with the given geometry, ready to go
+/// The FBM takes as many leading blocks as it needs, the rest are user-addressable
+/// \param block_size Bytes per block, a power of two from 64 to 1 MiB
+/// \param block_count Total blocks on the device, FBM included, up to 2^32
+/// \return Pointer to a new block storage device, NULL on error (including bad geometry)
+///
+block_store_t *block_store_create_ex(const size_t block_size, const size_t block_count);
+
+// Flags for block_store_open, or them together
+typedef enum {
+    BLOCK_STORE_OPEN_CREATE = 0x01,   // Create the file if it doesn't exist, as an empty device
+    BLOCK_STORE_OPEN_TRUNCATE = 0x02, // Throw away what's in the file and start with an empty device
+} BLOCK_STORE_OPEN_FLAGS;
+
+///
+/// Opens a BS device stored in the given file, mapping the file into memory
+/// Nothing is read up front, blocks are paged in as they're touched and changes go straight to the file
+/// \param path The file holding the device
+/// \param flags BLOCK_STORE_OPEN_* flags
+/// \return Pointer to the BS device, NULL on error (including a file that's the wrong size)
+///
+block_store_t *block_store_open(const char *const path, const int flags);
+
+///
+/// Opens a BS device with the given geometry stored in the given file, mapping the file into memory
+/// \param path The file holding the device
+/// \param flags BLOCK_STORE_OPEN_* flags
+/// \param block_size Bytes per block, as given to block_store_create_ex
+/// \param block_count Total blocks on the device, as given to block_store_create_ex
+/// \return Pointer to the BS device, NULL on error (including a file that's the wrong size)
+///
+block_store_t *block_store_open_ex(const char *const path, const int flags, const size_t block_size, const size_t block_count);
+
+///
+/// Opens a BS device with the given geometry stored in the given file, keeping only the FBM and a fixed-size
+///  cache of blocks in memory, so the device can be much bigger than memory
+/// The cache uses CLOCK replacement and writes dirty blocks back when they're evicted, or on sync and destroy
+///  Working sets that fit in the cache run at memory speed, see block_store_get_cache_stats
+///  Borrowing isn't supported (the block could be evicted), and neither are optimistic reads
+/// \param path The file holding the device
+/// \param flags BLOCK_STORE_OPEN_* flags
+/// \param block_size Bytes per block, as given to block_store_create_ex
+/// \param block_count Total blocks on the device, as given to block_store_create_ex
+/// \param cache_blocks How many blocks the cache holds, non-zero
+/// \return Pointer to the BS device, NULL on error (including a file that's the wrong size)
+///
+block_store_t *block_store_open_cached(const char *const path, const int flags, const size_t block_size, const size_t block_count, const size_t cache_blocks);
+
+// Block cache counters, from block_store_get_cache_stats
+typedef struct {
+    uint64_t hits;          // Reads and writes that found the block cached
+    uint64_t misses;        // Reads and writes that had to read the block in from the file
+    uint64_t evictions;     // Cached blocks dropped to make room
+    uint64_t writebacks;    // Dirty blocks written to the file, on eviction, sync or destroy
+    uint64_t prefetched;    // Blocks readahead read in before they were asked for
+    uint64_t prefetch_hits; // Reads that found a block readahead had read in
+} block_store_cache_stats_t;
+
+///
+/// Gets a cached device's block cache counters
+/// \param bs BS device, opened with block_store_open_cached
+/// \param stats Gets the hit, miss, eviction and write-back counts
+/// \return true on success, false on error or if the device has no block cache
+///
+bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats);
+
+///
+/// Flushes a file-backed BS device's changes to its file, blocking until they're written
+/// \param bs BS device
+/// \return true if everything made it to the file, false on error or if the device isn't file-backed
+///
+bool block_store_sync(block_store_t *const bs);
+
 ///
 /// Destroys the provided block storage device
 /// This is an idempotent operation, so there is no return value
@@ -29,6 +105,7 @@ void block_store_destroy(block_store_t *const bs);
 
 ///
 /// Searches for a free block, marks it as in use, and returns the block's id
+///  which free block depends on the device's policy, see block_store_set_policy
 /// \param bs BS device
 /// \return Allocated block's id, SIZE_MAX on error
 ///
@@ -49,6 +126,146 @@ bool block_store_request(block_store_t *const bs, const size_t block_id);
 ///
 void block_store_release(block_store_t *const bs, const size_t block_id);
 
+///
+/// Allocates n blocks in one sweep of the FBM, all or nothing
+/// \param bs BS device
+/// \param n Number of blocks to allocate
+/// \param out_ids Gets the allocated block ids, in ascending order
+/// \return true if all n were allocated, false on error or if there aren't n free blocks (nothing is allocated then)
+///
+bool block_store_allocate_n(block_store_t *const bs, const size_t n, size_t *const out_ids);
+
+///
+/// Frees many blocks at once, invalid ids are skipped
+/// \param bs BS device
+/// \param block_ids The blocks to free
+/// \param n Number of block ids
+///
+void block_store_release_n(block_store_t *const bs, const size_t *const block_ids, const size_t n);
+
+// Allocation policies, for block_store_set_policy
+typedef enum {
+    BLOCK_STORE_FIRST_FIT = 0, // The lowest free run that's big enough, quick and keeps the front of the device packed
+    BLOCK_STORE_BEST_FIT = 1,  // The smallest free run that's big enough, scans every run but leaves big runs whole
+    BLOCK_STORE_NEXT_FIT = 2,  // The first free run that's big enough after the last allocation, wrapping around
+    BLOCK_STORE_WORST_FIT = 3, // The biggest free run, scans every run and leaves the biggest leftovers
+} BLOCK_STORE_POLICY;
+
+// Free space fragmentation, from block_store_fragmentation_stats
+typedef struct {
+    size_t free_blocks;       // Total free blocks
+    size_t free_runs;         // Number of maximal runs of free blocks
+    size_t largest_free_run;  // Length of the biggest one, the largest extent that can be allocated
+    size_t run_histogram[33]; // run_histogram[k] counts free runs of 2^k to 2^(k+1) - 1 blocks
+} block_store_fragmentation_t;
+
+///
+/// Picks how block_store_allocate and block_store_allocate_extent choose among free runs
+///  (block_store_allocate_n sweeps from the front, or from the cursor for next fit)
+/// \param bs BS device
+/// \param policy One of the BLOCK_STORE_*_FIT policies, first fit is the default
+/// \return true if the policy was set, false on error
+///
+bool block_store_set_policy(block_store_t *const bs, const BLOCK_STORE_POLICY policy);
+
+///
+/// Allocates count physically adjacent blocks, chosen by the device's policy
+/// \param bs BS device
+/// \param count Number of blocks, non-zero
+/// \param first_id Gets the first block id of the extent, the rest follow it
+/// \return true if the extent was allocated, false on error or if there's no free run that long
+///
+bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const first_id);
+
+///
+/// Frees count blocks starting at first_id
+/// \param bs BS device
+/// \param first_id The first block of the extent
+/// \param count Number of blocks, the extent must fit on the device
+///
+void block_store_release_extent(block_store_t *const bs, const size_t first_id, const size_t count);
+
+///
+/// Switches the device to buddy allocation, for callers that allocate power-of-two extents and free them in bulk
+///  block_store_allocate_extent then hands out 2^k aligned blocks (rounding count up and giving the tail back),
+///  release merges freed buddies back together, and the policy is ignored
+///  The buddy index is rebuilt from the FBM, which stays the only thing that's persisted
+///  Call it before sharing the device between threads, or again to rebuild the index
+/// \param bs BS device
+/// \param max_order Biggest buddy block is 2^max_order blocks, at most 32, clamped to the device
+/// \return true if buddy mode is on, false on error
+///
+bool block_store_enable_buddy(block_store_t *const bs, const size_t max_order);
+
+///
+/// Puts a per-thread cache (magazine) of free blocks in front of the FBM
+///  block_store_allocate pops from the calling thread's magazine, refilling it with magazine_size / 2 blocks in one
+///  FBM sweep, and block_store_release pushes onto it, spilling the older half back when it's full
+///  Cached blocks are set in the FBM but count as free (fragmentation stats see them as used),
+///  block_store_request can still take them, and sync, serialize and destroy give them back first
+///  so the FBM that's persisted is exact
+///  Call it before sharing the device between threads, it can't be combined with buddy mode
+/// \param bs BS device
+/// \param magazine_size Blocks each thread's magazine holds, non-zero
+/// \return true if the caches are on, false on error
+///
+bool block_store_enable_caches(block_store_t *const bs, const size_t magazine_size);
+
+///
+/// Gives every thread's cached blocks back to the FBM, so it says exactly which blocks are in use
+///  sync, serialize and destroy do this themselves
+/// \param bs BS device
+///
+void block_store_flush_caches(block_store_t *const bs);
+
+///
+/// Makes the device safe to share between threads, with the block ids split into shards that each have a
+///  reader-writer lock over their slice of the FBM
+///  Reads of blocks hold their shard's lock shared, so reads proceed in parallel, while writes and releases hold
+///  it exclusive (readv/writev, release_n and extents lock every shard they touch)
+///  Syncs, serializes and flushes only read the device, so they hold every shard shared, waiting out writers
+///  Allocation is lock-free on the FBM, each thread starts looking in its own shard (the policy only applies to extents)
+///  Call it before sharing the device, it can't be combined with buddy mode or the magazine caches
+/// \param bs BS device
+/// \param shards Number of shards, non-zero, fewer are used if the device is too small (each covers at least 64 blocks)
+/// \return true if the device is sharded, false on error
+///
+bool block_store_enable_sharding(block_store_t *const bs, const size_t shards);
+
+///
+/// Turns on optimistic reads: block_store_read and block_store_pread take no lock at all, they copy the block and
+///  retry if a write or release of it happened meanwhile, which each group of group_blocks blocks tracks with a
+///  sequence counter
+///  Writes (write, pwrite, writev) and releases bump the sequence, writes to the same group wait on each other
+///  Writes through block_store_borrow_mut pointers aren't seen, and readv still takes the shard locks
+///  Works with or without sharding, call it before sharing the device between threads
+/// \param bs BS device
+/// \param group_blocks Blocks per sequence counter, non-zero, 1 gives every block its own
+/// \return true if optimistic reads are on, false on error
+///
+bool block_store_enable_seqlock(block_store_t *const bs, const size_t group_blocks);
+
+///
+/// Turns on readahead for a file-backed BS device: reads (read, pread, readv) are watched for ascending
+///  sequential or strided patterns, a few streams at a time, and the blocks a stream is about to read are
+///  fetched while it's still busy with the ones before them
+///  Windows start at a few blocks and double each time the reader catches up, up to max_window
+///  Cached devices get a thread that reads the windows into the block cache (max_window is held to half the
+///  cache), mapped devices ask the kernel to page them in
+/// \param bs BS device, opened with block_store_open, block_store_open_ex or block_store_open_cached
+/// \param max_window Largest window in blocks, at least 4
+/// \return true if readahead is on, false on error or if the device isn't file-backed
+///
+bool block_store_enable_readahead(block_store_t *const bs, const size_t max_window);
+
+///
+/// Measures how fragmented the free space is
+/// \param bs BS device
+/// \param stats Gets the free block count, the free runs, and their size histogram
+/// \return true on success, false on error
+///
+bool block_store_fragmentation_stats(const block_store_t *const bs, block_store_fragmentation_t *const stats);
+
 ///
 /// Counts the number of blocks marked as in use
 /// \param bs BS device
@@ -70,6 +287,21 @@ size_t block_store_get_free_blocks(const block_store_t *const bs);
 ///
 size_t block_store_get_total_blocks();
 
+///
+/// Returns the number of user-addressable blocks on this device
+///  (the device's block count minus the blocks the FBM takes)
+/// \param bs BS device
+/// \return Total blocks, 0 on error
+///
+size_t block_store_get_block_count(const block_store_t *const bs);
+
+///
+/// Returns the size of this device's blocks
+/// \param bs BS device
+/// \return Bytes per block, 0 on error
+///
+size_t block_store_get_block_size(const block_store_t *const bs);
+
 ///
 /// Reads data from the specified block and writes it to the designated buffer
 /// \param bs BS device
@@ -88,13 +320,111 @@ size_t block_store_read(const block_store_t *const bs, const size_t block_id, vo
 ///
 size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
+///
+/// Reads part of the specified block into the designated buffer
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param offset Where in the block to start
+/// \param len Number of bytes to read, offset + len can't go past the end of the block
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_pread(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer);
+
+///
+/// Writes part of the specified block from the designated buffer, the rest of the block is left alone
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param offset Where in the block to start
+/// \param len Number of bytes to write, offset + len can't go past the end of the block
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_pwrite(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer);
+
+///
+/// Gets a pointer straight into the specified block, no copy
+/// The pointer is good until the block is released or the device is destroyed
+///  pair every borrow with block_store_unborrow, debug builds refuse to release a borrowed block
+/// \param bs BS device
+/// \param block_id The block to borrow
+/// \return Pointer to the block's data, NULL on error (including blocks not in use)
+///
+const void *block_store_borrow(const block_store_t *const bs, const size_t block_id);
+
+///
+/// Gets a writable pointer straight into the specified block, no copy
+/// Same rules as block_store_borrow
+/// \param bs BS device
+/// \param block_id The block to borrow
+/// \return Pointer to the block's data, NULL on error (including blocks not in use)
+///
+void *block_store_borrow_mut(block_store_t *const bs, const size_t block_id);
+
+///
+/// Hands back a pointer from block_store_borrow or block_store_borrow_mut
+/// \param bs BS device
+/// \param block_id The block that was borrowed
+///
+void block_store_unborrow(const block_store_t *const bs, const size_t block_id);
+
+///
+/// Reads many blocks into a list of buffers in one call
+/// The buffers are treated as one flat buffer that block_ids[k]'s data fills at offset k * block size,
+///  runs of consecutive ids that land in the same buffer are copied in one go
+/// \param bs BS device
+/// \param block_ids Source block ids
+/// \param count Number of block ids
+/// \param iov The buffers to write to, they must hold count blocks between them
+/// \param iovcnt Number of buffers
+/// \param status Optional, gets the bytes read for each block id, 0 for ids that are invalid or not in use
+/// \return Total bytes read, 0 on error
+///
+size_t block_store_readv(const block_store_t *const bs, const size_t *const block_ids, const size_t count, const struct iovec *const iov, const size_t iovcnt, size_t *const status);
+
+///
+/// Writes many blocks from a list of buffers in one call
+/// The buffers are treated as one flat buffer that block_ids[k]'s data comes from at offset k * block size,
+///  runs of consecutive ids that come from the same buffer are copied in one go
+/// \param bs BS device
+/// \param block_ids Destination block ids
+/// \param count Number of block ids
+/// \param iov The buffers to read from, they must hold count blocks between them
+/// \param iovcnt Number of buffers
+/// \param status Optional, gets the bytes written for each block id, 0 for ids that are invalid or not in use
+/// \return Total bytes written, 0 on error
+///
+size_t block_store_writev(block_store_t *const bs, const size_t *const block_ids, const size_t count, const struct iovec *const iov, const size_t iovcnt, size_t *const status);
+
 ///
 /// Imports BS device from the given file - for grads/bonus
+/// Images from before configurable geometry used a different layout and load with every block shifted by one,
+///  use block_store_deserialize_legacy for those
 /// \param filename The file to load
 /// \return Pointer to new BS device, NULL on error
 ///
 block_store_t *block_store_deserialize(const char *const filename);
 
+///
+/// Imports a 256x256 BS device from an image in the layout used before configurable geometry, where block id k
+///  was physical block k (so block 0 shared its first bytes with the FBM) instead of k + 1
+/// The device comes back in the current layout, block_store_serialize writes it out that way
+///  The old layout's physical block 255 had no id and is dropped
+/// \param filename The file to load
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize_legacy(const char *const filename);
+
+///
+/// Imports BS device with the given geometry from the given file
+/// The file must hold exactly the whole device, as block_store_serialize writes it
+/// \param filename The file to load
+/// \param block_size Bytes per block, as given to block_store_create_ex
+/// \param block_count Total blocks on the device, as given to block_store_create_ex
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize_ex(const char *const filename, const size_t block_size, const size_t block_count);
+
 ///
 /// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
 /// \param bs BS device
@@ -103,6 +433,20 @@ block_store_t *block_store_deserialize(const char *const filename);
 ///
 size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+///
+/// Writes what's changed since the last flush to the given file, so a checkpoint costs about as much as the churn
+///  Only blocks written since then and the FBM blocks that changed go out, with runs of them written in one go
+///  That only works on the image the last flush wrote (or the device was deserialized from), any other file,
+///  or one that's the wrong size, gets the whole device like block_store_serialize
+///  Writes through block_store_borrow_mut pointers are only seen if the block was borrowed since the last flush
+///  Flushes run one at a time under the device's flush lock, and sharded they also hold every shard shared,
+///  so reads carry on but writers wait until it's done
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_flush(block_store_t *const bs, const char *const filename);
+
 
 #ifdef __cplusplus
 }
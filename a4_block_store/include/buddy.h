@@ -0,0 +1,78 @@
+#ifndef BUDDY_H__
+#define BUDDY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "bitmap.h"
+
+typedef struct buddy buddy_t;
+
+// A buddy-system index over a range of blocks
+// Free space is kept as aligned power-of-two blocks, one set per order, and two free buddies are
+//  always merged. Each per-order set is a hierarchical bitmap, so allocating (find + split) and
+//  freeing (merge) are O(max order) bitmap updates, each O(log n).
+// It only tracks free space. The caller keeps whatever the real allocation map is (the block
+//  store's FBM) and can always rebuild the index from it with buddy_create.
+// Not thread safe, the caller does the locking.
+
+// Largest order supported, 2^32 blocks
+#define BUDDY_MAX_ORDER 32
+
+///
+/// Builds a buddy index from an allocation map
+/// \param fbm The map, set bits are in use and zero runs become free blocks
+/// \param max_order Largest block to hand out is 2^max_order, clamped to the map size
+/// \return New buddy index, NULL on error
+///
+buddy_t *buddy_create(const bitmap_t *const fbm, const size_t max_order);
+
+///
+/// Gets the largest order the index hands out, after clamping
+/// \param buddy The index
+/// \return The max order
+///
+size_t buddy_get_max_order(const buddy_t *const buddy);
+
+///
+/// Takes a free block of 2^order blocks, splitting a bigger one if needed
+/// \param buddy The index
+/// \param order The block order
+/// \return The first block, aligned to 2^order, SIZE_MAX on error/nothing free that big
+///
+size_t buddy_allocate(buddy_t *const buddy, const size_t order);
+
+///
+/// Takes a specific range out of the free space, splitting the blocks around it
+/// \param buddy The index
+/// \param first The first block
+/// \param count The number of blocks
+/// \return true if the range was all free and is now taken, false on error/partly in use (nothing changes)
+///
+bool buddy_claim(buddy_t *const buddy, const size_t first, const size_t count);
+
+///
+/// Returns a range to the free space, merging buddies as far as they go
+///  The range must be in use, giving back free blocks corrupts the index
+/// \param buddy The index
+/// \param first The first block
+/// \param count The number of blocks
+///
+void buddy_release(buddy_t *const buddy, const size_t first, const size_t count);
+
+///
+/// Destructs and destroys the index
+/// \param buddy The index
+///
+void buddy_destroy(buddy_t *buddy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
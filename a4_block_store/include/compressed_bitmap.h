@@ -0,0 +1,148 @@
+#ifndef COMPRESSED_BITMAP_H__
+#define COMPRESSED_BITMAP_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "bitmap.h"
+
+typedef struct cbitmap cbitmap_t;
+
+// A compressed bitmap, roaring style
+// The bits are split into 2^16 bit chunks and each chunk picks whichever container is smallest:
+//  a sorted array of set bits (sparse chunks), a list of runs (almost full or clustered chunks),
+//  or a plain 8KiB dense bitmap (everything else).
+// Maps that are nearly all zeros or nearly all ones take a tiny fraction of bitmap_t's memory.
+
+// Same deal as bitmap.h: bit requests outside the bitmap and NULL pointers are on you.
+
+///
+/// Sets requested bit in bitmap
+/// \param cbitmap The bitmap
+/// \param bit The bit to set
+/// \return false if a container couldn't grow (bitmap unchanged), true otherwise
+///
+bool cbitmap_set(cbitmap_t *const cbitmap, const size_t bit);
+
+///
+/// Clears requested bit in bitmap
+/// \param cbitmap The bitmap
+/// \param bit The bit to clear
+/// \return false if a container couldn't grow (bitmap unchanged), true otherwise
+///
+bool cbitmap_reset(cbitmap_t *const cbitmap, const size_t bit);
+
+///
+/// Returns bit in bitmap
+/// \param cbitmap The bitmap
+/// \param bit The bit to query
+/// \return State of requested bit
+///
+bool cbitmap_test(const cbitmap_t *const cbitmap, const size_t bit);
+
+///
+/// Find first set
+/// \param cbitmap The bitmap
+/// \return The first one bit address, SIZE_MAX on error/not found
+///
+size_t cbitmap_ffs(const cbitmap_t *const cbitmap);
+
+///
+/// Find first zero
+/// \param cbitmap The bitmap
+/// \return The first zero bit address, SIZE_MAX on error/not found
+///
+size_t cbitmap_ffz(const cbitmap_t *const cbitmap);
+
+///
+/// Count all bits set
+/// \param cbitmap the bitmap
+/// \return the total number of bits that are set in the bitmap
+///
+size_t cbitmap_total_set(const cbitmap_t *const cbitmap);
+
+///
+/// Gets total number of bits in bitmap
+/// \param cbitmap The bitmap
+/// \return The number of bits in the bitmap
+///
+size_t cbitmap_get_bits(const cbitmap_t *const cbitmap);
+
+///
+/// Gets the heap memory the bitmap is using, containers and bookkeeping included
+/// \param cbitmap The bitmap
+/// \return Bytes in use
+///
+size_t cbitmap_memory_usage(const cbitmap_t *const cbitmap);
+
+///
+/// Re-picks the smallest container for every chunk
+///  set/reset only convert when a container outgrows itself, so a map that filled up
+///  one bit at a time should be optimized before it's kept around or serialized
+/// \param cbitmap The bitmap
+///
+void cbitmap_optimize(cbitmap_t *const cbitmap);
+
+///
+/// Creates a compressed bitmap to contain n bits (zero initialized)
+/// \param n_bits
+/// \return New bitmap pointer, NULL on error
+///
+cbitmap_t *cbitmap_create(const size_t n_bits);
+
+///
+/// Creates a compressed copy of a bitmap, with every chunk in its smallest container
+/// \param bitmap The bitmap to copy
+/// \return New bitmap pointer, NULL on error
+///
+cbitmap_t *cbitmap_from_bitmap(const bitmap_t *const bitmap);
+
+///
+/// Creates a plain bitmap with the same contents
+/// \param cbitmap The bitmap to copy
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *cbitmap_to_bitmap(const cbitmap_t *const cbitmap);
+
+///
+/// Gets the number of bytes cbitmap_serialize will need
+/// \param cbitmap The bitmap
+/// \return Serialized size in bytes, 0 on error
+///
+size_t cbitmap_serialized_size(const cbitmap_t *const cbitmap);
+
+///
+/// Writes the bitmap in the compact format: a header, then per chunk a type byte,
+///  an entry count, and the container's entries (host byte order)
+/// \param cbitmap The bitmap
+/// \param buffer Where to write
+/// \param size Size of buffer
+/// \return Number of bytes written, 0 on error (including a buffer that's too small)
+///
+size_t cbitmap_serialize(const cbitmap_t *const cbitmap, void *const buffer, const size_t size);
+
+///
+/// Creates a bitmap from data written by cbitmap_serialize
+/// \param buffer The serialized data
+/// \param size Size of buffer
+/// \return New bitmap pointer, NULL on error (including malformed data)
+///
+cbitmap_t *cbitmap_deserialize(const void *const buffer, const size_t size);
+
+///
+/// Destructs and destroys bitmap object
+/// \param cbitmap The bitmap
+///
+void cbitmap_destroy(cbitmap_t *cbitmap);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef READAHEAD_H__
+#define READAHEAD_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct readahead readahead_t;
+
+// Spots sequential and strided reads and says what to fetch before it's asked for
+// A handful of streams are tracked at once, so interleaved scans each keep their own pattern. A read
+//  that lands one stride past a stream's last read continues it, one a short way past starts a new
+//  stride for it, and anything else takes over the least recently used stream.
+// Like the kernel's readahead, a stream's first window is small and each one after it is twice the
+//  size, up to a cap. The next window goes out when the reader gets to the first block of the last
+//  one, so there's always a window's worth in flight ahead of it.
+// It only decides, fetching is up to the caller. Not thread safe, the caller does the locking.
+
+// Blocks in a stream's first window
+#define READAHEAD_MIN_WINDOW 4
+// Reads further apart than this are never taken for a stride
+#define READAHEAD_MAX_STRIDE 64
+
+// Blocks first, first + stride, ... first + (count - 1) * stride
+typedef struct {
+    size_t first;
+    size_t stride;
+    size_t count;
+} readahead_window_t;
+
+///
+/// Creates a detector for reads over blocks [0, block_count)
+/// \param block_count Number of blocks, windows never go past the last one
+/// \param streams How many streams to track at once, non-zero
+/// \param max_window Largest window in blocks, at least READAHEAD_MIN_WINDOW
+/// \return New detector, NULL on error
+///
+readahead_t *readahead_create(const size_t block_count, const size_t streams, const size_t max_window);
+
+///
+/// Records a read and works out if a window should be fetched because of it
+/// \param ra The detector
+/// \param block The block read
+/// \param window Gets the blocks to fetch
+/// \return true if window was filled in, false if there's nothing to fetch (or on error)
+///
+bool readahead_access(readahead_t *const ra, const size_t block, readahead_window_t *const window);
+
+///
+/// Destructs and destroys the detector
+/// \param ra The detector
+///
+void readahead_destroy(readahead_t *ra);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,15 +1,66 @@
 #include "bitmap.h"
 #include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86 1
+#endif
  
-// Just the one for now. Indicates we're an overlay and should not free
+// OVERLAY indicates we're an overlay and should not free
+// HIERARCHICAL indicates we keep summary levels over the data for fast searches
+// RANKED indicates we keep per-superblock counts for rank/select
 // (also, make sure that ALL is as wide as ll of the flags)
-typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
+typedef enum { NONE = 0x00, OVERLAY = 0x01, HIERARCHICAL = 0x02, RANKED = 0x04, ALL = 0xFF } BITMAP_FLAGS;
+
+// Anything that has to hear about every word that changes
+#define ACCELERATED (HIERARCHICAL | RANKED)
+
+// The storage array is native 64-bit words. Byte order of the exported data matches the
+// old uint8_t layout (bit n lives in byte n >> 3) on little-endian hosts, which is all we run on.
+typedef uint64_t word_t;
+
+#define WORD_BITS 64
+#define WORD_SHIFT 6
+#define WORD_INDEX(bit) ((bit) >> WORD_SHIFT)
+#define WORD_MASK(bit) ((word_t) 1 << ((bit) & (WORD_BITS - 1)))
+#define ALL_ONES (~(word_t) 0)
+
+// Count trailing zeros, undefined for 0 so check first
+#define CTZ(word) ((size_t) __builtin_ctzll(word))
+
+// Summary levels for hierarchical bitmaps
+// Level 0 has one bit per data word, every level above has one bit per word of the level below,
+// and the top level is a single word. 11 levels covers a 2^64 bit map, we'll never get close.
+#define MAX_LEVELS 11
+
+struct summary {
+    size_t levels;
+    size_t words[MAX_LEVELS];  // Number of words in each level
+    word_t *full[MAX_LEVELS];  // Bit set when the word below has no zeros (padding bits are set)
+    word_t *any[MAX_LEVELS];   // Bit set when the word below has at least one one (padding bits are clear)
+};
+
+// Rank/select index
+// Superblocks are 8 words (one cache line, 512 bits). Their counts live in a Fenwick tree,
+// so a set/reset updates O(log n) counters and rank/select find the superblock in O(log n),
+// then finish inside one cache line. Plain cumulative counts would make rank O(1) but every
+// update O(n), which is no good for an allocator.
+#define SUPERBLOCK_SHIFT 3
+#define SUPERBLOCK_WORDS (1 << SUPERBLOCK_SHIFT)
+
+struct rank_index {
+    size_t superblocks;
+    uint64_t *tree;  // 1-indexed Fenwick tree over superblock counts
+};
 
 struct bitmap {
     unsigned leftover_bits;  // Packing will increase this to an int anyway
     BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
-    uint8_t *data;
-    size_t bit_count, byte_count;
+    word_t *data;
+    size_t bit_count, byte_count, word_count;
+    word_t tail_mask;  // Bits of the last word that are actually in the bitmap
+    struct summary *summary;  // NULL unless HIERARCHICAL
+    struct rank_index *rank;  // NULL unless RANKED
 };
 
 
@@ -18,21 +69,8 @@ struct bitmap {
 // #define FLAG_SET(bitmap, flag) bitmap->flags |= flag
 // #define FLAG_UNSET(bitmap, flag) bitmap->flags &= ~flag
 
-// lookup instead of always shifting bits. Should be faster? Confirmed: 10% faster
-// Also, using native int width because it should be faster as well? - Negligible/indeterminate
-//  Won't help until bitmap uses native width for the array
-static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
-
-// Mask for all bits at index i and lower
-static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF};
-
-// Inverted mask
-static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
-
-// Way more testing than I should waste my time on suggested uint8_t was faster
-// but it may still be negligible/indeterminate.
-// Since the data store is uint8_t, we already get punished for our bad alignment
-// so this doesn't really matter until everything gets moved to generic int
+// The old byte-wide mask lookups were 10% faster than shifting uint8_t, but a single shift
+// on a native word beats both, and it lets the searches below skip 64 bits at a time.
 
 // Total bits set in the given byte in a handy lookup table
 // Macros, man...
@@ -56,47 +94,319 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
     }
 */
 
+// SIMD kernels over whole words. The best set the CPU supports gets picked the first time
+// one is needed, and the table stays around as the fallback for everything else.
+
+// Bulk boolean operations, ANDNOT is a & ~b
+typedef enum { OP_AND, OP_OR, OP_XOR, OP_ANDNOT } BULK_OP;
+
+struct kernels {
+    size_t (*popcount)(const word_t *words, const size_t count);
+    void (*bulk)(word_t *dst, const word_t *a, const word_t *b, const size_t count, const BULK_OP op);
+    size_t (*bulk_count)(const word_t *a, const word_t *b, const size_t count, const BULK_OP op);
+};
+
+static inline word_t bulk_word(const BULK_OP op, const word_t a, const word_t b) {
+    switch (op) {
+        case OP_AND:
+            return a & b;
+        case OP_OR:
+            return a | b;
+        case OP_XOR:
+            return a ^ b;
+        default:
+            return a & ~b;
+    }
+}
+
+static inline size_t table_count_word(const word_t word) {
+    const uint8_t *bytes = (const uint8_t *) &word;
+    size_t total = 0;
+    for (size_t idx = 0; idx < sizeof(word_t); ++idx) {
+        total += bit_totals[bytes[idx]];
+    }
+    return total;
+}
+
+static size_t popcount_table(const word_t *words, const size_t count) {
+    size_t total = 0;
+    for (size_t idx = 0; idx < count; ++idx) {
+        total += table_count_word(words[idx]);
+    }
+    return total;
+}
+
+// The compiler unswitches the op and vectorizes this as far as the baseline ISA lets it
+static void bulk_scalar(word_t *dst, const word_t *a, const word_t *b, const size_t count, const BULK_OP op) {
+    for (size_t idx = 0; idx < count; ++idx) {
+        dst[idx] = bulk_word(op, a[idx], b[idx]);
+    }
+}
+
+static size_t bulk_count_table(const word_t *a, const word_t *b, const size_t count, const BULK_OP op) {
+    size_t total = 0;
+    for (size_t idx = 0; idx < count; ++idx) {
+        total += table_count_word(bulk_word(op, a[idx], b[idx]));
+    }
+    return total;
+}
+
+static const struct kernels table_kernels = {popcount_table, bulk_scalar, bulk_count_table};
+
+#ifdef BITMAP_X86
+__attribute__((target("popcnt"))) static size_t popcount_popcnt(const word_t *words, const size_t count) {
+    size_t total = 0;
+    for (size_t idx = 0; idx < count; ++idx) {
+        total += (size_t) __builtin_popcountll(words[idx]);
+    }
+    return total;
+}
+
+__attribute__((target("popcnt"))) static size_t bulk_count_popcnt(const word_t *a, const word_t *b, const size_t count,
+                                                                  const BULK_OP op) {
+    size_t total = 0;
+    for (size_t idx = 0; idx < count; ++idx) {
+        total += (size_t) __builtin_popcountll(bulk_word(op, a[idx], b[idx]));
+    }
+    return total;
+}
+
+static const struct kernels popcnt_kernels = {popcount_popcnt, bulk_scalar, bulk_count_popcnt};
+
+// Nibble lookup with pshufb (Mula), bit totals per 64-bit lane via psadbw
+__attribute__((target("avx2"))) static inline __m256i popcount_lanes_avx2(const __m256i vec) {
+    const __m256i nibble_totals = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    const __m256i lo  = _mm256_and_si256(vec, low_nibble);
+    const __m256i hi  = _mm256_and_si256(_mm256_srli_epi16(vec, 4), low_nibble);
+    const __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_totals, lo), _mm256_shuffle_epi8(nibble_totals, hi));
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2"))) static inline size_t sum_lanes_avx2(const __m256i sums) {
+    return (size_t) _mm256_extract_epi64(sums, 0) + (size_t) _mm256_extract_epi64(sums, 1)
+           + (size_t) _mm256_extract_epi64(sums, 2) + (size_t) _mm256_extract_epi64(sums, 3);
+}
+
+__attribute__((target("avx2"))) static inline __m256i bulk_vec_avx2(const BULK_OP op, const __m256i a, const __m256i b) {
+    switch (op) {
+        case OP_AND:
+            return _mm256_and_si256(a, b);
+        case OP_OR:
+            return _mm256_or_si256(a, b);
+        case OP_XOR:
+            return _mm256_xor_si256(a, b);
+        default:
+            return _mm256_andnot_si256(b, a);
+    }
+}
+
+// 4 words per step, leftovers one at a time
+__attribute__((target("avx2,popcnt"))) static size_t popcount_avx2(const word_t *words, const size_t count) {
+    __m256i sums = _mm256_setzero_si256();
+    size_t idx   = 0;
+    for (; idx + 4 <= count; idx += 4) {
+        sums = _mm256_add_epi64(sums, popcount_lanes_avx2(_mm256_loadu_si256((const __m256i *) (words + idx))));
+    }
+    size_t total = sum_lanes_avx2(sums);
+    for (; idx < count; ++idx) {
+        total += (size_t) __builtin_popcountll(words[idx]);
+    }
+    return total;
+}
+
+__attribute__((target("avx2"))) static void bulk_avx2(word_t *dst, const word_t *a, const word_t *b, const size_t count,
+                                                      const BULK_OP op) {
+    size_t idx = 0;
+    for (; idx + 4 <= count; idx += 4) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *) (a + idx));
+        const __m256i vb = _mm256_loadu_si256((const __m256i *) (b + idx));
+        _mm256_storeu_si256((__m256i *) (dst + idx), bulk_vec_avx2(op, va, vb));
+    }
+    for (; idx < count; ++idx) {
+        dst[idx] = bulk_word(op, a[idx], b[idx]);
+    }
+}
+
+__attribute__((target("avx2,popcnt"))) static size_t bulk_count_avx2(const word_t *a, const word_t *b, const size_t count,
+                                                                    const BULK_OP op) {
+    __m256i sums = _mm256_setzero_si256();
+    size_t idx   = 0;
+    for (; idx + 4 <= count; idx += 4) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *) (a + idx));
+        const __m256i vb = _mm256_loadu_si256((const __m256i *) (b + idx));
+        sums = _mm256_add_epi64(sums, popcount_lanes_avx2(bulk_vec_avx2(op, va, vb)));
+    }
+    size_t total = sum_lanes_avx2(sums);
+    for (; idx < count; ++idx) {
+        total += (size_t) __builtin_popcountll(bulk_word(op, a[idx], b[idx]));
+    }
+    return total;
+}
+
+static const struct kernels avx2_kernels = {popcount_avx2, bulk_avx2, bulk_count_avx2};
+#endif
+
+// BITMAP_POPCOUNT=table|popcnt|avx2 in the environment caps the choice, handy for
+// benchmarking against the baseline and for testing the fallbacks on newer machines
+static const struct kernels *kernels_select(void) {
+    const char *cap = getenv("BITMAP_POPCOUNT");
+    if (cap && !strcmp(cap, "table")) {
+        return &table_kernels;
+    }
+#ifdef BITMAP_X86
+    __builtin_cpu_init();
+    const bool allow_avx2 = !cap || !strcmp(cap, "avx2");
+    if (allow_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return &avx2_kernels;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return &popcnt_kernels;
+    }
+#endif
+    return &table_kernels;
+}
+
+// Every thread picks the same kernels, so racing on the first store is harmless
+static const struct kernels *selected_kernels = NULL;
+
+static inline const struct kernels *kernels_get(void) {
+    const struct kernels *selected = __atomic_load_n(&selected_kernels, __ATOMIC_RELAXED);
+    if (!selected) {
+        selected = kernels_select();
+        __atomic_store_n(&selected_kernels, selected, __ATOMIC_RELAXED);
+    }
+    return selected;
+}
+
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Summary maintenance and search, down with the other dragons
+static void summary_update(bitmap_t *const bitmap, const size_t idx, const word_t old, const word_t new_word);
+static void summary_rebuild(bitmap_t *const bitmap);
+
+// Tells every accelerator that word idx went from old to new_word
+static void bitmap_word_changed(bitmap_t *const bitmap, const size_t idx, const word_t old, const word_t new_word);
+// Rebuilds every accelerator from scratch
+static void bitmap_rebuild(bitmap_t *const bitmap);
+static size_t summary_first(const bitmap_t *const bitmap, const bool zero);
+static size_t summary_next(const bitmap_t *const bitmap, const size_t from, const bool zero);
+
+// Rank index maintenance, also with the dragons
+static uint64_t rank_prefix(const struct rank_index *const rank, size_t superblocks);
+
+// Word idx with the bits past the end of the bitmap cleared
+static inline word_t bitmap_word(const bitmap_t *const bitmap, const size_t idx) {
+    return idx == bitmap->word_count - 1 ? bitmap->data[idx] & bitmap->tail_mask : bitmap->data[idx];
+}
+
+// Word idx as candidates for a search: the zero bits, or the set bits, never the padding
+static inline word_t bitmap_candidates(const bitmap_t *const bitmap, const size_t idx, const bool zero) {
+    return zero ? ~bitmap->data[idx] & (idx == bitmap->word_count - 1 ? bitmap->tail_mask : ALL_ONES)
+                : bitmap_word(bitmap, idx);
+}
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    word_t *const word = &bitmap->data[WORD_INDEX(bit)];
+    const word_t old   = *word;
+    *word |= WORD_MASK(bit);
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        bitmap_word_changed(bitmap, WORD_INDEX(bit), old, *word);
+    }
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    word_t *const word = &bitmap->data[WORD_INDEX(bit)];
+    const word_t old   = *word;
+    *word &= ~WORD_MASK(bit);
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        bitmap_word_changed(bitmap, WORD_INDEX(bit), old, *word);
+    }
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) {
-    return bitmap->data[bit >> 3] & mask[bit & 0x07];
+    return bitmap->data[WORD_INDEX(bit)] & WORD_MASK(bit);
 }
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    word_t *const word = &bitmap->data[WORD_INDEX(bit)];
+    const word_t old   = *word;
+    *word ^= WORD_MASK(bit);
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        bitmap_word_changed(bitmap, WORD_INDEX(bit), old, *word);
+    }
 }
 
 void bitmap_invert(bitmap_t *const bitmap) {
-    for (size_t byte = 0; byte < bitmap->byte_count; ++byte) {
-        bitmap->data[byte] = ~bitmap->data[byte];
+    const size_t last = bitmap->word_count - 1;
+    for (size_t idx = 0; idx < last; ++idx) {
+        bitmap->data[idx] = ~bitmap->data[idx];
+    }
+    // Only flip the bytes we own, an overlay may not own the rest of the last word
+    const size_t tail_bytes = bitmap->byte_count & (sizeof(word_t) - 1);
+    bitmap->data[last] ^= tail_bytes ? (((word_t) 1 << (tail_bytes << 3)) - 1) : ALL_ONES;
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        bitmap_rebuild(bitmap);
     }
 }
 
 size_t bitmap_ffs(const bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) {
+        if (FLAG_CHECK(bitmap, HIERARCHICAL)) {
+            return summary_first(bitmap, false);
+        }
+        // Skip whole empty words, then let ctz find the bit
+        for (size_t idx = 0; idx < bitmap->word_count; ++idx) {
+            const word_t word = bitmap_word(bitmap, idx);
+            if (word) {
+                return (idx << WORD_SHIFT) + CTZ(word);
+            }
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
 
 size_t bitmap_ffz(const bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) {
+        if (FLAG_CHECK(bitmap, HIERARCHICAL)) {
+            return summary_first(bitmap, true);
+        }
+        // Same as ffs on the inverted word, masking off the bits past the end
+        for (size_t idx = 0; idx < bitmap->word_count; ++idx) {
+            const word_t word = ~bitmap->data[idx] & (idx == bitmap->word_count - 1 ? bitmap->tail_mask : ALL_ONES);
+            if (word) {
+                return (idx << WORD_SHIFT) + CTZ(word);
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Next zero (or set) bit at or after from, skipping whole words
+static size_t scan_next(const bitmap_t *const bitmap, const size_t from, const bool zero) {
+    size_t idx  = WORD_INDEX(from);
+    word_t word = bitmap_candidates(bitmap, idx, zero) & ~(WORD_MASK(from) - 1);
+    while (!word) {
+        if (++idx == bitmap->word_count) {
+            return SIZE_MAX;
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        word = bitmap_candidates(bitmap, idx, zero);
+    }
+    return (idx << WORD_SHIFT) + CTZ(word);
+}
+
+size_t bitmap_next_set(const bitmap_t *const bitmap, const size_t from) {
+    if (bitmap && from < bitmap->bit_count) {
+        return FLAG_CHECK(bitmap, HIERARCHICAL) ? summary_next(bitmap, from, false) : scan_next(bitmap, from, false);
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_next_zero(const bitmap_t *const bitmap, const size_t from) {
+    if (bitmap && from < bitmap->bit_count) {
+        return FLAG_CHECK(bitmap, HIERARCHICAL) ? summary_next(bitmap, from, true) : scan_next(bitmap, from, true);
     }
     return SIZE_MAX;
 }
@@ -104,34 +414,455 @@ size_t bitmap_ffz(const bitmap_t *const bitmap) {
 size_t bitmap_total_set(const bitmap_t *const bitmap) {
     size_t total = 0;
     if (bitmap) {
-        // If we have leftover, stop a byte early because we have to handle it differently.
-        size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-        for (size_t idx = 0; idx < stop; ++idx) {
-            total += bit_totals[bitmap->data[idx]];
-        }
-        if (bitmap->leftover_bits) {
-            // haha, this is readable
-            // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-            // then feed that to the bit_total lookup so we don't count the bits past our bit total
-            // (which whould be considered undetermined)
-            total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+        if (FLAG_CHECK(bitmap, RANKED)) {
+            // The tree already knows, O(log n)
+            return rank_prefix(bitmap->rank, bitmap->rank->superblocks);
         }
+        const struct kernels *const kernels = kernels_get();
+        // Whole words go to the kernel, the last one gets masked so we don't count
+        // the bits past our bit total (which whould be considered undetermined)
+        const size_t last = bitmap->word_count - 1;
+        const word_t tail = bitmap->data[last] & bitmap->tail_mask;
+        total = kernels->popcount(bitmap->data, last) + kernels->popcount(&tail, 1);
     }
     return total;
 }
 
+// dst = a op b, all the same size. dst may be a or b.
+// Whole words go through the kernel, the last word keeps dst's bits past the end untouched.
+static bool bitmap_bulk(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b, const BULK_OP op) {
+    if (!dst || !a || !b || dst->bit_count != a->bit_count || dst->bit_count != b->bit_count) {
+        return false;
+    }
+    const size_t last = dst->word_count - 1;
+    const word_t tail = bulk_word(op, a->data[last], b->data[last]);
+    kernels_get()->bulk(dst->data, a->data, b->data, last, op);
+    dst->data[last] = (tail & dst->tail_mask) | (dst->data[last] & ~dst->tail_mask);
+    if (FLAG_CHECK(dst, ACCELERATED)) {
+        bitmap_rebuild(dst);
+    }
+    return true;
+}
+
+static size_t bitmap_bulk_count(const bitmap_t *const a, const bitmap_t *const b, const BULK_OP op) {
+    if (!a || !b || a->bit_count != b->bit_count) {
+        return SIZE_MAX;
+    }
+    const struct kernels *const kernels = kernels_get();
+    const size_t last = a->word_count - 1;
+    const word_t tail = bulk_word(op, a->data[last], b->data[last]) & a->tail_mask;
+    return kernels->bulk_count(a->data, b->data, last, op) + kernels->popcount(&tail, 1);
+}
+
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b) {
+    return bitmap_bulk(dst, a, b, OP_AND);
+}
+
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b) {
+    return bitmap_bulk(dst, a, b, OP_OR);
+}
+
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b) {
+    return bitmap_bulk(dst, a, b, OP_XOR);
+}
+
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const a, const bitmap_t *const b) {
+    return bitmap_bulk(dst, a, b, OP_ANDNOT);
+}
+
+size_t bitmap_and_count(const bitmap_t *const a, const bitmap_t *const b) {
+    return bitmap_bulk_count(a, b, OP_AND);
+}
+
+size_t bitmap_or_count(const bitmap_t *const a, const bitmap_t *const b) {
+    return bitmap_bulk_count(a, b, OP_OR);
+}
+
+size_t bitmap_xor_count(const bitmap_t *const a, const bitmap_t *const b) {
+    return bitmap_bulk_count(a, b, OP_XOR);
+}
+
+size_t bitmap_andnot_count(const bitmap_t *const a, const bitmap_t *const b) {
+    return bitmap_bulk_count(a, b, OP_ANDNOT);
+}
+
+// The atomic operations work straight on the data words with the GCC __atomic builtins,
+// so they work on overlays too. Hierarchical summaries and rank counts can't be kept current
+// without a lock, so those bitmaps take the plain path and aren't safe to share.
+
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit) {
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        const bool was_set = bitmap_test(bitmap, bit);
+        bitmap_set(bitmap, bit);
+        return was_set;
+    }
+    return __atomic_fetch_or(&bitmap->data[WORD_INDEX(bit)], WORD_MASK(bit), __ATOMIC_ACQ_REL) & WORD_MASK(bit);
+}
+
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit) {
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        const bool was_set = bitmap_test(bitmap, bit);
+        bitmap_reset(bitmap, bit);
+        return was_set;
+    }
+    return __atomic_fetch_and(&bitmap->data[WORD_INDEX(bit)], ~WORD_MASK(bit), __ATOMIC_ACQ_REL) & WORD_MASK(bit);
+}
+
+size_t bitmap_find_zero_and_set(bitmap_t *const bitmap, const size_t start_hint) {
+    if (bitmap) {
+        if (FLAG_CHECK(bitmap, ACCELERATED)) {
+            const size_t bit = bitmap_ffz(bitmap);
+            if (bit != SIZE_MAX) {
+                bitmap_set(bitmap, bit);
+            }
+            return bit;
+        }
+        // Start at the hint's word and wrap, so threads given different hints stay off each other's cache lines
+        size_t idx = start_hint < bitmap->bit_count ? WORD_INDEX(start_hint) : 0;
+        for (size_t visited = 0; visited < bitmap->word_count; ++visited) {
+            const word_t valid = idx == bitmap->word_count - 1 ? bitmap->tail_mask : ALL_ONES;
+            word_t old         = __atomic_load_n(&bitmap->data[idx], __ATOMIC_RELAXED);
+            word_t free_bits;
+            // A failed CAS reloads old, so we retry against whatever the other thread left us
+            while ((free_bits = ~old & valid)) {
+                const word_t claim = free_bits & -free_bits;
+                if (__atomic_compare_exchange_n(&bitmap->data[idx], &old, old | claim, true, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_RELAXED)) {
+                    return (idx << WORD_SHIFT) + CTZ(claim);
+                }
+            }
+            idx = idx + 1 == bitmap->word_count ? 0 : idx + 1;
+        }
+    }
+    return SIZE_MAX;
+}
+
+bool bitmap_find_zeros_and_set(bitmap_t *const bitmap, const size_t n, size_t *const bits, const size_t start_hint) {
+    if (!bitmap || (n && !bits)) {
+        return false;
+    }
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        if (bitmap->bit_count - bitmap_total_set(bitmap) < n) {
+            return false;
+        }
+        size_t bit = start_hint < bitmap->bit_count ? WORD_INDEX(start_hint) << WORD_SHIFT : 0;
+        for (size_t found = 0; found < n; ++found) {
+            bit = bitmap_next_zero(bitmap, bit);
+            if (bit == SIZE_MAX) {
+                bit = bitmap_next_zero(bitmap, 0);
+            }
+            bitmap_set(bitmap, bit);
+            bits[found] = bit;
+        }
+        return true;
+    }
+    // Same sweep as find_zero_and_set, but each CAS claims as many of the word's free bits as we still need
+    size_t found = 0;
+    size_t idx   = start_hint < bitmap->bit_count ? WORD_INDEX(start_hint) : 0;
+    for (size_t visited = 0; found < n && visited < bitmap->word_count; ++visited) {
+        const word_t valid = idx == bitmap->word_count - 1 ? bitmap->tail_mask : ALL_ONES;
+        word_t old         = __atomic_load_n(&bitmap->data[idx], __ATOMIC_RELAXED);
+        word_t free_bits, claim;
+        do {
+            free_bits = ~old & valid;
+            claim     = 0;
+            for (size_t want = n - found; free_bits && want; --want) {
+                claim |= free_bits & -free_bits;
+                free_bits &= free_bits - 1;
+            }
+        } while (claim && !__atomic_compare_exchange_n(&bitmap->data[idx], &old, old | claim, true,
+                                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        for (; claim; claim &= claim - 1) {
+            bits[found++] = (idx << WORD_SHIFT) + CTZ(claim);
+        }
+        idx = idx + 1 == bitmap->word_count ? 0 : idx + 1;
+    }
+    if (found < n) {
+        // Came up short, hand back what we took so the caller gets all or nothing
+        for (size_t undo = 0; undo < found; ++undo) {
+            __atomic_fetch_and(&bitmap->data[WORD_INDEX(bits[undo])], ~WORD_MASK(bits[undo]), __ATOMIC_ACQ_REL);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Sets or clears [start, start + count) with one masked read-modify-write per word
+// The bits of word idx that fall in [start, start + count)
+static inline word_t range_mask(const size_t idx, const size_t start, const size_t count) {
+    word_t mask = ALL_ONES;
+    if (idx == WORD_INDEX(start)) {
+        mask &= ~(WORD_MASK(start) - 1);
+    }
+    if (idx == WORD_INDEX(start + count - 1)) {
+        mask &= ALL_ONES >> (WORD_BITS - 1 - ((start + count - 1) & (WORD_BITS - 1)));
+    }
+    return mask;
+}
+
+static void bitmap_apply_range(bitmap_t *const bitmap, const size_t start, const size_t count, const bool set) {
+    if (!count) {
+        return;
+    }
+    const size_t first = WORD_INDEX(start), last = WORD_INDEX(start + count - 1);
+    for (size_t idx = first; idx <= last; ++idx) {
+        const word_t mask = range_mask(idx, start, count);
+        const word_t old  = bitmap->data[idx];
+        bitmap->data[idx] = set ? old | mask : old & ~mask;
+        if (FLAG_CHECK(bitmap, ACCELERATED)) {
+            bitmap_word_changed(bitmap, idx, old, bitmap->data[idx]);
+        }
+    }
+}
+
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    bitmap_apply_range(bitmap, start, count, true);
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    bitmap_apply_range(bitmap, start, count, false);
+}
+
+bool bitmap_test_and_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (!bitmap || !count || start >= bitmap->bit_count || count > bitmap->bit_count - start) {
+        return false;
+    }
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        if (bitmap_next_set(bitmap, start) < start + count) {
+            return false;
+        }
+        bitmap_apply_range(bitmap, start, count, true);
+        return true;
+    }
+    const size_t first = WORD_INDEX(start), last = WORD_INDEX(start + count - 1);
+    for (size_t idx = first; idx <= last; ++idx) {
+        const word_t mask = range_mask(idx, start, count);
+        word_t old        = __atomic_load_n(&bitmap->data[idx], __ATOMIC_RELAXED);
+        do {
+            if (old & mask) {
+                // Someone has part of the range, give back the words we already took
+                for (size_t undo = first; undo < idx; ++undo) {
+                    __atomic_fetch_and(&bitmap->data[undo], ~range_mask(undo, start, count), __ATOMIC_ACQ_REL);
+                }
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(&bitmap->data[idx], &old, old | mask, true, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_RELAXED));
+    }
+    return true;
+}
+
+bool bitmap_test_and_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (!bitmap || !count || start >= bitmap->bit_count || count > bitmap->bit_count - start) {
+        return false;
+    }
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        const bool all_set = bitmap_next_zero(bitmap, start) >= start + count;
+        bitmap_apply_range(bitmap, start, count, false);
+        return all_set;
+    }
+    bool all_set = true;
+    const size_t first = WORD_INDEX(start), last = WORD_INDEX(start + count - 1);
+    for (size_t idx = first; idx <= last; ++idx) {
+        const word_t mask = range_mask(idx, start, count);
+        all_set &= (__atomic_fetch_and(&bitmap->data[idx], ~mask, __ATOMIC_ACQ_REL) & mask) == mask;
+    }
+    return all_set;
+}
+
+// First run of n zeros inside [begin, end)
+// Empty words extend the run by 64, full words kill it, and only mixed words get
+// walked, one ctz per transition rather than one test per bit
+static size_t zero_run_between(const bitmap_t *const bitmap, const size_t n, const size_t begin, const size_t end) {
+    size_t run = 0, run_start = begin;
+    const size_t first = WORD_INDEX(begin), last = WORD_INDEX(end - 1);
+    for (size_t idx = first; idx <= last; ++idx) {
+        // Anything we can't hand out looks like a one: set bits, bits before begin, bits at or past end
+        word_t used = bitmap->data[idx];
+        if (idx == first) {
+            used |= WORD_MASK(begin) - 1;
+        }
+        if (idx == last && (end & (WORD_BITS - 1))) {
+            used |= ~(WORD_MASK(end) - 1);
+        }
+
+        if (!used) {
+            if (!run) {
+                run_start = idx << WORD_SHIFT;
+            }
+            run += WORD_BITS;
+            if (run >= n) {
+                return run_start;
+            }
+            continue;
+        }
+        if (used == ALL_ONES) {
+            run = 0;
+            continue;
+        }
+
+        size_t offset = 0;
+        while (offset < WORD_BITS) {
+            const word_t rest   = used >> offset;
+            const size_t zeros = rest ? CTZ(rest) : WORD_BITS - offset;
+            if (zeros) {
+                if (!run) {
+                    run_start = (idx << WORD_SHIFT) + offset;
+                }
+                run += zeros;
+                if (run >= n) {
+                    return run_start;
+                }
+                offset += zeros;
+                if (offset >= WORD_BITS) {
+                    break;
+                }
+            }
+            const word_t rest_free = ~used >> offset;
+            offset += rest_free ? CTZ(rest_free) : WORD_BITS - offset;
+            run = 0;
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t n, const size_t start_hint) {
+    if (bitmap && n && n <= bitmap->bit_count) {
+        const size_t hint = start_hint < bitmap->bit_count ? start_hint : 0;
+        const size_t found = zero_run_between(bitmap, n, hint, bitmap->bit_count);
+        if (found != SIZE_MAX || !hint) {
+            return found;
+        }
+        // Wrap around, a run starting before the hint may run up to n - 1 bits past it
+        const size_t end = hint + n - 1 < bitmap->bit_count ? hint + n - 1 : bitmap->bit_count;
+        return zero_run_between(bitmap, n, 0, end);
+    }
+    return SIZE_MAX;
+}
+
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) {
     if (bitmap && func) {
-        for (size_t idx = 0; idx < bitmap->bit_count; ++idx) {
-            if (bitmap_test(bitmap, idx)) {
-                func(idx, arg);
+        // Empty words cost one load, set bits come out lowest first with ctz
+        for (size_t idx = 0; idx < bitmap->word_count; ++idx) {
+            for (word_t word = bitmap_word(bitmap, idx); word; word &= word - 1) {
+                func((idx << WORD_SHIFT) + CTZ(word), arg);
+            }
+        }
+    }
+}
+
+// Indices handed to a batch callback at once. 2KiB of stack.
+#define FOR_EACH_BATCH 256
+
+void bitmap_for_each_batch(const bitmap_t *const bitmap, void (*func)(const size_t *, size_t, void *), void *arg) {
+    if (bitmap && func) {
+        size_t batch[FOR_EACH_BATCH];
+        size_t count = 0;
+        for (size_t idx = 0; idx < bitmap->word_count; ++idx) {
+            for (word_t word = bitmap_word(bitmap, idx); word; word &= word - 1) {
+                batch[count++] = (idx << WORD_SHIFT) + CTZ(word);
+                if (count == FOR_EACH_BATCH) {
+                    func(batch, count, arg);
+                    count = 0;
+                }
+            }
+        }
+        if (count) {
+            func(batch, count, arg);
+        }
+    }
+}
+
+// Set bits in words [first, last) plus the ones below bit in word last
+static size_t count_up_to(const bitmap_t *const bitmap, const size_t first, const size_t bit) {
+    const size_t last = WORD_INDEX(bit);
+    const word_t partial = bitmap->data[last] & (WORD_MASK(bit) - 1);
+    return kernels_get()->popcount(bitmap->data + first, last - first) + (size_t) __builtin_popcountll(partial);
+}
+
+bool bitmap_enable_rank(bitmap_t *const bitmap) {
+    if (!bitmap) {
+        return false;
+    }
+    if (FLAG_CHECK(bitmap, RANKED)) {
+        return true;
+    }
+    struct rank_index *rank = (struct rank_index *) malloc(sizeof(struct rank_index));
+    if (!rank) {
+        return false;
+    }
+    rank->superblocks = (bitmap->word_count + SUPERBLOCK_WORDS - 1) >> SUPERBLOCK_SHIFT;
+    rank->tree        = (uint64_t *) malloc((rank->superblocks + 1) * sizeof(uint64_t));
+    if (!rank->tree) {
+        free(rank);
+        return false;
+    }
+    bitmap->rank = rank;
+    bitmap->flags |= RANKED;
+    bitmap_rebuild(bitmap);
+    return true;
+}
+
+size_t bitmap_rank(const bitmap_t *const bitmap, const size_t bit) {
+    if (!bitmap) {
+        return SIZE_MAX;
+    }
+    if (bit >= bitmap->bit_count) {
+        return bitmap_total_set(bitmap);
+    }
+    if (FLAG_CHECK(bitmap, RANKED)) {
+        // Whole superblocks from the tree, then at most one cache line of popcounts
+        const size_t superblock = WORD_INDEX(bit) >> SUPERBLOCK_SHIFT;
+        return rank_prefix(bitmap->rank, superblock) + count_up_to(bitmap, superblock << SUPERBLOCK_SHIFT, bit);
+    }
+    return count_up_to(bitmap, 0, bit);
+}
+
+size_t bitmap_select(const bitmap_t *const bitmap, const size_t k) {
+    if (!bitmap) {
+        return SIZE_MAX;
+    }
+    size_t remaining = k;
+    size_t idx       = 0;
+    if (FLAG_CHECK(bitmap, RANKED)) {
+        // Fenwick descent for the last superblock whose prefix is still <= k
+        const struct rank_index *const rank = bitmap->rank;
+        size_t superblock = 0;
+        size_t step       = 1;
+        while (step <= rank->superblocks >> 1) {
+            step <<= 1;
+        }
+        for (; step; step >>= 1) {
+            if (superblock + step <= rank->superblocks && rank->tree[superblock + step] <= remaining) {
+                superblock += step;
+                remaining -= rank->tree[superblock];
+            }
+        }
+        if (superblock == rank->superblocks) {
+            return SIZE_MAX;
+        }
+        idx = superblock << SUPERBLOCK_SHIFT;
+    }
+    // Word by word from there, which is the whole map without an index
+    for (; idx < bitmap->word_count; ++idx) {
+        word_t word = bitmap_word(bitmap, idx);
+        const size_t count = (size_t) __builtin_popcountll(word);
+        if (remaining < count) {
+            for (; remaining; --remaining) {
+                word &= word - 1;
             }
+            return (idx << WORD_SHIFT) + CTZ(word);
         }
+        remaining -= count;
     }
+    return SIZE_MAX;
 }
 
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) {
     memset(bitmap->data, pattern, bitmap->byte_count);
+    if (FLAG_CHECK(bitmap, ACCELERATED)) {
+        bitmap_rebuild(bitmap);
+    }
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) {
@@ -146,8 +877,17 @@ bitmap_t *bitmap_create(const size_t n_bits) {
     return bitmap_initialize(n_bits, NONE);
 }
 
+bitmap_t *bitmap_create_hierarchical(const size_t n_bits) {
+    bitmap_t *bitmap = bitmap_initialize(n_bits, HIERARCHICAL);
+    if (bitmap) {
+        // Data is all zero but the padding bits in the summaries still need setting
+        summary_rebuild(bitmap);
+    }
+    return bitmap;
+}
+
 const uint8_t *bitmap_export(const bitmap_t *const bitmap) {
-    return bitmap->data;
+    return (const uint8_t *) bitmap->data;
 }
 
 bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data) {
@@ -162,22 +902,50 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data) {
 }
 
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) {
-    if (bitmap_data) {
+    // Word access needs word alignment, we won't fake it with byte loads
+    if (bitmap_data && !((uintptr_t) bitmap_data & (sizeof(word_t) - 1))) {
         bitmap_t *bitmap = bitmap_initialize(n_bits, OVERLAY);
         if (bitmap) {
-            bitmap->data = (uint8_t *) bitmap_data;
+            bitmap->data = (word_t *) bitmap_data;
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+bitmap_t *bitmap_overlay_hierarchical(const size_t n_bits, void *const bitmap_data) {
+    if (bitmap_data && !((uintptr_t) bitmap_data & (sizeof(word_t) - 1))) {
+        bitmap_t *bitmap = bitmap_initialize(n_bits, OVERLAY | HIERARCHICAL);
+        if (bitmap) {
+            bitmap->data = (word_t *) bitmap_data;
+            summary_rebuild(bitmap);
             return bitmap;
         }
     }
     return NULL;
 }
 
+void bitmap_refresh(bitmap_t *const bitmap) {
+    if (bitmap && FLAG_CHECK(bitmap, ACCELERATED)) {
+        bitmap_rebuild(bitmap);
+    }
+}
+
 void bitmap_destroy(bitmap_t *bitmap) {
     if (bitmap) {
         if (!FLAG_CHECK(bitmap, OVERLAY)) {
             // don't free memory that isn't ours!
             free(bitmap->data);
         }
+        if (bitmap->summary) {
+            // all levels live in the one allocation hanging off level 0
+            free(bitmap->summary->full[0]);
+            free(bitmap->summary);
+        }
+        if (bitmap->rank) {
+            free(bitmap->rank->tree);
+            free(bitmap->rank);
+        }
         free(bitmap);
     }
 }
@@ -188,6 +956,208 @@ void bitmap_destroy(bitmap_t *bitmap) {
 ///
 //
 
+static void bitmap_word_changed(bitmap_t *const bitmap, const size_t idx, const word_t old, const word_t new_word) {
+    if (FLAG_CHECK(bitmap, HIERARCHICAL)) {
+        summary_update(bitmap, idx, old, new_word);
+    }
+    if (FLAG_CHECK(bitmap, RANKED) && old != new_word) {
+        // Padding bits don't count, then add the difference up the tree
+        const word_t valid  = idx == bitmap->word_count - 1 ? bitmap->tail_mask : ALL_ONES;
+        const uint64_t diff = (uint64_t) __builtin_popcountll(new_word & valid) - (uint64_t) __builtin_popcountll(old & valid);
+        struct rank_index *const rank = bitmap->rank;
+        for (size_t node = (idx >> SUPERBLOCK_SHIFT) + 1; node <= rank->superblocks; node += node & -node) {
+            rank->tree[node] += diff;  // unsigned wraparound takes care of negative diffs
+        }
+    }
+}
+
+static void bitmap_rebuild(bitmap_t *const bitmap) {
+    if (FLAG_CHECK(bitmap, HIERARCHICAL)) {
+        summary_rebuild(bitmap);
+    }
+    if (FLAG_CHECK(bitmap, RANKED)) {
+        struct rank_index *const rank = bitmap->rank;
+        const struct kernels *const kernels = kernels_get();
+        rank->tree[0] = 0;
+        for (size_t superblock = 0; superblock < rank->superblocks; ++superblock) {
+            const size_t first = superblock << SUPERBLOCK_SHIFT;
+            const size_t words = first + SUPERBLOCK_WORDS < bitmap->word_count ? SUPERBLOCK_WORDS : bitmap->word_count - first;
+            uint64_t count     = kernels->popcount(bitmap->data + first, words);
+            if (first + words == bitmap->word_count) {
+                // The last superblock, padding bits don't count
+                count -= (uint64_t) __builtin_popcountll(bitmap->data[bitmap->word_count - 1] & ~bitmap->tail_mask);
+            }
+            rank->tree[superblock + 1] = count;
+        }
+        // Linear time Fenwick build, every node pushes its total to its parent
+        for (size_t node = 1; node <= rank->superblocks; ++node) {
+            const size_t parent = node + (node & -node);
+            if (parent <= rank->superblocks) {
+                rank->tree[parent] += rank->tree[node];
+            }
+        }
+    }
+}
+
+// Set bits in the first n superblocks
+static uint64_t rank_prefix(const struct rank_index *const rank, size_t superblocks) {
+    uint64_t total = 0;
+    for (; superblocks; superblocks &= superblocks - 1) {
+        total += rank->tree[superblocks];
+    }
+    return total;
+}
+
+// Allocates the summary levels, contents are garbage until summary_rebuild
+static bool summary_create(bitmap_t *const bitmap) {
+    struct summary *summary = (struct summary *) calloc(1, sizeof(struct summary));
+    if (!summary) {
+        return false;
+    }
+    size_t total   = 0;
+    size_t entries = bitmap->word_count;
+    do {
+        entries = (entries + WORD_BITS - 1) >> WORD_SHIFT;
+        summary->words[summary->levels++] = entries;
+        total += entries;
+    } while (entries > 1);
+
+    // One allocation for every level of both summaries
+    word_t *storage = (word_t *) malloc(total * 2 * sizeof(word_t));
+    if (!storage) {
+        free(summary);
+        return false;
+    }
+    for (size_t level = 0; level < summary->levels; ++level) {
+        summary->full[level] = storage;
+        summary->any[level]  = storage + summary->words[level];
+        storage += summary->words[level] * 2;
+    }
+    bitmap->summary = summary;
+    return true;
+}
+
+// Sets or clears the summary bit for entry at level, climbing for as long as the word
+// containing it changes state too. For the full summary a word counts when it's all ones,
+// for the any summary when it's non-zero.
+static void summary_propagate(struct summary *const summary, word_t *const *const levels, const bool full,
+                              size_t level, size_t entry, bool value) {
+    for (; level < summary->levels; ++level) {
+        word_t *const word = &levels[level][WORD_INDEX(entry)];
+        const word_t old   = *word;
+        *word = value ? old | WORD_MASK(entry) : old & ~WORD_MASK(entry);
+        const bool was = full ? old == ALL_ONES : old != 0;
+        const bool is  = full ? *word == ALL_ONES : *word != 0;
+        if (was == is) {
+            return;
+        }
+        value = is;
+        entry = WORD_INDEX(entry);
+    }
+}
+
+static void summary_update(bitmap_t *const bitmap, const size_t idx, const word_t old, const word_t new_word) {
+    // Padding bits count as set for fullness and unset for emptiness
+    const word_t valid = idx == bitmap->word_count - 1 ? bitmap->tail_mask : ALL_ONES;
+    const bool was_full = (old | ~valid) == ALL_ONES, is_full = (new_word | ~valid) == ALL_ONES;
+    const bool was_any = (old & valid) != 0, is_any = (new_word & valid) != 0;
+    if (was_full != is_full) {
+        summary_propagate(bitmap->summary, bitmap->summary->full, true, 0, idx, is_full);
+    }
+    if (was_any != is_any) {
+        summary_propagate(bitmap->summary, bitmap->summary->any, false, 0, idx, is_any);
+    }
+}
+
+static void summary_rebuild(bitmap_t *const bitmap) {
+    struct summary *const summary = bitmap->summary;
+    size_t entries = bitmap->word_count;
+    for (size_t level = 0; level < summary->levels; ++level) {
+        word_t *const full = summary->full[level];
+        word_t *const any  = summary->any[level];
+        memset(full, 0, summary->words[level] * sizeof(word_t));
+        memset(any, 0, summary->words[level] * sizeof(word_t));
+        for (size_t entry = 0; entry < entries; ++entry) {
+            word_t below_full, below_any;
+            if (level) {
+                below_full = summary->full[level - 1][entry];
+                below_any  = summary->any[level - 1][entry];
+            } else {
+                const word_t valid = entry == bitmap->word_count - 1 ? bitmap->tail_mask : ALL_ONES;
+                below_full = bitmap->data[entry] | ~valid;
+                below_any  = bitmap->data[entry] & valid;
+            }
+            if (below_full == ALL_ONES) {
+                full[WORD_INDEX(entry)] |= WORD_MASK(entry);
+            }
+            if (below_any) {
+                any[WORD_INDEX(entry)] |= WORD_MASK(entry);
+            }
+        }
+        // Entries past the end are never free
+        if (entries & (WORD_BITS - 1)) {
+            full[summary->words[level] - 1] |= ~(WORD_MASK(entries) - 1);
+        }
+        entries = summary->words[level];
+    }
+}
+
+// First zero (or one) bit found by walking down from the top level, one word per level
+static size_t summary_first(const bitmap_t *const bitmap, const bool zero) {
+    const struct summary *const summary = bitmap->summary;
+    word_t *const *const levels = zero ? summary->full : summary->any;
+
+    size_t entry = 0;
+    for (size_t level = summary->levels; level-- > 0;) {
+        const word_t word = zero ? ~levels[level][entry] : levels[level][entry];
+        if (!word) {
+            // Only possible at the top, everything below agrees with its parent
+            return SIZE_MAX;
+        }
+        entry = (entry << WORD_SHIFT) + CTZ(word);
+    }
+    const word_t valid = entry == bitmap->word_count - 1 ? bitmap->tail_mask : ALL_ONES;
+    const word_t word  = (zero ? ~bitmap->data[entry] : bitmap->data[entry]) & valid;
+    return (entry << WORD_SHIFT) + CTZ(word);
+}
+
+// Next zero (or set) bit at or after from
+// Climbs from the starting word until some summary word has a candidate past
+// where we've already looked, then walks back down one word per level
+static size_t summary_next(const bitmap_t *const bitmap, const size_t from, const bool zero) {
+    const struct summary *const summary = bitmap->summary;
+    word_t *const *const levels = zero ? summary->full : summary->any;
+
+    const size_t idx  = WORD_INDEX(from);
+    const word_t word = bitmap_candidates(bitmap, idx, zero) & ~(WORD_MASK(from) - 1);
+    if (word) {
+        return (idx << WORD_SHIFT) + CTZ(word);
+    }
+
+    size_t entry = idx + 1;
+    size_t level = 0;
+    for (;; ++level) {
+        if (level == summary->levels) {
+            return SIZE_MAX;
+        }
+        const size_t summary_idx = WORD_INDEX(entry);
+        if (summary_idx < summary->words[level]) {
+            const word_t found = (zero ? ~levels[level][summary_idx] : levels[level][summary_idx])
+                                 & ~(WORD_MASK(entry) - 1);
+            if (found) {
+                entry = (summary_idx << WORD_SHIFT) + CTZ(found);
+                break;
+            }
+        }
+        entry = summary_idx + 1;
+    }
+    while (level-- > 0) {
+        const word_t below = zero ? ~levels[level][entry] : levels[level][entry];
+        entry = (entry << WORD_SHIFT) + CTZ(below);
+    }
+    return (entry << WORD_SHIFT) + CTZ(bitmap_candidates(bitmap, entry, zero));
+}
+
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
     if (n_bits) {  // must be non-zero
         bitmap_t *bitmap = (bitmap_t *) malloc(sizeof(bitmap_t));
@@ -197,25 +1167,26 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
             bitmap->byte_count    = n_bits >> 3;
             bitmap->leftover_bits = n_bits & 0x07;
             bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
+            bitmap->word_count = (n_bits + WORD_BITS - 1) >> WORD_SHIFT;
+            bitmap->tail_mask  = (n_bits & (WORD_BITS - 1)) ? WORD_MASK(n_bits) - 1 : ALL_ONES;
+            bitmap->data       = NULL;
+            bitmap->summary    = NULL;
+            bitmap->rank       = NULL;
 
             // FLAG HANDLING HERE
 
-            // This logic will need to be reworked when we have more than one flag, haha
-            // Maybe something like if (flags) and then contain a giant if/else-if for each flag
-            // Then a return at the end
-
-            if (FLAG_CHECK(bitmap, OVERLAY)) {
-                // don't mess with data, caller will set it
-                bitmap->data = NULL;
+            // Each flag that needs setup gets its turn, the first failure drops to the cleanup
+            // Overlays don't mess with data, caller will set it
+            bool ok = FLAG_CHECK(bitmap, OVERLAY)
+                      || (bitmap->data = (word_t *) calloc(bitmap->word_count, sizeof(word_t))) != NULL;
+            if (ok && FLAG_CHECK(bitmap, HIERARCHICAL)) {
+                ok = summary_create(bitmap);
+            }
+            if (ok) {
                 return bitmap;
-            } else {
-                bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
-                if (bitmap->data) {
-                    return bitmap;
-                }
             }
 
-            free(bitmap);
+            bitmap_destroy(bitmap);
         }
     }
     return NULL;
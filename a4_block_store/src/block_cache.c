@@ -0,0 +1,302 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include "block_cache.h"
+
+// Marks an empty frame, and an empty hash table slot
+#define NO_BLOCK SIZE_MAX
+
+struct frame {
+    size_t block;  // NO_BLOCK while the frame is empty
+    bool referenced;
+    bool dirty;
+    bool prefetched;  // Read in by block_cache_prefetch and not asked for since
+};
+
+struct block_cache {
+    int fd;
+    size_t block_size;
+    size_t block_count;
+    off_t base;
+    size_t capacity;
+    uint8_t *data;  // capacity frames of block_size bytes
+    uint8_t *staging;  // block_cache_prefetch reads into this with the cache unlocked
+    struct frame *frames;
+    size_t hand;
+    // block -> frame, linear probing, twice the frames so probes stay short
+    size_t *table;
+    size_t table_bits;
+    block_cache_stats_t stats;
+    pthread_mutex_t lock;
+};
+
+static inline size_t table_slot(const block_cache_t *const cache, const size_t block) {
+    // Fibonacci hashing, the top bits of the product are the well mixed ones
+    return (size_t) (((uint64_t) block * 0x9E3779B97F4A7C15ull) >> (64 - cache->table_bits));
+}
+
+static inline size_t table_mask(const block_cache_t *const cache) {
+    return ((size_t) 1 << cache->table_bits) - 1;
+}
+
+static size_t table_find(const block_cache_t *const cache, const size_t block) {
+    for (size_t slot = table_slot(cache, block);; slot = (slot + 1) & table_mask(cache)) {
+        const size_t frame = cache->table[slot];
+        if (frame == NO_BLOCK || cache->frames[frame].block == block) {
+            return frame;
+        }
+    }
+}
+
+static void table_insert(block_cache_t *const cache, const size_t frame) {
+    size_t slot = table_slot(cache, cache->frames[frame].block);
+    while (cache->table[slot] != NO_BLOCK) {
+        slot = (slot + 1) & table_mask(cache);
+    }
+    cache->table[slot] = frame;
+}
+
+static void table_erase(block_cache_t *const cache, const size_t block) {
+    size_t hole = table_slot(cache, block);
+    while (cache->frames[cache->table[hole]].block != block) {
+        hole = (hole + 1) & table_mask(cache);
+    }
+    // Backward shift instead of tombstones: pull later entries of the probe run into the hole
+    //  unless their home slot is after the hole (cyclically), where they'd stop being found
+    for (size_t slot = (hole + 1) & table_mask(cache); cache->table[slot] != NO_BLOCK;
+         slot = (slot + 1) & table_mask(cache)) {
+        const size_t home = table_slot(cache, cache->frames[cache->table[slot]].block);
+        const bool stays = hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot);
+        if (!stays) {
+            cache->table[hole] = cache->table[slot];
+            hole = slot;
+        }
+    }
+    cache->table[hole] = NO_BLOCK;
+}
+
+// pread/pwrite the whole length, they can come back short
+static bool file_io(const int fd, uint8_t *buffer, size_t len, off_t offset, const bool write) {
+    while (len) {
+        const ssize_t done = write ? pwrite(fd, buffer, len, offset) : pread(fd, buffer, len, offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        buffer += done;
+        len -= (size_t) done;
+        offset += done;
+    }
+    return true;
+}
+
+static inline uint8_t *frame_data(const block_cache_t *const cache, const size_t frame) {
+    return cache->data + frame * cache->block_size;
+}
+
+static bool write_back(block_cache_t *const cache, const size_t frame) {
+    struct frame *const f = &cache->frames[frame];
+    if (f->dirty) {
+        if (!file_io(cache->fd, frame_data(cache, frame), cache->block_size,
+                     cache->base + (off_t) (f->block * cache->block_size), true)) {
+            return false;
+        }
+        f->dirty = false;
+        ++cache->stats.writebacks;
+    }
+    return true;
+}
+
+block_cache_t *block_cache_create(const int fd, const size_t block_size, const size_t block_count, const off_t base,
+                                  const size_t capacity) {
+    if (fd < 0 || !block_size || !block_count || base < 0 || !capacity) {
+        return NULL;
+    }
+    // More frames than blocks would never be used
+    const size_t frames = capacity < block_count ? capacity : block_count;
+    block_cache_t *cache = (block_cache_t *) calloc(1, sizeof(block_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    cache->fd          = fd;
+    cache->block_size  = block_size;
+    cache->block_count = block_count;
+    cache->base        = base;
+    cache->capacity    = frames;
+    cache->table_bits  = 1;
+    while (((size_t) 1 << cache->table_bits) < frames * 2) {
+        ++cache->table_bits;
+    }
+    cache->data   = (uint8_t *) malloc(frames * block_size);
+    cache->staging = (uint8_t *) malloc(block_size);
+    cache->frames = (struct frame *) malloc(frames * sizeof(struct frame));
+    cache->table  = (size_t *) malloc(((size_t) 1 << cache->table_bits) * sizeof(size_t));
+    if (!cache->data || !cache->staging || !cache->frames || !cache->table) {
+        free(cache->data);
+        free(cache->staging);
+        free(cache->frames);
+        free(cache->table);
+        free(cache);
+        return NULL;
+    }
+    for (size_t frame = 0; frame < frames; ++frame) {
+        cache->frames[frame] = (struct frame){NO_BLOCK, false, false, false};
+    }
+    memset(cache->table, 0xff, ((size_t) 1 << cache->table_bits) * sizeof(size_t));
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void block_cache_lock(block_cache_t *const cache) {
+    pthread_mutex_lock(&cache->lock);
+}
+
+void block_cache_unlock(block_cache_t *const cache) {
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Empties a frame to put another block in, NO_BLOCK if the one there couldn't be written back
+static size_t take_frame(block_cache_t *const cache) {
+    // CLOCK: empty frames go first, then anything not referenced since the hand last came by
+    for (;; cache->hand = (cache->hand + 1) % cache->capacity) {
+        struct frame *const f = &cache->frames[cache->hand];
+        if (f->block == NO_BLOCK || !f->referenced) {
+            break;
+        }
+        f->referenced = false;
+    }
+    const size_t frame = cache->hand;
+    cache->hand = (cache->hand + 1) % cache->capacity;
+
+    struct frame *const f = &cache->frames[frame];
+    if (f->block != NO_BLOCK) {
+        // Couldn't write it back, leave it cached and dirty rather than lose the data
+        if (!write_back(cache, frame)) {
+            return NO_BLOCK;
+        }
+        table_erase(cache, f->block);
+        f->block = NO_BLOCK;
+        ++cache->stats.evictions;
+    }
+    return frame;
+}
+
+// Shared body of block_cache_frame and block_cache_frame_overwrite, read_in says whether a miss needs the file's copy
+static uint8_t *get_frame(block_cache_t *const cache, const size_t block, const bool dirty, const bool read_in) {
+    if (!cache || block >= cache->block_count) {
+        return NULL;
+    }
+    size_t frame = table_find(cache, block);
+    if (frame != NO_BLOCK) {
+        struct frame *const f = &cache->frames[frame];
+        ++cache->stats.hits;
+        if (f->prefetched) {
+            ++cache->stats.prefetch_hits;
+        }
+        f->referenced = true;
+        f->prefetched = false;
+        f->dirty |= dirty;
+        return frame_data(cache, frame);
+    }
+    ++cache->stats.misses;
+
+    frame = take_frame(cache);
+    if (frame == NO_BLOCK || (read_in && !file_io(cache->fd, frame_data(cache, frame), cache->block_size,
+                                                  cache->base + (off_t) (block * cache->block_size), false))) {
+        return NULL;
+    }
+    cache->frames[frame] = (struct frame){block, true, dirty, false};
+    table_insert(cache, frame);
+    return frame_data(cache, frame);
+}
+
+uint8_t *block_cache_frame(block_cache_t *const cache, const size_t block, const bool dirty) {
+    return get_frame(cache, block, dirty, true);
+}
+
+uint8_t *block_cache_frame_overwrite(block_cache_t *const cache, const size_t block) {
+    return get_frame(cache, block, true, false);
+}
+
+bool block_cache_prefetch(block_cache_t *const cache, const size_t block) {
+    if (!cache || block >= cache->block_count) {
+        return false;
+    }
+    block_cache_lock(cache);
+    const bool cached = table_find(cache, block) != NO_BLOCK;
+    // Any write-back could be this block going out newer than what we're about to read
+    const uint64_t writebacks = cache->stats.writebacks;
+    block_cache_unlock(cache);
+    if (cached) {
+        return true;
+    }
+
+    // The read is the slow part, everybody else carries on while it happens
+    if (!file_io(cache->fd, cache->staging, cache->block_size, cache->base + (off_t) (block * cache->block_size),
+                 false)) {
+        return false;
+    }
+
+    block_cache_lock(cache);
+    bool fetched = table_find(cache, block) != NO_BLOCK;
+    if (!fetched && cache->stats.writebacks == writebacks) {
+        const size_t frame = take_frame(cache);
+        if (frame != NO_BLOCK) {
+            memcpy(frame_data(cache, frame), cache->staging, cache->block_size);
+            // Not referenced, so if nobody reads it it's the first to go
+            cache->frames[frame] = (struct frame){block, false, false, true};
+            table_insert(cache, frame);
+            ++cache->stats.prefetches;
+            fetched = true;
+        }
+    }
+    block_cache_unlock(cache);
+    return fetched;
+}
+
+bool block_cache_flush(block_cache_t *const cache) {
+    if (!cache) {
+        return false;
+    }
+    bool flushed = true;
+    block_cache_lock(cache);
+    for (size_t frame = 0; frame < cache->capacity; ++frame) {
+        if (cache->frames[frame].block != NO_BLOCK) {
+            flushed &= write_back(cache, frame);
+        }
+    }
+    block_cache_unlock(cache);
+    return flushed;
+}
+
+size_t block_cache_get_capacity(const block_cache_t *const cache) {
+    return cache ? cache->capacity : 0;
+}
+
+bool block_cache_get_stats(block_cache_t *const cache, block_cache_stats_t *const stats) {
+    if (!cache || !stats) {
+        return false;
+    }
+    block_cache_lock(cache);
+    *stats = cache->stats;
+    block_cache_unlock(cache);
+    return true;
+}
+
+bool block_cache_destroy(block_cache_t *cache) {
+    if (!cache) {
+        return false;
+    }
+    const bool flushed = block_cache_flush(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->data);
+    free(cache->staging);
+    free(cache->frames);
+    free(cache->table);
+    free(cache);
+    return flushed;
+}
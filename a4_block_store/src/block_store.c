@@ -1,9 +1,17 @@
+#define _POSIX_C_SOURCE 200809L //for mmap, ftruncate and friends under -std=c11
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
 #include "bitmap.h"
+#include "buddy.h"
+#include "block_cache.h"
+#include "readahead.h"
 #include "block_store.h"
 #include <errno.h>
 
@@ -12,132 +20,1708 @@
 #define BLOCK_STORE_NUM_BYTES 65536  // 2^8 blocks of 2^8 bytes.
 #define BLOCK_SIZE_BYTES 256         // 2^8 BYTES per block
 
+//readahead, how many sequential readers are told apart and how many windows can wait for the worker
+#define BLOCK_STORE_READAHEAD_STREAMS 8
+#define BLOCK_STORE_READAHEAD_QUEUE 16
+
+//limits for block_store_create_ex
+#define BLOCK_STORE_MIN_BLOCK_SIZE 64             // 2^6 bytes, keeps the fbm word aligned
+#define BLOCK_STORE_MAX_BLOCK_SIZE (1 << 20)      // 2^20 bytes, 1 MiB
+#define BLOCK_STORE_MAX_BLOCKS ((size_t) 1 << 32) // 2^32 blocks
+
+//one thread's stash of blocks it has claimed in the fbm but not handed out yet
+//the lock is only ever contended by a flush, the owning thread is the only one that allocates from it
+typedef struct magazine {
+    pthread_mutex_t lock;
+    pthread_t owner;
+    struct magazine* next;
+    size_t count;
+    size_t ids[]; //the blocks, popped from the end
+} magazine;
+
+//every thread's magazine for one device
+//the cached bitmap is set for blocks sitting in a magazine, and whoever clears a block's bit owns it,
+//so a request can still take a cached block and the magazine skips it when it gets there
+typedef struct {
+    pthread_mutex_t lock; //guards the magazines list
+    magazine* magazines;
+    size_t magazineSize;
+    uint64_t id; //tells this rack from one that used to be at the same address, for the thread local lookup
+    bitmap_t* cached;
+} magazineRack;
+
+//spots sequential reads and fetches ahead of them, the lock covers the detector and the queue
+//cached devices have a worker thread that reads the queued windows into the cache, mapped devices don't queue
+//anything, the kernel is told to start reading the pages in and that's already asynchronous
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; //the worker waits on this for windows, or for stop
+    readahead_t* detector;
+    readahead_window_t queue[BLOCK_STORE_READAHEAD_QUEUE]; //windows waiting for the worker, oldest at head
+    size_t head;
+    size_t queued;
+    bool stop;
+    bool hasWorker;
+    pthread_t worker;
+} prefetcher;
+
+//one shard's lock, on its own cache line so shards next to each other don't slow each other down
+typedef struct {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64))) blockShard;
+
 //the block_store struct, contains the bitmap fbm to keep track of available and used blocks
-//can store 2^8 blocks of 2^8 bytes, the first block being the fbm
-//fbm is physically stored in the first block of the blocks array, with a pointer to keep track of it in the struct
+//can store blockCount blocks of blockSize bytes, the first fbmBlocks blocks being the fbm
+//fbm is physically stored in the leading blocks of the blocks array, with a pointer to keep track of it in the struct
+//user block ids start after the fbm, so block id 0 is physical block fbmBlocks
 struct block_store {
     void* blocks;
     bitmap_t* fbm;
+    size_t blockSize;
+    size_t blockCount;
+    size_t fbmBlocks;
+    int fd; //the file the blocks are mapped from, -1 if they're on the heap
+    BLOCK_STORE_POLICY policy; //how new blocks get placed
+    size_t cursor; //where next fit starts looking, just past the last allocation
+    buddy_t* buddy; //power-of-two free lists over the fbm, NULL unless buddy mode is on
+    pthread_mutex_t buddyLock; //in buddy mode every fbm change holds this so the buddy index stays in step
+    magazineRack* rack; //per thread allocation caches, NULL unless they're on
+    blockShard* shards; //one lock per shardBlocks slice of the ids, NULL unless sharding is on
+    size_t shardCount;
+    size_t shardBlocks; //a multiple of 64, so no two shards share an fbm word
+    uint32_t* seqs; //sequence per seqBlocks group, odd while a write is in progress, NULL unless optimistic reads are on
+    size_t seqBlocks;
+    block_cache_t* cache; //the user blocks live in the file behind this cache, only the fbm is in blocks, NULL unless opened with block_store_open_cached
+    prefetcher* readahead; //reads ahead of sequential readers, NULL unless it's on
+    bitmap_t* dirty; //user blocks written since the last flush
+    uint8_t* fbmCopy; //the fbm as the last flush wrote it, changed fbm blocks are found by comparing, NULL until there's been one
+    dev_t flushDev; //the file the last flush went to, dirty and fbmCopy are only good for patching that one
+    ino_t flushIno;
+    pthread_mutex_t flushLock; //one flush at a time, it's the only thing that changes dirty tracking and the fbm copy once the device is shared
+#ifdef BLOCK_STORE_DEBUG_BORROW
+    uint32_t* borrows; //outstanding borrows per block, so releasing a borrowed block can be caught
+#endif
 };
 
+//gets a pointer to the start of a user block, every access to block data goes through here
+static inline uint8_t *block_store_block(const block_store_t *const bs, const size_t block_id) {
+    return (uint8_t *)bs->blocks + (block_id + bs->fbmBlocks) * bs->blockSize;
+}
+
+//whether a user block is allocated to someone, which is what every data access checks
+//with caches on, a released block sitting in a magazine is still set in the fbm, its cached bit says it's free
+static inline bool block_store_in_use(const block_store_t *const bs, const size_t block_id) {
+    return bitmap_test(bs->fbm, block_id) && (bs->rack==NULL || !bitmap_test(bs->rack->cached, block_id));
+}
+
+//notes that user blocks [first, first + count) changed since the last flush
+//mostly they're marked already, so look before doing the atomic
+static inline void block_store_mark_dirty(const block_store_t *const bs, const size_t first, const size_t count) {
+    for(size_t id = first; id < first + count; id++) {
+        if(!bitmap_test(bs->dirty, id)) {
+            bitmap_test_and_set(bs->dirty, id);
+        }
+    }
+}
+
+static void block_store_readahead(const block_store_t *const bs, const size_t block_id);
+
+//copies len bytes at offset between a user block and buffer, toBuffer says which way
+//cached devices go through the block cache, returns false if it couldn't get the block in from the file
+//(a write of the whole block doesn't need it in, it just takes a frame)
+//reads are also where readahead finds out what's being read
+static bool block_store_copy(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer, const bool toBuffer) {
+    uint8_t* data = NULL;
+    if(bs->cache!=NULL) {
+        block_cache_lock(bs->cache);
+        if(!toBuffer && offset==0 && len==bs->blockSize) {
+            data = block_cache_frame_overwrite(bs->cache, block_id);
+        }
+        else {
+            data = block_cache_frame(bs->cache, block_id, !toBuffer);
+        }
+    }
+    else {
+        data = block_store_block(bs, block_id);
+    }
+
+    if(data!=NULL) {
+        if(toBuffer) {
+            memcpy(buffer, data + offset, len);
+        }
+        else {
+            //marked after the copy, so a flush that clears it before then still writes what we copied
+            memcpy(data + offset, buffer, len);
+            block_store_mark_dirty(bs, block_id, 1);
+        }
+    }
+
+    if(bs->cache!=NULL) {
+        block_cache_unlock(bs->cache);
+    }
+    if(toBuffer && bs->readahead!=NULL) {
+        block_store_readahead(bs, block_id);
+    }
+    return data!=NULL;
+}
+
+//tells the kernel a window of a file-backed device is about to be read, so the pages are on their way in
+static void block_store_advise(const block_store_t *const bs, const readahead_window_t window) {
+    //one call for a sequential window, strided ones go a block at a time so the gaps aren't read
+    size_t runs = window.stride==1 ? 1 : window.count;
+    size_t runBlocks = window.stride==1 ? window.count : 1;
+    for(size_t i = 0; i < runs; i++) {
+        size_t first = window.first + i * window.stride;
+        size_t offset = (first + bs->fbmBlocks) * bs->blockSize;
+        size_t len = runBlocks * bs->blockSize;
+        if(bs->cache!=NULL) {
+            posix_fadvise(bs->fd, (off_t)offset, (off_t)len, POSIX_FADV_WILLNEED);
+        }
+        else {
+            //madvise wants a page aligned start
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t start = offset / page * page;
+            posix_madvise((uint8_t *)bs->blocks + start, offset + len - start, POSIX_MADV_WILLNEED);
+        }
+    }
+}
+
+//records a read with the readahead detector and sends off whatever window it asks for
+static void block_store_readahead(const block_store_t *const bs, const size_t block_id) {
+    prefetcher* ra = bs->readahead;
+    readahead_window_t window;
+    pthread_mutex_lock(&ra->lock);
+    bool fetch = readahead_access(ra->detector, block_id, &window);
+    if(fetch && ra->hasWorker) {
+        //a full queue means the worker is behind, the window is only a hint so drop it
+        if(ra->queued<BLOCK_STORE_READAHEAD_QUEUE) {
+            ra->queue[(ra->head + ra->queued) % BLOCK_STORE_READAHEAD_QUEUE] = window;
+            ra->queued++;
+            pthread_cond_signal(&ra->wake);
+        }
+        fetch = false;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    if(fetch) {
+        block_store_advise(bs, window);
+    }
+}
+
+//a cached device's readahead thread, reads queued windows into the block cache until it's told to stop
+static void *block_store_readahead_worker(void *arg) {
+    const block_store_t* bs = arg;
+    prefetcher* ra = bs->readahead;
+    pthread_mutex_lock(&ra->lock);
+    while(!ra->stop) {
+        if(ra->queued==0) {
+            pthread_cond_wait(&ra->wake, &ra->lock);
+            continue;
+        }
+        readahead_window_t window = ra->queue[ra->head];
+        ra->head = (ra->head + 1) % BLOCK_STORE_READAHEAD_QUEUE;
+        ra->queued--;
+        pthread_mutex_unlock(&ra->lock);
+
+        //get the kernel going on the whole window first, so the reads below mostly find it there
+        block_store_advise(bs, window);
+        for(size_t i = 0; i < window.count; i++) {
+            size_t id = window.first + i * window.stride;
+            //free blocks would only push out ones that are in use
+            if(block_store_in_use(bs, id)) {
+                block_cache_prefetch(bs->cache, id);
+            }
+        }
+        pthread_mutex_lock(&ra->lock);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+//writes a cached device's dirty blocks and its fbm back to the file, false on error
+static bool block_store_write_back(const block_store_t *const bs) {
+    bool written = block_cache_flush(bs->cache);
+
+    //the fbm is the leading blocks of the file
+    size_t fbmBytes = bs->fbmBlocks * bs->blockSize;
+    size_t bytes = 0;
+    while(bytes<fbmBytes) {
+        ssize_t wrote = pwrite(bs->fd, (const uint8_t *)bs->blocks + bytes, fbmBytes - bytes, (off_t)bytes);
+        if(wrote<0 && errno==EINTR) {
+            continue;
+        }
+        if(wrote<=0) {
+            return false;
+        }
+        bytes += (size_t)wrote;
+    }
+    return written;
+}
+
+//finds the first free run at or after from
+//returns where it starts and puts its length in length, SIZE_MAX if there are no free blocks past from
+static size_t block_store_next_free_run(const block_store_t *const bs, const size_t from, size_t *const length) {
+    size_t start = bitmap_next_zero(bs->fbm, from);
+    if(start==SIZE_MAX) {
+        return SIZE_MAX;
+    }
+
+    //the run goes up to the next block in use, or the end of the device
+    size_t end = bitmap_next_set(bs->fbm, start);
+    if(end==SIZE_MAX) {
+        end = bitmap_get_bits(bs->fbm);
+    }
+    *length = end - start;
+    return start;
+}
+
+//best or worst fit: the smallest (or biggest) free run that's at least count long, SIZE_MAX if there isn't one
+static size_t block_store_fit(const block_store_t *const bs, const size_t count, const bool worst) {
+    size_t best = SIZE_MAX;
+    size_t bestLength = 0;
+    size_t length = 0;
+    for(size_t start = block_store_next_free_run(bs, 0, &length); start!=SIZE_MAX; start = block_store_next_free_run(bs, start + length, &length)) {
+        if(length<count) {
+            continue;
+        }
+        if(best==SIZE_MAX || (worst ? length>bestLength : length<bestLength)) {
+            best = start;
+            bestLength = length;
+            //best fit can't do better than exact
+            if(!worst && length==count) {
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+//picks where count free blocks should go under the device's policy, SIZE_MAX if they don't fit anywhere
+static size_t block_store_place(const block_store_t *const bs, const size_t count) {
+    switch(bs->policy) {
+        case BLOCK_STORE_NEXT_FIT:
+            //find_zero_run wraps around to the front if there's nothing past the cursor
+            return bitmap_find_zero_run(bs->fbm, count, __atomic_load_n(&bs->cursor, __ATOMIC_RELAXED));
+        case BLOCK_STORE_BEST_FIT:
+            return block_store_fit(bs, count, false);
+        case BLOCK_STORE_WORST_FIT:
+            return block_store_fit(bs, count, true);
+        default:
+            return bitmap_find_zero_run(bs->fbm, count, 0);
+    }
+}
+
+//claims count adjacent blocks under the device's policy, SIZE_MAX if there's no room
+static size_t block_store_claim(block_store_t *const bs, const size_t count) {
+    //another thread can take part of the run between us finding it and claiming it, so look again if that happens
+    //the claim only fails if someone else's succeeded, so this always makes progress
+    for(;;) {
+        size_t start = block_store_place(bs, count);
+        if(start==SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        if(bitmap_test_and_set_range(bs->fbm, start, count)) {
+            //next fit carries on from the end of this one
+            __atomic_store_n(&bs->cursor, start + count, __ATOMIC_RELAXED);
+            return start;
+        }
+    }
+}
+
+//buddy mode extent allocation, count rounded up to a power of two and the tail given straight back
+//returns the first block, SIZE_MAX if there's no room
+static size_t block_store_buddy_claim(block_store_t *const bs, const size_t count) {
+    size_t order = 0;
+    while(((size_t)1 << order) < count) {
+        order++;
+    }
+
+    pthread_mutex_lock(&bs->buddyLock);
+    size_t start = SIZE_MAX;
+    if(order<=buddy_get_max_order(bs->buddy)) {
+        start = buddy_allocate(bs->buddy, order);
+        if(start!=SIZE_MAX) {
+            buddy_release(bs->buddy, start + count, ((size_t)1 << order) - count);
+        }
+    }
+    else {
+        //bigger than the biggest buddy block, find it in the fbm and cut it out of the index
+        start = bitmap_find_zero_run(bs->fbm, count, 0);
+        if(start!=SIZE_MAX) {
+            buddy_claim(bs->buddy, start, count);
+        }
+    }
+    if(start!=SIZE_MAX) {
+        bitmap_test_and_set_range(bs->fbm, start, count);
+    }
+    pthread_mutex_unlock(&bs->buddyLock);
+
+    return start;
+}
+
+//the magazine this thread used last, and the rack it's from
+static _Thread_local struct {
+    uint64_t rackId;
+    magazine* mag;
+} threadMagazine;
+
+//rack ids start at 1, so a thread that hasn't used any rack never matches
+static uint64_t nextRackId = 1;
+
+//finds (or makes) the calling thread's magazine for this device, NULL if there's no memory for one
+static magazine *block_store_magazine(const block_store_t *const bs) {
+    magazineRack* rack = bs->rack;
+    if(threadMagazine.rackId==rack->id) {
+        return threadMagazine.mag;
+    }
+
+    //first time on this device (or back after using another one), look ourselves up
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&rack->lock);
+    magazine* mag = rack->magazines;
+    while(mag!=NULL && !pthread_equal(mag->owner, self)) {
+        mag = mag->next;
+    }
+    if(mag==NULL) {
+        mag = malloc(sizeof(magazine) + rack->magazineSize * sizeof(size_t));
+        if(mag!=NULL) {
+            pthread_mutex_init(&mag->lock, NULL);
+            mag->owner = self;
+            mag->count = 0;
+            mag->next = rack->magazines;
+            rack->magazines = mag;
+        }
+    }
+    pthread_mutex_unlock(&rack->lock);
+
+    if(mag!=NULL) {
+        threadMagazine.rackId = rack->id;
+        threadMagazine.mag = mag;
+    }
+    return mag;
+}
+
+//gives the oldest n blocks in a magazine back to the fbm, skipping any a request took in the meantime
+//the caller holds the magazine's lock
+static void block_store_spill(const block_store_t *const bs, magazine *const mag, const size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        if(bitmap_test_and_reset(bs->rack->cached, mag->ids[i])) {
+            bitmap_test_and_reset(bs->fbm, mag->ids[i]);
+        }
+    }
+    memmove(mag->ids, mag->ids + n, (mag->count - n) * sizeof(size_t));
+    mag->count -= n;
+}
+
+//gives every cached block back to the fbm, so it says exactly what's in use
+static void block_store_flush_magazines(const block_store_t *const bs) {
+    if(bs->rack==NULL) {
+        return;
+    }
+    pthread_mutex_lock(&bs->rack->lock);
+    for(magazine* mag = bs->rack->magazines; mag!=NULL; mag = mag->next) {
+        pthread_mutex_lock(&mag->lock);
+        block_store_spill(bs, mag, mag->count);
+        pthread_mutex_unlock(&mag->lock);
+    }
+    pthread_mutex_unlock(&bs->rack->lock);
+}
+
+//claims a batch of free blocks for an empty magazine, half of it so there's room for releases too
+//falls back to a single block when the device is nearly full, returns false if there's nothing left
+//the caller holds the magazine's lock
+static bool block_store_refill(const block_store_t *const bs, magazine *const mag) {
+    size_t batch = bs->rack->magazineSize / 2;
+    if(batch==0 || !bitmap_find_zeros_and_set(bs->fbm, batch, mag->ids, 0)) {
+        mag->ids[0] = bitmap_find_zero_and_set(bs->fbm, 0);
+        if(mag->ids[0]==SIZE_MAX) {
+            return false;
+        }
+        batch = 1;
+    }
+
+    //they come back ascending, flip them so the lowest pops first like first fit
+    for(size_t i = 0; i < batch / 2; i++) {
+        size_t swap = mag->ids[i];
+        mag->ids[i] = mag->ids[batch - 1 - i];
+        mag->ids[batch - 1 - i] = swap;
+    }
+    for(size_t i = 0; i < batch; i++) {
+        bitmap_test_and_set(bs->rack->cached, mag->ids[i]);
+    }
+    mag->count = batch;
+    return true;
+}
+
+//allocates from this thread's magazine, SIZE_MAX if the device is full
+static size_t block_store_cache_allocate(block_store_t *const bs) {
+    magazine* mag = block_store_magazine(bs);
+    if(mag==NULL) {
+        return bitmap_find_zero_and_set(bs->fbm, 0);
+    }
+
+    size_t id = SIZE_MAX;
+    pthread_mutex_lock(&mag->lock);
+    while(id==SIZE_MAX) {
+        if(mag->count==0 && !block_store_refill(bs, mag)) {
+            break;
+        }
+        //only take it if a request didn't get there first
+        size_t candidate = mag->ids[--mag->count];
+        if(bitmap_test_and_reset(bs->rack->cached, candidate)) {
+            id = candidate;
+        }
+    }
+    pthread_mutex_unlock(&mag->lock);
+
+    return id;
+}
+
+//releases into this thread's magazine, spilling the older half to the fbm when it's full
+static void block_store_cache_release(block_store_t *const bs, const size_t block_id) {
+    //releasing a free block is a no-op, it mustn't end up cached twice
+    if(!bitmap_test(bs->fbm, block_id) || bitmap_test_and_set(bs->rack->cached, block_id)) {
+        return;
+    }
+
+    magazine* mag = block_store_magazine(bs);
+    if(mag==NULL) {
+        bitmap_test_and_reset(bs->rack->cached, block_id);
+        bitmap_test_and_reset(bs->fbm, block_id);
+        return;
+    }
+
+    pthread_mutex_lock(&mag->lock);
+    if(mag->count==bs->rack->magazineSize) {
+        block_store_spill(bs, mag, (mag->count + 1) / 2);
+    }
+    mag->ids[mag->count++] = block_id;
+    pthread_mutex_unlock(&mag->lock);
+}
+
+//the shard this thread allocates from first, handed out round robin the first time it allocates
+static _Thread_local size_t threadShard = SIZE_MAX;
+static size_t nextThreadShard = 0;
+
+//sharded mode locks, they're no-ops when the device isn't sharded
+//readers of a block hold its shard's lock shared, anything that changes a block in use or frees it holds it exclusive
+//allocating never needs one, a free block has no readers and the fbm claims are atomic
+static void block_store_shard_lock(const block_store_t *const bs, const size_t block_id, const bool exclusive) {
+    if(bs->shards!=NULL) {
+        pthread_rwlock_t* lock = &bs->shards[block_id / bs->shardBlocks].lock;
+        if(exclusive) {
+            pthread_rwlock_wrlock(lock);
+        }
+        else {
+            pthread_rwlock_rdlock(lock);
+        }
+    }
+}
+
+static void block_store_shard_unlock(const block_store_t *const bs, const size_t block_id) {
+    if(bs->shards!=NULL) {
+        pthread_rwlock_unlock(&bs->shards[block_id / bs->shardBlocks].lock);
+    }
+}
+
+//locks the shards holding [first, first + count), always in ascending order so two of these can't deadlock
+static void block_store_shard_lock_range(const block_store_t *const bs, const size_t first, const size_t count, const bool exclusive) {
+    if(bs->shards!=NULL) {
+        for(size_t shard = first / bs->shardBlocks; shard <= (first + count - 1) / bs->shardBlocks; shard++) {
+            block_store_shard_lock(bs, shard * bs->shardBlocks, exclusive);
+        }
+    }
+}
+
+static void block_store_shard_unlock_range(const block_store_t *const bs, const size_t first, const size_t count) {
+    if(bs->shards!=NULL) {
+        for(size_t shard = first / bs->shardBlocks; shard <= (first + count - 1) / bs->shardBlocks; shard++) {
+            block_store_shard_unlock(bs, shard * bs->shardBlocks);
+        }
+    }
+}
+
+//locks just the shards holding the given ids, ascending like the range lock so neither can deadlock the other
+//returns which shards it took, for block_store_shard_unlock_ids, NULL if it had to take them all (or there are none)
+static bool *block_store_shard_lock_ids(const block_store_t *const bs, const size_t *const ids, const size_t count, const bool exclusive) {
+    if(bs->shards==NULL) {
+        return NULL;
+    }
+    size_t blocks = bitmap_get_bits(bs->fbm);
+    bool* taken = calloc(bs->shardCount, sizeof(bool));
+    if(taken==NULL) {
+        block_store_shard_lock_range(bs, 0, blocks, exclusive);
+        return NULL;
+    }
+    //out of range ids are skipped without looking at them, so they need no lock
+    for(size_t i = 0; i < count; i++) {
+        if(ids[i]<blocks) {
+            taken[ids[i] / bs->shardBlocks] = true;
+        }
+    }
+    for(size_t shard = 0; shard < bs->shardCount; shard++) {
+        if(taken[shard]) {
+            block_store_shard_lock(bs, shard * bs->shardBlocks, exclusive);
+        }
+    }
+    return taken;
+}
+
+static void block_store_shard_unlock_ids(const block_store_t *const bs, bool *taken) {
+    if(bs->shards==NULL) {
+        return;
+    }
+    if(taken==NULL) {
+        block_store_shard_unlock_range(bs, 0, bitmap_get_bits(bs->fbm));
+        return;
+    }
+    for(size_t shard = 0; shard < bs->shardCount; shard++) {
+        if(taken[shard]) {
+            block_store_shard_unlock(bs, shard * bs->shardBlocks);
+        }
+    }
+    free(taken);
+}
+
+//optimistic read side, copies len bytes at offset out of the block without taking any lock
+//the copy is retried until no write or release of the block's group overlapped it
+//returns len, 0 if the block isn't in use
+static size_t block_store_seq_read(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer) {
+    uint32_t* seq = &bs->seqs[block_id / bs->seqBlocks];
+    for(;;) {
+        uint32_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if(before & 1) {
+            //a writer's in there, let it finish
+            sched_yield();
+            continue;
+        }
+        bool inUse = block_store_in_use(bs, block_id);
+        if(inUse) {
+            memcpy(buffer, block_store_block(bs, block_id) + offset, len);
+        }
+        //the copy has to be done before we look at the sequence again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(seq, __ATOMIC_RELAXED)==before) {
+            return inUse ? len : 0;
+        }
+    }
+}
+
+//optimistic write side, takes the groups holding [first, first + count) by making their sequences odd
+//writers of the same group wait on each other here, groups are taken in ascending order so they can't deadlock
+//sharded devices take the shard lock first, then this
+static void block_store_seq_begin(const block_store_t *const bs, const size_t first, const size_t count) {
+    if(bs->seqs==NULL) {
+        return;
+    }
+    for(size_t group = first / bs->seqBlocks; group <= (first + count - 1) / bs->seqBlocks; group++) {
+        uint32_t current = __atomic_load_n(&bs->seqs[group], __ATOMIC_RELAXED);
+        while((current & 1) || !__atomic_compare_exchange_n(&bs->seqs[group], &current, current + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            if(current & 1) {
+                sched_yield();
+                current = __atomic_load_n(&bs->seqs[group], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+//makes the sequences even again, readers that overlapped the write see them changed and retry
+static void block_store_seq_end(const block_store_t *const bs, const size_t first, const size_t count) {
+    if(bs->seqs==NULL) {
+        return;
+    }
+    for(size_t group = first / bs->seqBlocks; group <= (first + count - 1) / bs->seqBlocks; group++) {
+        __atomic_add_fetch(&bs->seqs[group], 1, __ATOMIC_RELEASE);
+    }
+}
+
+//checks the geometry and works out the number of leading blocks the fbm needs to track the rest of the device
+//that's the smallest f where the (blockCount - f) remaining blocks fit in f blocks worth of bits
+//returns 0 if the geometry is bad
+static size_t block_store_fbm_blocks(const size_t blockSize, const size_t blockCount) {
+    //block size must be a power of two
+    if(blockSize<BLOCK_STORE_MIN_BLOCK_SIZE || blockSize>BLOCK_STORE_MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0) {
+        return 0;
+    }
+    if(blockCount>BLOCK_STORE_MAX_BLOCKS) {
+        return 0;
+    }
+
+    const size_t bitsPerBlock = blockSize * 8;
+    size_t fbmBlocks = (blockCount + bitsPerBlock) / (bitsPerBlock + 1);
+
+    //the fbm needs to leave at least one block for the user
+    if(fbmBlocks>=blockCount) {
+        return 0;
+    }
+    return fbmBlocks;
+}
+
+//builds the struct around a blocks array that's already zeroed or loaded
+//fd is the file the blocks are mapped from, -1 if they're on the heap
+//on error the blocks are left for the caller to clean up
+static block_store_t *block_store_wrap(void *blocks, const size_t blockSize, const size_t blockCount, const size_t fbmBlocks, const int fd) {
+    //malloc struct
+    block_store_t* bs = malloc(sizeof(block_store_t));
+
+    //check for allocation errors
+    if(bs==NULL) {
+        return NULL;
+    }
+    bs->blocks = blocks;
+    bs->blockSize = blockSize;
+    bs->blockCount = blockCount;
+    bs->fbmBlocks = fbmBlocks;
+    bs->fd = fd;
+    bs->policy = BLOCK_STORE_FIRST_FIT;
+    bs->cursor = 0;
+    bs->buddy = NULL;
+    bs->rack = NULL;
+    bs->shards = NULL;
+    bs->shardCount = 0;
+    bs->shardBlocks = 0;
+    bs->seqs = NULL;
+    bs->seqBlocks = 0;
+    bs->cache = NULL;
+    bs->readahead = NULL;
+    bs->fbmCopy = NULL;
+
+    //use the leading blocks as the fbm and init it
+    bs->fbm = bitmap_overlay(blockCount - fbmBlocks, blocks);
+    if(bs->fbm==NULL) {
+        free(bs);
+        return NULL;
+    }
+    bs->dirty = bitmap_create(blockCount - fbmBlocks);
+    if(bs->dirty==NULL) {
+        bitmap_destroy(bs->fbm);
+        free(bs);
+        return NULL;
+    }
+
+#ifdef BLOCK_STORE_DEBUG_BORROW
+    bs->borrows = calloc(blockCount - fbmBlocks, sizeof(uint32_t));
+    if(bs->borrows==NULL) {
+        bitmap_destroy(bs->dirty);
+        bitmap_destroy(bs->fbm);
+        free(bs);
+        return NULL;
+    }
+#endif
+    pthread_mutex_init(&bs->buddyLock, NULL);
+    pthread_mutex_init(&bs->flushLock, NULL);
+
+    return bs;
+}
+
 ///
 /// This creates a new BS device, ready to go
 /// \return Pointer to a new block storage device, NULL on error
 ///
 block_store_t *block_store_create() {
-    //malloc struct
-    block_store_t* bs = malloc(sizeof(block_store_t));
+    return block_store_create_ex(BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS);
+}
 
-    //check for allocation errors
-    if(bs==NULL) {
+///
+/// This creates a new BS device with the given geometry, ready to go
+/// The FBM takes as many leading blocks as it needs, the rest are user-addressable
+/// \param block_size Bytes per block, a power of two from 64 to 1 MiB
+/// \param block_count Total blocks on the device, FBM included, up to 2^32
+/// \return Pointer to a new block storage device, NULL on error (including bad geometry)
+///
+block_store_t *block_store_create_ex(const size_t block_size, const size_t block_count) {
+    //check the geometry
+    size_t fbmBlocks = block_store_fbm_blocks(block_size, block_count);
+    if(fbmBlocks==0) {
         return NULL;
     }
 
     //allocate and zero out the block store (calloc'ed in order to init bitmap as all zeros)
-    bs->blocks = calloc(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES);
+    void* blocks = calloc(block_count, block_size);
 
     //check for allocation errors
-    if(bs->blocks==NULL) {
-        block_store_destroy(bs);
+    if(blocks==NULL) {
         return NULL;
     }
 
-    //use the first block as the fbm and init it
-    bs->fbm = bitmap_overlay(BLOCK_STORE_AVAIL_BLOCKS, bs->blocks);
+    block_store_t* bs = block_store_wrap(blocks, block_size, block_count, fbmBlocks, -1);
+    if(bs==NULL) {
+        free(blocks);
+    }
+    return bs;
+}
+
+//preads or pwrites all len bytes at offset, either can come back short, false on error
+static bool block_store_file_io(const int fd, uint8_t *buffer, size_t len, off_t offset, const bool write) {
+    while(len>0) {
+        ssize_t done = write ? pwrite(fd, buffer, len, offset) : pread(fd, buffer, len, offset);
+        if(done<0 && errno==EINTR) {
+            continue;
+        }
+        if(done<=0) {
+            return false;
+        }
+        buffer += done;
+        len -= (size_t)done;
+        offset += done;
+    }
+    return true;
+}
+
+//records that fd now holds exactly this device, so the next flush to it only has to write what changes after this
+//takes a copy of the fbm to compare against and clears the dirty blocks, false on error
+static bool block_store_set_flushed(block_store_t *const bs, const int fd) {
+    struct stat st;
+    size_t fbmBytes = bs->fbmBlocks * bs->blockSize;
+    if(bs->fbmCopy==NULL) {
+        bs->fbmCopy = malloc(fbmBytes);
+    }
+    if(bs->fbmCopy==NULL || fstat(fd, &st)!=0) {
+        free(bs->fbmCopy);
+        bs->fbmCopy = NULL;
+        return false;
+    }
+    memcpy(bs->fbmCopy, bs->blocks, fbmBytes);
+    bitmap_test_and_reset_range(bs->dirty, 0, bitmap_get_bits(bs->dirty));
+    bs->flushDev = st.st_dev;
+    bs->flushIno = st.st_ino;
+    return true;
+}
+
+//writes user blocks [first, first + count) to their place in an image file
+//a cached device's blocks come out of its own file, which the caller has brought up to date, chunkBytes at a time through chunk
+static bool block_store_write_run(const block_store_t *const bs, const int fd, const size_t first, const size_t count, uint8_t *chunk, const size_t chunkBytes) {
+    off_t offset = (off_t)((first + bs->fbmBlocks) * bs->blockSize);
+    size_t len = count * bs->blockSize;
+    if(bs->cache==NULL) {
+        return block_store_file_io(fd, block_store_block(bs, first), len, offset, true);
+    }
+    for(size_t done = 0; done < len; done += chunkBytes) {
+        size_t part = len - done < chunkBytes ? len - done : chunkBytes;
+        if(!block_store_file_io(bs->fd, chunk, part, offset + (off_t)done, false) || !block_store_file_io(fd, chunk, part, offset + (off_t)done, true)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//copies the first totalBytes of one file to the current position of another, a chunk at a time
+//returns the bytes copied
+static size_t block_store_copy_file(const int from, const int to, const size_t totalBytes) {
+    size_t chunkBytes = 1 << 16;
+    uint8_t* chunk = malloc(chunkBytes);
+    size_t bytes = 0;
+    while(chunk!=NULL && bytes<totalBytes) {
+        size_t want = totalBytes - bytes < chunkBytes ? totalBytes - bytes : chunkBytes;
+        ssize_t got = pread(from, chunk, want, (off_t)bytes);
+        if(got<0 && errno==EINTR) {
+            continue;
+        }
+        if(got<=0) {
+            break;
+        }
+        size_t wroteAll = 0;
+        while(wroteAll<(size_t)got) {
+            ssize_t wrote = write(to, chunk + wroteAll, (size_t)got - wroteAll);
+            if(wrote<0 && errno==EINTR) {
+                continue;
+            }
+            if(wrote<=0) {
+                free(chunk);
+                return bytes + wroteAll;
+            }
+            wroteAll += (size_t)wrote;
+        }
+        bytes += wroteAll;
+    }
+    free(chunk);
+    return bytes;
+}
+
+//opens (or creates) the file behind a file-backed device and checks it's totalBytes long
+//returns the fd, -1 on error
+static int block_store_open_file(const char *const path, const int flags, const size_t totalBytes) {
+    //open the file read/write, mapped and cached devices both write back to it
+    int openFlags = O_RDWR;
+    if(flags & BLOCK_STORE_OPEN_CREATE) {
+        openFlags |= O_CREAT;
+    }
+    if(flags & BLOCK_STORE_OPEN_TRUNCATE) {
+        openFlags |= O_TRUNC;
+    }
+    int fd = open(path, openFlags, 0644);
+    if(fd<0) {
+        return -1;
+    }
+
+    //an empty file we're allowed to set up gets sized to the device, the hole reads back as zeros so the fbm starts empty
+    //anything else has to be exactly the device already
+    struct stat info;
+    if(fstat(fd, &info)!=0) {
+        close(fd);
+        return -1;
+    }
+    if(info.st_size==0 && (flags & (BLOCK_STORE_OPEN_CREATE | BLOCK_STORE_OPEN_TRUNCATE))) {
+        if(ftruncate(fd, (off_t)totalBytes)!=0) {
+            close(fd);
+            return -1;
+        }
+    }
+    else if((uint64_t)info.st_size!=totalBytes) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+///
+/// Opens a BS device stored in the given file, mapping the file into memory
+/// Nothing is read up front, blocks are paged in as they're touched and changes go straight to the file
+/// \param path The file holding the device
+/// \param flags BLOCK_STORE_OPEN_* flags
+/// \return Pointer to the BS device, NULL on error (including a file that's the wrong size)
+///
+block_store_t *block_store_open(const char *const path, const int flags) {
+    return block_store_open_ex(path, flags, BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS);
+}
+
+///
+/// Opens a BS device with the given geometry stored in the given file, mapping the file into memory
+/// \param path The file holding the device
+/// \param flags BLOCK_STORE_OPEN_* flags
+/// \param block_size Bytes per block, as given to block_store_create_ex
+/// \param block_count Total blocks on the device, as given to block_store_create_ex
+/// \return Pointer to the BS device, NULL on error (including a file that's the wrong size)
+///
+block_store_t *block_store_open_ex(const char *const path, const int flags, const size_t block_size, const size_t block_count) {
+    //make sure path and geometry are valid
+    if(path==NULL) {
+        return NULL;
+    }
+    size_t fbmBlocks = block_store_fbm_blocks(block_size, block_count);
+    if(fbmBlocks==0) {
+        return NULL;
+    }
+    size_t totalBytes = block_size * block_count;
+
+    int fd = block_store_open_file(path, flags, totalBytes);
+    if(fd<0) {
+        return NULL;
+    }
+
+    //map the whole device, the blocks and the fbm point straight into the page cache
+    void* blocks = mmap(NULL, totalBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(blocks==MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    block_store_t* bs = block_store_wrap(blocks, block_size, block_count, fbmBlocks, fd);
+    if(bs==NULL) {
+        munmap(blocks, totalBytes);
+        close(fd);
+    }
+    return bs;
+}
+
+///
+/// Opens a BS device with the given geometry stored in the given file, keeping only the FBM and a fixed-size
+///  cache of blocks in memory, so the device can be much bigger than memory
+/// The cache uses CLOCK replacement and writes dirty blocks back when they're evicted, or on sync and destroy
+///  Working sets that fit in the cache run at memory speed, see block_store_get_cache_stats
+///  Borrowing isn't supported (the block could be evicted), and neither are optimistic reads
+/// \param path The file holding the device
+/// \param flags BLOCK_STORE_OPEN_* flags
+/// \param block_size Bytes per block, as given to block_store_create_ex
+/// \param block_count Total blocks on the device, as given to block_store_create_ex
+/// \param cache_blocks How many blocks the cache holds, non-zero
+/// \return Pointer to the BS device, NULL on error (including a file that's the wrong size)
+///
+block_store_t *block_store_open_cached(const char *const path, const int flags, const size_t block_size, const size_t block_count, const size_t cache_blocks) {
+    //make sure path, geometry and cache size are valid
+    if(path==NULL || cache_blocks==0) {
+        return NULL;
+    }
+    size_t fbmBlocks = block_store_fbm_blocks(block_size, block_count);
+    if(fbmBlocks==0) {
+        return NULL;
+    }
+
+    int fd = block_store_open_file(path, flags, block_size * block_count);
+    if(fd<0) {
+        return NULL;
+    }
+
+    //only the fbm lives in memory for good, read it in
+    size_t fbmBytes = fbmBlocks * block_size;
+    void* blocks = malloc(fbmBytes);
+    size_t bytes = 0;
+    while(blocks!=NULL && bytes<fbmBytes) {
+        ssize_t got = pread(fd, (uint8_t *)blocks + bytes, fbmBytes - bytes, (off_t)bytes);
+        if(got<0 && errno==EINTR) {
+            continue;
+        }
+        if(got<=0) {
+            break;
+        }
+        bytes += (size_t)got;
+    }
+    if(blocks==NULL || bytes!=fbmBytes) {
+        free(blocks);
+        close(fd);
+        return NULL;
+    }
+
+    //the user blocks come after the fbm in the file
+    block_cache_t* cache = block_cache_create(fd, block_size, block_count - fbmBlocks, (off_t)fbmBytes, cache_blocks);
+    block_store_t* bs = cache!=NULL ? block_store_wrap(blocks, block_size, block_count, fbmBlocks, fd) : NULL;
+    if(bs==NULL) {
+        block_cache_destroy(cache);
+        free(blocks);
+        close(fd);
+        return NULL;
+    }
+    bs->cache = cache;
+    return bs;
+}
+
+///
+/// Gets a cached device's block cache counters
+/// \param bs BS device, opened with block_store_open_cached
+/// \param stats Gets the hit, miss, eviction and write-back counts
+/// \return true on success, false on error or if the device has no block cache
+///
+bool block_store_get_cache_stats(const block_store_t *const bs, block_store_cache_stats_t *const stats) {
+    //check that bs and stats are valid and there's a cache to ask
+    if(bs==NULL || stats==NULL || bs->cache==NULL) {
+        return false;
+    }
+
+    block_cache_stats_t counts;
+    if(!block_cache_get_stats(bs->cache, &counts)) {
+        return false;
+    }
+    stats->hits = counts.hits;
+    stats->misses = counts.misses;
+    stats->evictions = counts.evictions;
+    stats->writebacks = counts.writebacks;
+    stats->prefetched = counts.prefetches;
+    stats->prefetch_hits = counts.prefetch_hits;
+    return true;
+}
+
+///
+/// Flushes a file-backed BS device's changes to its file, blocking until they're written
+/// \param bs BS device
+/// \return true if everything made it to the file, false on error or if the device isn't file-backed
+///
+bool block_store_sync(block_store_t *const bs) {
+    //make sure bs is valid and actually has a file behind it
+    if(bs==NULL || bs->fd<0) {
+        return false;
+    }
+
+    //cached blocks are set in the mapped fbm, put them back first
+    block_store_flush_magazines(bs);
+
+    //only the dirty pages (or cached blocks) get written, with writers held off so each block goes out whole
+    size_t blocks = bitmap_get_bits(bs->fbm);
+    block_store_shard_lock_range(bs, 0, blocks, false);
+    bool synced = false;
+    if(bs->cache!=NULL) {
+        synced = block_store_write_back(bs) && fsync(bs->fd)==0;
+    }
+    else {
+        synced = msync(bs->blocks, bs->blockSize * bs->blockCount, MS_SYNC)==0;
+    }
+    block_store_shard_unlock_range(bs, 0, blocks);
+    return synced;
+}
+
+///
+/// Destroys the provided block storage device
+/// This is an idempotent operation, so there is no return value
+/// \param bs BS device
+///
+void block_store_destroy(block_store_t *const bs) {
+    //check that bs is valid
+    if(bs == NULL) {
+        return;
+    }
+    else {
+        //free inner objects then the whole struct
+        //the fbm goes first, it's overlaid on the blocks
+        //but the magazines give their blocks back to it before that, a mapped fbm is about to be written back
+        //and the readahead worker is stopped before anything it uses goes away
+
+        if(bs->readahead != NULL) {
+            pthread_mutex_lock(&bs->readahead->lock);
+            bs->readahead->stop = true;
+            pthread_cond_signal(&bs->readahead->wake);
+            pthread_mutex_unlock(&bs->readahead->lock);
+            if(bs->readahead->hasWorker) {
+                pthread_join(bs->readahead->worker, NULL);
+            }
+            pthread_cond_destroy(&bs->readahead->wake);
+            pthread_mutex_destroy(&bs->readahead->lock);
+            readahead_destroy(bs->readahead->detector);
+            free(bs->readahead);
+        }
+
+        if(bs->rack != NULL) {
+            block_store_flush_magazines(bs);
+            while(bs->rack->magazines != NULL) {
+                magazine* next = bs->rack->magazines->next;
+                pthread_mutex_destroy(&bs->rack->magazines->lock);
+                free(bs->rack->magazines);
+                bs->rack->magazines = next;
+            }
+            pthread_mutex_destroy(&bs->rack->lock);
+            bitmap_destroy(bs->rack->cached);
+            free(bs->rack);
+        }
+
+        if(bs->shards != NULL) {
+            for(size_t i = 0; i < bs->shardCount; i++) {
+                pthread_rwlock_destroy(&bs->shards[i].lock);
+            }
+            free(bs->shards);
+        }
+
+        if(bs->fbm != NULL) {
+            bitmap_destroy(bs->fbm);
+        }
+        buddy_destroy(bs->buddy);
+        free(bs->seqs);
+        bitmap_destroy(bs->dirty);
+        free(bs->fbmCopy);
+        pthread_mutex_destroy(&bs->buddyLock);
+        pthread_mutex_destroy(&bs->flushLock);
+
+#ifdef BLOCK_STORE_DEBUG_BORROW
+        //anything still borrowed is about to be a dangling pointer
+        for(size_t i = 0; i < bs->blockCount - bs->fbmBlocks; i++) {
+            if(bs->borrows[i]!=0) {
+                fprintf(stderr, "block_store_destroy: block %zu is still borrowed\n", i);
+            }
+        }
+        free(bs->borrows);
+#endif
+
+        //cached devices write back what's dirty and their fbm, the blocks array is just the fbm
+        //mapped devices get unmapped, the kernel writes back whatever sync didn't get to
+        if(bs->blocks != NULL) {
+            if(bs->cache != NULL) {
+                block_store_write_back(bs);
+                block_cache_destroy(bs->cache);
+                free(bs->blocks);
+                close(bs->fd);
+            }
+            else if(bs->fd >= 0) {
+                munmap(bs->blocks, bs->blockSize * bs->blockCount);
+                close(bs->fd);
+            }
+            else {
+                free(bs->blocks);
+            }
+        }
+
+        free(bs);
+    }
+}
+
+///
+/// Searches for a free block, marks it as in use, and returns the block's id
+///  which free block depends on the device's policy, see block_store_set_policy
+/// \param bs BS device
+/// \return Allocated block's id, SIZE_MAX on error
+///
+size_t block_store_allocate(block_store_t *const bs) {
+    //check that bs is valid
+    if(bs==NULL) {
+        return SIZE_MAX;
+    }
+
+    //buddy mode takes the smallest free buddy block, splitting one if it has to
+    if(bs->buddy!=NULL) {
+        pthread_mutex_lock(&bs->buddyLock);
+        size_t id = buddy_allocate(bs->buddy, 0);
+        if(id!=SIZE_MAX) {
+            bitmap_test_and_set(bs->fbm, id);
+        }
+        pthread_mutex_unlock(&bs->buddyLock);
+        return id;
+    }
+
+    //with caches on, most allocations never touch the fbm
+    if(bs->rack!=NULL) {
+        return block_store_cache_allocate(bs);
+    }
+
+    //sharded, each thread starts in its own shard's slice of the fbm so threads aren't all fighting over the first free word
+    if(bs->shards!=NULL) {
+        if(threadShard==SIZE_MAX) {
+            threadShard = __atomic_fetch_add(&nextThreadShard, 1, __ATOMIC_RELAXED);
+        }
+        return bitmap_find_zero_and_set(bs->fbm, (threadShard % bs->shardCount) * bs->shardBlocks);
+    }
+
+    //the other policies have to look at the free runs before claiming one
+    if(bs->policy!=BLOCK_STORE_FIRST_FIT) {
+        return block_store_claim(bs, 1);
+    }
+
+    //find the first free (zero) in the fbm and mark it in use in one atomic step,
+    //so two threads allocating at once can't both get the same block
+    size_t firstFree = 0;
+    firstFree = bitmap_find_zero_and_set(bs->fbm, 0);
+
+    //SIZE_MAX if there was no open slot
+    return firstFree;
+}
+
+///
+/// Attempts to allocate the requested block id
+/// \param bs the block store object
+/// \block_id the requested block identifier
+/// \return boolean indicating succes of operation
+///
+bool block_store_request(block_store_t *const bs, const size_t block_id) {
+    //make sure that bs and block_id are valid
+    if(bs == NULL || block_id>=bitmap_get_bits(bs->fbm)) {
+        return false;
+    }
+
+    //buddy mode has to cut the block out of the index as well
+    if(bs->buddy!=NULL) {
+        pthread_mutex_lock(&bs->buddyLock);
+        bool wasSet = bitmap_test_and_set(bs->fbm, block_id);
+        if(!wasSet) {
+            buddy_claim(bs->buddy, block_id, 1);
+        }
+        pthread_mutex_unlock(&bs->buddyLock);
+        return !wasSet;
+    }
+
+    //atomically mark the block set in the fbm and see if it was set already
+    bool isSet = false;
+    isSet = bitmap_test_and_set(bs->fbm, block_id);
+
+    //a set block might just be sitting in a magazine, taking its cached bit takes it from there
+    if(isSet && bs->rack!=NULL) {
+        return bitmap_test_and_reset(bs->rack->cached, block_id);
+    }
+
+    //if it was not set, then it is ours to use, else false - it is already in use
+    return !isSet;
+}
+
+///
+/// Frees the specified block
+/// \param bs BS device
+/// \param block_id The block to free
+///
+void block_store_release(block_store_t *const bs, const size_t block_id) {
+    //check that bs and block_id are valid
+    if(bs==NULL || block_id>=bitmap_get_bits(bs->fbm)) {
+        return;
+    }
+
+#ifdef BLOCK_STORE_DEBUG_BORROW
+    //someone still has a pointer into this block, refuse rather than let it be handed out again
+    if(__atomic_load_n(&bs->borrows[block_id], __ATOMIC_ACQUIRE)!=0) {
+        fprintf(stderr, "block_store_release: block %zu is still borrowed, not releasing it\n", block_id);
+        return;
+    }
+#endif
+
+    //buddy mode merges it back, but only if it was actually in use, freeing a free block twice breaks the index
+    if(bs->buddy!=NULL) {
+        pthread_mutex_lock(&bs->buddyLock);
+        block_store_seq_begin(bs, block_id, 1);
+        if(bitmap_test_and_reset(bs->fbm, block_id)) {
+            buddy_release(bs->buddy, block_id, 1);
+        }
+        block_store_seq_end(bs, block_id, 1);
+        pthread_mutex_unlock(&bs->buddyLock);
+        return;
+    }
+
+    //with caches on it goes into this thread's magazine for the next allocate
+    //it stays set in the fbm but its cached bit is set, which the data paths treat as free
+    //optimistic readers of it see its sequence move and retry, then find it free
+    if(bs->rack!=NULL) {
+        block_store_seq_begin(bs, block_id, 1);
+        block_store_cache_release(bs, block_id);
+        block_store_seq_end(bs, block_id, 1);
+        return;
+    }
+
+    //release (zero out) the given block_id in the fbm, atomically so other threads' updates to the same word survive
+    //sharded, wait for anyone still reading or writing it
+    //optimistic readers of it see its sequence move and retry
+    block_store_shard_lock(bs, block_id, true);
+    block_store_seq_begin(bs, block_id, 1);
+    bitmap_test_and_reset(bs->fbm, block_id);
+    block_store_seq_end(bs, block_id, 1);
+    block_store_shard_unlock(bs, block_id);
+}
+
+///
+/// Allocates n blocks in one sweep of the FBM, all or nothing
+/// \param bs BS device
+/// \param n Number of blocks to allocate
+/// \param out_ids Gets the allocated block ids, in ascending order
+/// \return true if all n were allocated, false on error or if there aren't n free blocks (nothing is allocated then)
+///
+bool block_store_allocate_n(block_store_t *const bs, const size_t n, size_t *const out_ids) {
+    //check that bs and out_ids are valid
+    if(bs==NULL || out_ids==NULL) {
+        return false;
+    }
+
+    //buddy mode sweeps from the front too, then cuts each block out of the index
+    if(bs->buddy!=NULL) {
+        pthread_mutex_lock(&bs->buddyLock);
+        bool found = bitmap_find_zeros_and_set(bs->fbm, n, out_ids, 0);
+        for(size_t i = 0; found && i < n; i++) {
+            buddy_claim(bs->buddy, out_ids[i], 1);
+        }
+        pthread_mutex_unlock(&bs->buddyLock);
+        return found;
+    }
+
+    //claim them all in one pass from the front (or the cursor for next fit), the fbm hands them back if it comes up short
+    bool nextFit = bs->policy==BLOCK_STORE_NEXT_FIT;
+    if(!bitmap_find_zeros_and_set(bs->fbm, n, out_ids, nextFit ? __atomic_load_n(&bs->cursor, __ATOMIC_RELAXED) : 0)) {
+        return false;
+    }
+    if(nextFit && n>0) {
+        __atomic_store_n(&bs->cursor, out_ids[n - 1] + 1, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+//orders block ids for block_store_release_n
+static int block_store_compare_ids(const void *a, const void *b) {
+    const size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+///
+/// Frees many blocks at once, invalid ids are skipped
+/// \param bs BS device
+/// \param block_ids The blocks to free
+/// \param n Number of block ids
+///
+void block_store_release_n(block_store_t *const bs, const size_t *const block_ids, const size_t n) {
+    //check that bs and block_ids are valid
+    if(bs==NULL || block_ids==NULL) {
+        return;
+    }
+
+    //gather the valid ids, sorted, so the sweep walks the fbm front to back and neighbours merge into runs
+    size_t blocks = bitmap_get_bits(bs->fbm);
+    size_t* ids = n>0 && n<=SIZE_MAX / sizeof(size_t) ? malloc(n * sizeof(size_t)) : NULL;
+    if(ids==NULL) {
+        //no room to sort, release does the per-id checks
+        for(size_t i = 0; i < n; i++) {
+            block_store_release(bs, block_ids[i]);
+        }
+        return;
+    }
+    size_t count = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(block_ids[i]>=blocks) {
+            continue;
+        }
+#ifdef BLOCK_STORE_DEBUG_BORROW
+        //same rule as block_store_release, a borrowed block is skipped
+        if(__atomic_load_n(&bs->borrows[block_ids[i]], __ATOMIC_ACQUIRE)!=0) {
+            fprintf(stderr, "block_store_release_n: block %zu is still borrowed, not releasing it\n", block_ids[i]);
+            continue;
+        }
+#endif
+        ids[count++] = block_ids[i];
+    }
+    qsort(ids, count, sizeof(size_t), block_store_compare_ids);
+    size_t unique = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(unique==0 || ids[i]!=ids[unique - 1]) {
+            ids[unique++] = ids[i];
+        }
+    }
+
+    //one lock acquisition for the whole sweep, the buddy lock or just the shards the ids fall in
+    bool* shards = NULL;
+    if(bs->buddy!=NULL) {
+        pthread_mutex_lock(&bs->buddyLock);
+    } else if(bs->rack==NULL) {
+        shards = block_store_shard_lock_ids(bs, ids, unique, true);
+    }
+
+    size_t run = 0;
+    while(run < unique) {
+        size_t end = run + 1;
+        while(end<unique && ids[end]==ids[end - 1] + 1) {
+            end++;
+        }
+        const size_t first = ids[run], len = end - run;
+        block_store_seq_begin(bs, first, len);
+        if(bs->buddy!=NULL) {
+            //only the parts that were in use go back, freeing a free block twice breaks the index
+            size_t start = bitmap_next_set(bs->fbm, first);
+            while(start!=SIZE_MAX && start<first + len) {
+                size_t stop = bitmap_next_zero(bs->fbm, start);
+                if(stop==SIZE_MAX || stop>first + len) {
+                    stop = first + len;
+                }
+                bitmap_test_and_reset_range(bs->fbm, start, stop - start);
+                buddy_release(bs->buddy, start, stop - start);
+                start = stop<first + len ? bitmap_next_set(bs->fbm, stop) : SIZE_MAX;
+            }
+        } else if(bs->rack!=NULL) {
+            //cached blocks are already free, clearing them would let the magazine hand out a block someone else has
+            for(size_t i = first; i < first + len; i++) {
+                if(!bitmap_test(bs->rack->cached, i)) {
+                    bitmap_test_and_reset(bs->fbm, i);
+                }
+            }
+        } else {
+            //a word at a time, however many of the run's ids share it
+            bitmap_test_and_reset_range(bs->fbm, first, len);
+        }
+        block_store_seq_end(bs, first, len);
+        run = end;
+    }
+
+    if(bs->buddy!=NULL) {
+        pthread_mutex_unlock(&bs->buddyLock);
+    } else if(bs->rack==NULL) {
+        block_store_shard_unlock_ids(bs, shards);
+    }
+    free(ids);
+}
+
+///
+/// Picks how block_store_allocate and block_store_allocate_extent choose among free runs
+///  (block_store_allocate_n sweeps from the front, or from the cursor for next fit)
+/// \param bs BS device
+/// \param policy One of the BLOCK_STORE_*_FIT policies, first fit is the default
+/// \return true if the policy was set, false on error
+///
+bool block_store_set_policy(block_store_t *const bs, const BLOCK_STORE_POLICY policy) {
+    //check that bs and the policy are valid
+    if(bs==NULL || policy<BLOCK_STORE_FIRST_FIT || policy>BLOCK_STORE_WORST_FIT) {
+        return false;
+    }
+
+    bs->policy = policy;
+    return true;
+}
+
+///
+/// Allocates count physically adjacent blocks, chosen by the device's policy
+/// \param bs BS device
+/// \param count Number of blocks, non-zero
+/// \param first_id Gets the first block id of the extent, the rest follow it
+/// \return true if the extent was allocated, false on error or if there's no free run that long
+///
+bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const first_id) {
+    //check that bs, count and first_id are valid
+    if(bs==NULL || first_id==NULL || count==0 || count>bitmap_get_bits(bs->fbm)) {
+        return false;
+    }
+
+    //find a spot by policy (or buddy) and claim the whole run
+    size_t start = bs->buddy!=NULL ? block_store_buddy_claim(bs, count) : block_store_claim(bs, count);
+    if(start==SIZE_MAX) {
+        return false;
+    }
+
+    *first_id = start;
+    return true;
+}
+
+///
+/// Frees count blocks starting at first_id
+/// \param bs BS device
+/// \param first_id The first block of the extent
+/// \param count Number of blocks, the extent must fit on the device
+///
+void block_store_release_extent(block_store_t *const bs, const size_t first_id, const size_t count) {
+    //check that bs and the extent are valid
+    if(bs==NULL || count==0 || first_id>=bitmap_get_bits(bs->fbm) || count>bitmap_get_bits(bs->fbm) - first_id) {
+        return;
+    }
+
+#ifdef BLOCK_STORE_DEBUG_BORROW
+    //same rule as block_store_release, but for the whole extent
+    for(size_t i = first_id; i < first_id + count; i++) {
+        if(__atomic_load_n(&bs->borrows[i], __ATOMIC_ACQUIRE)!=0) {
+            fprintf(stderr, "block_store_release_extent: block %zu is still borrowed, not releasing the extent\n", i);
+            return;
+        }
+    }
+#endif
+
+    //buddy mode gives back only the runs that were in use, freeing a free block twice breaks the index
+    if(bs->buddy!=NULL) {
+        const size_t end = first_id + count;
+        pthread_mutex_lock(&bs->buddyLock);
+        size_t start = bitmap_next_set(bs->fbm, first_id);
+        while(start!=SIZE_MAX && start<end) {
+            size_t stop = bitmap_next_zero(bs->fbm, start);
+            if(stop==SIZE_MAX || stop>end) {
+                stop = end;
+            }
+            block_store_seq_begin(bs, start, stop - start);
+            bitmap_test_and_reset_range(bs->fbm, start, stop - start);
+            block_store_seq_end(bs, start, stop - start);
+            buddy_release(bs->buddy, start, stop - start);
+            start = stop<end ? bitmap_next_set(bs->fbm, stop) : SIZE_MAX;
+        }
+        pthread_mutex_unlock(&bs->buddyLock);
+        return;
+    }
+
+    //cached blocks are already free, clearing them would let the magazine hand out a block someone else has
+    if(bs->rack!=NULL) {
+        block_store_seq_begin(bs, first_id, count);
+        for(size_t i = first_id; i < first_id + count; i++) {
+            if(!bitmap_test(bs->rack->cached, i)) {
+                bitmap_test_and_reset(bs->fbm, i);
+            }
+        }
+        block_store_seq_end(bs, first_id, count);
+        return;
+    }
+
+    //clear the extent a word at a time, once nobody's reading or writing any of it
+    block_store_shard_lock_range(bs, first_id, count, true);
+    block_store_seq_begin(bs, first_id, count);
+    bitmap_test_and_reset_range(bs->fbm, first_id, count);
+    block_store_seq_end(bs, first_id, count);
+    block_store_shard_unlock_range(bs, first_id, count);
+}
+
+///
+/// Switches the device to buddy allocation, for callers that allocate power-of-two extents and free them in bulk
+///  block_store_allocate_extent then hands out 2^k aligned blocks (rounding count up and giving the tail back),
+///  release merges freed buddies back together, and the policy is ignored
+///  The buddy index is rebuilt from the FBM, which stays the only thing that's persisted
+///  Call it before sharing the device between threads, or again to rebuild the index
+/// \param bs BS device
+/// \param max_order Biggest buddy block is 2^max_order blocks, at most 32, clamped to the device
+/// \return true if buddy mode is on, false on error
+///
+bool block_store_enable_buddy(block_store_t *const bs, const size_t max_order) {
+    //check that bs and max_order are valid, the buddy index can't see blocks in magazines
+    if(bs==NULL || max_order>BUDDY_MAX_ORDER || bs->rack!=NULL || bs->shards!=NULL) {
+        return false;
+    }
+
+    //build the new index from the fbm before dropping the old one
+    pthread_mutex_lock(&bs->buddyLock);
+    buddy_t* buddy = buddy_create(bs->fbm, max_order);
+    if(buddy!=NULL) {
+        buddy_destroy(bs->buddy);
+        bs->buddy = buddy;
+    }
+    pthread_mutex_unlock(&bs->buddyLock);
+
+    return buddy!=NULL;
+}
 
-    return bs;
+///
+/// Puts a per-thread cache (magazine) of free blocks in front of the FBM
+///  block_store_allocate pops from the calling thread's magazine, refilling it with magazine_size / 2 blocks in one
+///  FBM sweep, and block_store_release pushes onto it, spilling the older half back when it's full
+///  Cached blocks are set in the FBM but count as free (fragmentation stats see them as used),
+///  block_store_request can still take them, and sync, serialize and destroy give them back first
+///  so the FBM that's persisted is exact
+///  Call it before sharing the device between threads, it can't be combined with buddy mode
+/// \param bs BS device
+/// \param magazine_size Blocks each thread's magazine holds, non-zero
+/// \return true if the caches are on, false on error
+///
+bool block_store_enable_caches(block_store_t *const bs, const size_t magazine_size) {
+    //check that bs and magazine_size are valid, and that this isn't being done twice
+    if(bs==NULL || magazine_size==0 || bs->rack!=NULL || bs->buddy!=NULL || bs->shards!=NULL) {
+        return false;
+    }
+
+    magazineRack* rack = malloc(sizeof(magazineRack));
+    if(rack==NULL) {
+        return false;
+    }
+    rack->cached = bitmap_create(bitmap_get_bits(bs->fbm));
+    if(rack->cached==NULL) {
+        free(rack);
+        return false;
+    }
+    pthread_mutex_init(&rack->lock, NULL);
+    rack->magazines = NULL;
+    rack->magazineSize = magazine_size;
+    rack->id = __atomic_fetch_add(&nextRackId, 1, __ATOMIC_RELAXED);
+    bs->rack = rack;
+    return true;
 }
 
 ///
-/// Destroys the provided block storage device
-/// This is an idempotent operation, so there is no return value
+/// Gives every thread's cached blocks back to the FBM, so it says exactly which blocks are in use
+///  sync, serialize and destroy do this themselves
 /// \param bs BS device
 ///
-void block_store_destroy(block_store_t *const bs) {
+void block_store_flush_caches(block_store_t *const bs) {
     //check that bs is valid
-    if(bs == NULL) {
+    if(bs==NULL) {
         return;
     }
-    else {
-        //free inner objects then the whole struct
-        
-        if(bs->blocks != NULL) {
-            free(bs->blocks);
 
-        }
+    block_store_flush_magazines(bs);
+}
 
-        if(bs->fbm != NULL) {
-            free(bs->fbm);
-        }
+///
+/// Makes the device safe to share between threads, with the block ids split into shards that each have a
+///  reader-writer lock over their slice of the FBM
+///  Reads of blocks hold their shard's lock shared, so reads proceed in parallel, while writes and releases hold
+///  it exclusive (readv/writev, release_n and extents lock every shard they touch)
+///  Syncs, serializes and flushes only read the device, so they hold every shard shared, waiting out writers
+///  Allocation is lock-free on the FBM, each thread starts looking in its own shard (the policy only applies to extents)
+///  Call it before sharing the device, it can't be combined with buddy mode or the magazine caches
+/// \param bs BS device
+/// \param shards Number of shards, non-zero, fewer are used if the device is too small (each covers at least 64 blocks)
+/// \return true if the device is sharded, false on error
+///
+bool block_store_enable_sharding(block_store_t *const bs, const size_t shards) {
+    //check that bs and shards are valid, and that this isn't being done twice
+    if(bs==NULL || shards==0 || bs->shards!=NULL || bs->buddy!=NULL || bs->rack!=NULL) {
+        return false;
+    }
 
-        free(bs);
+    //split the ids evenly, rounded up to whole fbm words
+    size_t blocks = bitmap_get_bits(bs->fbm);
+    size_t shardBlocks = (blocks + shards - 1) / shards;
+    shardBlocks = (shardBlocks + 63) & ~(size_t)63;
+    size_t shardCount = (blocks + shardBlocks - 1) / shardBlocks;
+
+    blockShard* shardArray = aligned_alloc(64, shardCount * sizeof(blockShard));
+    if(shardArray==NULL) {
+        return false;
     }
+    for(size_t i = 0; i < shardCount; i++) {
+        pthread_rwlock_init(&shardArray[i].lock, NULL);
+    }
+    bs->shardBlocks = shardBlocks;
+    bs->shardCount = shardCount;
+    bs->shards = shardArray;
+    return true;
 }
 
 ///
-/// Searches for a free block, marks it as in use, and returns the block's id
+/// Turns on optimistic reads: block_store_read and block_store_pread take no lock at all, they copy the block and
+///  retry if a write or release of it happened meanwhile, which each group of group_blocks blocks tracks with a
+///  sequence counter
+///  Writes (write, pwrite, writev) and releases bump the sequence, writes to the same group wait on each other
+///  Writes through block_store_borrow_mut pointers aren't seen, and readv still takes the shard locks
+///  Works with or without sharding, call it before sharing the device between threads
 /// \param bs BS device
-/// \return Allocated block's id, SIZE_MAX on error
+/// \param group_blocks Blocks per sequence counter, non-zero, 1 gives every block its own
+/// \return true if optimistic reads are on, false on error
 ///
-size_t block_store_allocate(block_store_t *const bs) {
-    //check that bs is valid
-    if(bs==NULL) {
-        return SIZE_MAX;
+bool block_store_enable_seqlock(block_store_t *const bs, const size_t group_blocks) {
+    //check that bs and group_blocks are valid, and that this isn't being done twice
+    //a cached device's blocks can be evicted mid-copy, so it can't read without locking
+    if(bs==NULL || group_blocks==0 || bs->seqs!=NULL || bs->cache!=NULL) {
+        return false;
     }
 
-    //find the first free (zero) by using the fbm
-    size_t firstFree = 0;
-    firstFree = bitmap_ffz(bs->fbm);
-    
-    //make sure that there is an open slot and no error returned
-    if(firstFree == SIZE_MAX) {
-        return firstFree;
+    size_t blocks = bitmap_get_bits(bs->fbm);
+    uint32_t* seqs = calloc((blocks + group_blocks - 1) / group_blocks, sizeof(uint32_t));
+    if(seqs==NULL) {
+        return false;
     }
-    
-    //mark the block as in use in the fbm
-    bitmap_set(bs->fbm, firstFree);
-
-    return firstFree;
+    bs->seqBlocks = group_blocks;
+    bs->seqs = seqs;
+    return true;
 }
 
 ///
-/// Attempts to allocate the requested block id
-/// \param bs the block store object
-/// \block_id the requested block identifier
-/// \return boolean indicating succes of operation
+/// Turns on readahead for a file-backed BS device: reads (read, pread, readv) are watched for ascending
+///  sequential or strided patterns, a few streams at a time, and the blocks a stream is about to read are
+///  fetched while it's still busy with the ones before them
+///  Windows start at a few blocks and double each time the reader catches up, up to max_window
+///  Cached devices get a thread that reads the windows into the block cache (max_window is held to half the
+///  cache), mapped devices ask the kernel to page them in
+/// \param bs BS device, opened with block_store_open, block_store_open_ex or block_store_open_cached
+/// \param max_window Largest window in blocks, at least 4
+/// \return true if readahead is on, false on error or if the device isn't file-backed
 ///
-bool block_store_request(block_store_t *const bs, const size_t block_id) {
-    //make sure that bs and block_id are valid
-    if(bs == NULL || block_id>block_store_get_total_blocks()) {
+bool block_store_enable_readahead(block_store_t *const bs, const size_t max_window) {
+    //check that bs is valid and file-backed, and that this isn't being done twice
+    if(bs==NULL || bs->fd<0 || bs->readahead!=NULL) {
         return false;
     }
 
-    //check to see if the requested block_id is set in the fbm
-    bool isSet = false;
-    isSet = bitmap_test(bs->fbm, block_id);
-
-    //if it is not set, then mark set and return that it can be used, else false - it is already in use
-    if(!isSet) {
-        bitmap_set(bs->fbm, block_id);
-        return true;
+    //a window bigger than half the cache would push out the one before it before it gets read
+    size_t window = max_window;
+    if(bs->cache!=NULL && window>block_cache_get_capacity(bs->cache) / 2) {
+        window = block_cache_get_capacity(bs->cache) / 2;
     }
-    else {
+    prefetcher* ra = calloc(1, sizeof(prefetcher));
+    readahead_t* detector = readahead_create(bitmap_get_bits(bs->fbm), BLOCK_STORE_READAHEAD_STREAMS, window);
+    if(ra==NULL || detector==NULL) {
+        free(ra);
+        readahead_destroy(detector);
         return false;
     }
+    ra->detector = detector;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->wake, NULL);
+    bs->readahead = ra;
+
+    if(bs->cache!=NULL) {
+        ra->hasWorker = pthread_create(&ra->worker, NULL, block_store_readahead_worker, bs)==0;
+        if(!ra->hasWorker) {
+            bs->readahead = NULL;
+            pthread_cond_destroy(&ra->wake);
+            pthread_mutex_destroy(&ra->lock);
+            readahead_destroy(detector);
+            free(ra);
+            return false;
+        }
+    }
+    return true;
 }
 
 ///
-/// Frees the specified block
+/// Measures how fragmented the free space is
 /// \param bs BS device
-/// \param block_id The block to free
+/// \param stats Gets the free block count, the free runs, and their size histogram
+/// \return true on success, false on error
 ///
-void block_store_release(block_store_t *const bs, const size_t block_id) {
-    //check that bs and block_id are valid
-    if(bs==NULL || block_id>block_store_get_total_blocks()) {
-        return;
+bool block_store_fragmentation_stats(const block_store_t *const bs, block_store_fragmentation_t *const stats) {
+    //check that bs and stats are valid
+    if(bs==NULL || stats==NULL) {
+        return false;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    //one walk over the free runs
+    size_t length = 0;
+    for(size_t start = block_store_next_free_run(bs, 0, &length); start!=SIZE_MAX; start = block_store_next_free_run(bs, start + length, &length)) {
+        stats->free_blocks += length;
+        stats->free_runs++;
+        if(length>stats->largest_free_run) {
+            stats->largest_free_run = length;
+        }
+        //bucket k holds runs of 2^k up to 2^(k+1) - 1 blocks
+        stats->run_histogram[63 - __builtin_clzll((unsigned long long)length)]++;
     }
-    //release (zero out) the given block_id in the fbm
-    bitmap_reset(bs->fbm, block_id);
+
+    return true;
 }
 
 ///
@@ -152,7 +1736,11 @@ size_t block_store_get_used_blocks(const block_store_t *const bs) {
     }
 
     //get and return amount of total blocks that are in use (set bits)
+    //blocks in magazines are set but free
     size_t totalSet = bitmap_total_set(bs->fbm);
+    if(bs->rack!=NULL) {
+        totalSet -= bitmap_total_set(bs->rack->cached);
+    }
 
     return totalSet;
 }
@@ -168,8 +1756,11 @@ size_t block_store_get_free_blocks(const block_store_t *const bs) {
         return SIZE_MAX;
     }
 
-    //total bits in fbm - total set in fbm = total free in fbm
+    //total bits in fbm - total set in fbm = total free in fbm, plus whatever's free in magazines
     size_t totalFree = bitmap_get_bits(bs->fbm) - bitmap_total_set(bs->fbm);
+    if(bs->rack!=NULL) {
+        totalFree += bitmap_total_set(bs->rack->cached);
+    }
 
     return totalFree;
 }
@@ -183,6 +1774,36 @@ size_t block_store_get_total_blocks() {
     return BLOCK_STORE_AVAIL_BLOCKS;
 }
 
+///
+/// Returns the number of user-addressable blocks on this device
+///  (the device's block count minus the blocks the FBM takes)
+/// \param bs BS device
+/// \return Total blocks, 0 on error
+///
+size_t block_store_get_block_count(const block_store_t *const bs) {
+    //make sure bs is valid
+    if(bs==NULL) {
+        return 0;
+    }
+
+    //one bit in the fbm per user block
+    return bitmap_get_bits(bs->fbm);
+}
+
+///
+/// Returns the size of this device's blocks
+/// \param bs BS device
+/// \return Bytes per block, 0 on error
+///
+size_t block_store_get_block_size(const block_store_t *const bs) {
+    //make sure bs is valid
+    if(bs==NULL) {
+        return 0;
+    }
+
+    return bs->blockSize;
+}
+
 ///
 /// Reads data from the specified block and writes it to the designated buffer
 /// \param bs BS device
@@ -192,19 +1813,29 @@ size_t block_store_get_total_blocks() {
 ///
 size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer) {
     //check to make sure bs, buffer, and block_id are valid
-    if(bs==NULL || buffer==NULL || block_id>block_store_get_total_blocks()) {
+    if(bs==NULL || buffer==NULL || block_id>=bitmap_get_bits(bs->fbm)) {
         return 0;
     }
 
-    //make sure this block is actually in use
-    if(bitmap_test(bs->fbm, block_id)==0) {
-        return 0;
+    //optimistic reads never lock, they copy and check nobody wrote it meanwhile
+    if(bs->seqs!=NULL) {
+        return block_store_seq_read(bs, block_id, 0, bs->blockSize, buffer);
     }
-    else {
+
+    //sharded, other readers can carry on but nobody can write or release it under us
+    block_store_shard_lock(bs, block_id, false);
+
+    //make sure this block is actually in use
+    size_t bytes = 0;
+    if(block_store_in_use(bs, block_id)) {
         //copy contents from specified block into buffer
-        memcpy(buffer, (bs->blocks+(block_id*BLOCK_SIZE_BYTES)), BLOCK_SIZE_BYTES);
-        return BLOCK_SIZE_BYTES;
+        if(block_store_copy(bs, block_id, 0, bs->blockSize, buffer, true)) {
+            bytes = bs->blockSize;
+        }
     }
+
+    block_store_shard_unlock(bs, block_id);
+    return bytes;
 }
 
 ///
@@ -216,27 +1847,370 @@ size_t block_store_read(const block_store_t *const bs, const size_t block_id, vo
 ///
 size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer) {
     //validate bs, buffer, block_id
-    if(bs==NULL || buffer==NULL || block_id>block_store_get_total_blocks()) {
+    if(bs==NULL || buffer==NULL || block_id>=bitmap_get_bits(bs->fbm)) {
         return 0;
     }
 
+    //sharded, wait until nobody's reading it
+    block_store_shard_lock(bs, block_id, true);
+
     //make sure that the block has been requested first and can be written to
-    if(bitmap_test(bs->fbm, block_id)==0) {
+    size_t bytes = 0;
+    if(block_store_in_use(bs, block_id)) {
+        //copy contents from buffer into the proper id in the block array
+        block_store_seq_begin(bs, block_id, 1);
+        if(block_store_copy(bs, block_id, 0, bs->blockSize, (void *)buffer, false)) {
+            bytes = bs->blockSize;
+        }
+        block_store_seq_end(bs, block_id, 1);
+    }
+
+    block_store_shard_unlock(bs, block_id);
+    return bytes;
+}
+
+///
+/// Reads part of the specified block into the designated buffer
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param offset Where in the block to start
+/// \param len Number of bytes to read, offset + len can't go past the end of the block
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_pread(const block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, void *buffer) {
+    //check to make sure bs, buffer, and block_id are valid, and the range is inside the block
+    //offset is checked on its own first so offset + len can't wrap
+    if(bs==NULL || buffer==NULL || block_id>=bitmap_get_bits(bs->fbm) || len==0 || offset>=bs->blockSize || len>bs->blockSize - offset) {
         return 0;
     }
-    else {
-        //copy contents from buffer into the proper id in the block array
-        memcpy((bs->blocks+(block_id*BLOCK_SIZE_BYTES)), buffer, BLOCK_SIZE_BYTES);
-        return BLOCK_SIZE_BYTES;
+
+    //lock-free like block_store_read when optimistic reads are on
+    if(bs->seqs!=NULL) {
+        return block_store_seq_read(bs, block_id, offset, len, buffer);
+    }
+
+    //make sure this block is actually in use, under the shard lock like block_store_read
+    block_store_shard_lock(bs, block_id, false);
+    size_t bytes = 0;
+    if(block_store_in_use(bs, block_id)) {
+        //copy just the requested range into buffer
+        if(block_store_copy(bs, block_id, offset, len, buffer, true)) {
+            bytes = len;
+        }
+    }
+    block_store_shard_unlock(bs, block_id);
+    return bytes;
+}
+
+///
+/// Writes part of the specified block from the designated buffer, the rest of the block is left alone
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param offset Where in the block to start
+/// \param len Number of bytes to write, offset + len can't go past the end of the block
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_pwrite(block_store_t *const bs, const size_t block_id, const size_t offset, const size_t len, const void *buffer) {
+    //validate bs, buffer, block_id, and the range
+    if(bs==NULL || buffer==NULL || block_id>=bitmap_get_bits(bs->fbm) || len==0 || offset>=bs->blockSize || len>bs->blockSize - offset) {
+        return 0;
+    }
+
+    //make sure that the block has been requested first and can be written to, under the shard lock like block_store_write
+    block_store_shard_lock(bs, block_id, true);
+    size_t bytes = 0;
+    if(block_store_in_use(bs, block_id)) {
+        //patch just the requested range, no need to read the block out and write it all back
+        block_store_seq_begin(bs, block_id, 1);
+        if(block_store_copy(bs, block_id, offset, len, (void *)buffer, false)) {
+            bytes = len;
+        }
+        block_store_seq_end(bs, block_id, 1);
+    }
+    block_store_shard_unlock(bs, block_id);
+    return bytes;
+}
+
+///
+/// Gets a pointer straight into the specified block, no copy
+/// The pointer is good until the block is released or the device is destroyed
+///  pair every borrow with block_store_unborrow, debug builds refuse to release a borrowed block
+/// \param bs BS device
+/// \param block_id The block to borrow
+/// \return Pointer to the block's data, NULL on error (including blocks not in use)
+///
+const void *block_store_borrow(const block_store_t *const bs, const size_t block_id) {
+    //check to make sure bs and block_id are valid
+    if(bs==NULL || block_id>=bitmap_get_bits(bs->fbm)) {
+        return NULL;
+    }
+
+    //make sure this block is actually in use, and in memory for good, a cached block could be evicted under the borrower
+    if(!block_store_in_use(bs, block_id) || bs->cache!=NULL) {
+        return NULL;
+    }
+
+#ifdef BLOCK_STORE_DEBUG_BORROW
+    __atomic_add_fetch(&bs->borrows[block_id], 1, __ATOMIC_ACQ_REL);
+#endif
+    return block_store_block(bs, block_id);
+}
+
+///
+/// Gets a writable pointer straight into the specified block, no copy
+/// Same rules as block_store_borrow
+/// \param bs BS device
+/// \param block_id The block to borrow
+/// \return Pointer to the block's data, NULL on error (including blocks not in use)
+///
+void *block_store_borrow_mut(block_store_t *const bs, const size_t block_id) {
+    //same checks, the only difference is what the caller is allowed to do with it
+    //we can't see the writes, so the block counts as changed from when it's borrowed
+    void* data = (void *)block_store_borrow(bs, block_id);
+    if(data!=NULL) {
+        block_store_mark_dirty(bs, block_id, 1);
+    }
+    return data;
+}
+
+///
+/// Hands back a pointer from block_store_borrow or block_store_borrow_mut
+/// \param bs BS device
+/// \param block_id The block that was borrowed
+///
+void block_store_unborrow(const block_store_t *const bs, const size_t block_id) {
+    //check that bs and block_id are valid
+    if(bs==NULL || block_id>=bitmap_get_bits(bs->fbm)) {
+        return;
+    }
+
+#ifdef BLOCK_STORE_DEBUG_BORROW
+    //undo the borrow, but never wrap below zero on an unmatched unborrow
+    uint32_t count = __atomic_load_n(&bs->borrows[block_id], __ATOMIC_ACQUIRE);
+    do {
+        if(count==0) {
+            fprintf(stderr, "block_store_unborrow: block %zu wasn't borrowed\n", block_id);
+            return;
+        }
+    } while(!__atomic_compare_exchange_n(&bs->borrows[block_id], &count, count - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+#endif
+}
+
+//a position in a list of buffers, walking them as if they were one flat buffer
+typedef struct {
+    const struct iovec* iov;
+    size_t index;  //which buffer we're in
+    size_t offset; //bytes into that buffer
+} iovCursor;
+
+//copies bytes between a run of blocks and the buffers at the cursor and moves the cursor past them
+//blockData NULL just skips the bytes, toBuffers says which way the copy goes
+static void block_store_iov_copy(iovCursor *const cursor, uint8_t *blockData, size_t bytes, const bool toBuffers) {
+    while(bytes>0) {
+        const struct iovec* vec = &cursor->iov[cursor->index];
+        size_t chunk = vec->iov_len - cursor->offset;
+
+        //used this buffer up, on to the next
+        if(chunk==0) {
+            cursor->index++;
+            cursor->offset = 0;
+            continue;
+        }
+        if(chunk>bytes) {
+            chunk = bytes;
+        }
+
+        if(blockData!=NULL) {
+            uint8_t* bufferData = (uint8_t *)vec->iov_base + cursor->offset;
+            if(toBuffers) {
+                memcpy(bufferData, blockData, chunk);
+            }
+            else {
+                memcpy(blockData, bufferData, chunk);
+            }
+            blockData += chunk;
+        }
+        cursor->offset += chunk;
+        bytes -= chunk;
+    }
+}
+
+//shared body of readv and writev
+static size_t block_store_transfer(const block_store_t *const bs, const size_t *const block_ids, const size_t count, const struct iovec *const iov, const size_t iovcnt, size_t *const status, const bool toBuffers) {
+    //validate everything once up front
+    if(bs==NULL || block_ids==NULL || iov==NULL || count==0) {
+        return 0;
+    }
+
+    //the buffers have to hold every block, checked here so the copies don't have to
+    size_t space = 0;
+    for(size_t i = 0; i < iovcnt; i++) {
+        if(iov[i].iov_base==NULL && iov[i].iov_len>0) {
+            return 0;
+        }
+        space += iov[i].iov_len;
+    }
+    if(space / bs->blockSize < count) {
+        return 0;
+    }
+
+    //sharded, take the shards the ids are in, shared for reads and exclusive for writes
+    size_t blocks = bitmap_get_bits(bs->fbm);
+    bool* shards = block_store_shard_lock_ids(bs, block_ids, count, !toBuffers);
+    iovCursor cursor = {iov, 0, 0};
+    size_t totalBytes = 0;
+    size_t i = 0;
+    while(i<count) {
+        //blocks out of range or not in use are skipped, their part of the buffers is left alone
+        if(block_ids[i]>=blocks || !block_store_in_use(bs, block_ids[i])) {
+            if(status!=NULL) {
+                status[i] = 0;
+            }
+            block_store_iov_copy(&cursor, NULL, bs->blockSize, toBuffers);
+            i++;
+            continue;
+        }
+
+        //cached blocks aren't next to each other in memory, they go one at a time through the cache
+        //writes replace the whole block, so they don't read it in first
+        if(bs->cache!=NULL) {
+            block_cache_lock(bs->cache);
+            uint8_t* frame = toBuffers ? block_cache_frame(bs->cache, block_ids[i], false) : block_cache_frame_overwrite(bs->cache, block_ids[i]);
+            block_store_iov_copy(&cursor, frame, bs->blockSize, toBuffers);
+            block_cache_unlock(bs->cache);
+            if(!toBuffers && frame!=NULL) {
+                block_store_mark_dirty(bs, block_ids[i], 1);
+            }
+            if(toBuffers && bs->readahead!=NULL) {
+                block_store_readahead(bs, block_ids[i]);
+            }
+            if(frame!=NULL) {
+                totalBytes += bs->blockSize;
+            }
+            if(status!=NULL) {
+                status[i] = frame!=NULL ? bs->blockSize : 0;
+            }
+            i++;
+            continue;
+        }
+
+        //grow the run while the ids keep counting up and are in use, they're next to each other in the blocks array
+        size_t runEnd = i + 1;
+        while(runEnd<count && block_ids[runEnd]==block_ids[runEnd - 1] + 1 && block_ids[runEnd]<blocks && block_store_in_use(bs, block_ids[runEnd])) {
+            runEnd++;
+        }
+
+        //one copy for the run, or one per buffer if it crosses buffers
+        size_t runBytes = (runEnd - i) * bs->blockSize;
+        if(!toBuffers) {
+            block_store_seq_begin(bs, block_ids[i], runEnd - i);
+        }
+        block_store_iov_copy(&cursor, block_store_block(bs, block_ids[i]), runBytes, toBuffers);
+        if(!toBuffers) {
+            block_store_mark_dirty(bs, block_ids[i], runEnd - i);
+            block_store_seq_end(bs, block_ids[i], runEnd - i);
+        }
+        totalBytes += runBytes;
+        for(; i < runEnd; i++) {
+            if(status!=NULL) {
+                status[i] = bs->blockSize;
+            }
+            if(toBuffers && bs->readahead!=NULL) {
+                block_store_readahead(bs, block_ids[i]);
+            }
+        }
     }
+
+    block_store_shard_unlock_ids(bs, shards);
+    return totalBytes;
+}
+
+///
+/// Reads many blocks into a list of buffers in one call
+/// The buffers are treated as one flat buffer that block_ids[k]'s data fills at offset k * block size,
+///  runs of consecutive ids that land in the same buffer are copied in one go
+/// \param bs BS device
+/// \param block_ids Source block ids
+/// \param count Number of block ids
+/// \param iov The buffers to write to, they must hold count blocks between them
+/// \param iovcnt Number of buffers
+/// \param status Optional, gets the bytes read for each block id, 0 for ids that are invalid or not in use
+/// \return Total bytes read, 0 on error
+///
+size_t block_store_readv(const block_store_t *const bs, const size_t *const block_ids, const size_t count, const struct iovec *const iov, const size_t iovcnt, size_t *const status) {
+    //block data goes to the buffers
+    return block_store_transfer(bs, block_ids, count, iov, iovcnt, status, true);
+}
+
+///
+/// Writes many blocks from a list of buffers in one call
+/// The buffers are treated as one flat buffer that block_ids[k]'s data comes from at offset k * block size,
+///  runs of consecutive ids that come from the same buffer are copied in one go
+/// \param bs BS device
+/// \param block_ids Destination block ids
+/// \param count Number of block ids
+/// \param iov The buffers to read from, they must hold count blocks between them
+/// \param iovcnt Number of buffers
+/// \param status Optional, gets the bytes written for each block id, 0 for ids that are invalid or not in use
+/// \return Total bytes written, 0 on error
+///
+size_t block_store_writev(block_store_t *const bs, const size_t *const block_ids, const size_t count, const struct iovec *const iov, const size_t iovcnt, size_t *const status) {
+    //buffer data goes to the blocks
+    return block_store_transfer(bs, block_ids, count, iov, iovcnt, status, false);
 }
 
 ///
 /// Imports BS device from the given file - for grads/bonus
+/// Images from before configurable geometry used a different layout and load with every block shifted by one,
+///  use block_store_deserialize_legacy for those
 /// \param filename The file to load
 /// \return Pointer to new BS device, NULL on error
 ///
 block_store_t *block_store_deserialize(const char *const filename) {
+    return block_store_deserialize_ex(filename, BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS);
+}
+
+///
+/// Imports a 256x256 BS device from an image in the layout used before configurable geometry, where block id k
+///  was physical block k (so block 0 shared its first bytes with the FBM) instead of k + 1
+/// The device comes back in the current layout, block_store_serialize writes it out that way
+///  The old layout's physical block 255 had no id and is dropped
+/// \param filename The file to load
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize_legacy(const char *const filename) {
+    //same size as a current image, so load it as one and move the blocks into place
+    block_store_t* bs = block_store_deserialize(filename);
+    if(bs==NULL) {
+        return NULL;
+    }
+
+    //old block k goes up one to where id k lives now, the fbm bits are in the same place in both
+    //block 0 keeps the fbm and nothing else, and the bit past the last id never meant anything
+    uint8_t* raw = bs->blocks;
+    size_t fbmBytes = bitmap_get_bytes(bs->fbm);
+    memmove(raw + BLOCK_SIZE_BYTES, raw, BLOCK_STORE_AVAIL_BLOCKS * BLOCK_SIZE_BYTES);
+    memset(raw + fbmBytes, 0, BLOCK_SIZE_BYTES - fbmBytes);
+    raw[fbmBytes - 1] &= (uint8_t)((1u << (BLOCK_STORE_AVAIL_BLOCKS % 8)) - 1);
+    bitmap_refresh(bs->fbm);
+
+    //the file isn't in this layout, so flushing can't patch it
+    free(bs->fbmCopy);
+    bs->fbmCopy = NULL;
+    return bs;
+}
+
+///
+/// Imports BS device with the given geometry from the given file
+/// The file must hold exactly the whole device, as block_store_serialize writes it
+/// \param filename The file to load
+/// \param block_size Bytes per block, as given to block_store_create_ex
+/// \param block_count Total blocks on the device, as given to block_store_create_ex
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize_ex(const char *const filename, const size_t block_size, const size_t block_count) {
     //make sure filename is valid
     if(filename==NULL) {
         return NULL;
@@ -251,13 +2225,40 @@ block_store_t *block_store_deserialize(const char *const filename) {
     }
 
     //create the bs into which the deserialized data will go
-    block_store_t* bs = block_store_create();
+    block_store_t* bs = block_store_create_ex(block_size, block_count);
+    if(bs==NULL) {
+        close(fd);
+        return NULL;
+    }
 
     //read from the file and put the data into blocks array
-    size_t bytes = read(fd, bs->blocks, BLOCK_STORE_NUM_BYTES);
+    //read can come back short on big devices, so keep going until we have it all
+    size_t totalBytes = block_size * block_count;
+    size_t bytes = 0;
+    while(bytes<totalBytes) {
+        ssize_t got = read(fd, (uint8_t *)bs->blocks + bytes, totalBytes - bytes);
+        if(got<0 && errno==EINTR) {
+            continue;
+        }
+        if(got<=0) {
+            break;
+        }
+        bytes += (size_t)got;
+    }
+
+    //anything left over means the file is bigger than this device
+    uint8_t extra;
+    bool tooLong = bytes==totalBytes && read(fd, &extra, 1)>0;
+
+    //the file is exactly this device, so block_store_flush can patch it from here on
+    bool loaded = bytes==totalBytes && !tooLong;
+    if(loaded) {
+        block_store_set_flushed(bs, fd);
+    }
+    close(fd);
 
-    //make sure any data was read
-    if(bytes==0) {
+    //make sure the whole device was there, a short or long file is the wrong geometry or corrupt
+    if(!loaded) {
         block_store_destroy(bs);
         return NULL;
     }
@@ -277,28 +2278,137 @@ size_t block_store_serialize(const block_store_t *const bs, const char *const fi
         return 0;
     }
 
-    //open file in create mode to start in case it has not been created yet
-    //source: https://stackoverflow.com/questions/15798450/open-with-o-creat-was-it-opened-or-created
-    int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
-    
-    //if error or file already exists, now open in write mode
-    if ((fd == -1) && (errno == EEXIST))
-    {
-        fd = open(filename, O_WRONLY);
-    }
+    //blocks cached in magazines are set in the fbm, give them back so the image is exact
+    block_store_flush_magazines(bs);
+
+    //open file, creating it if it has not been created yet
+    //truncate it too, an old image from a bigger device would leave junk at the end otherwise
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
     //if all file opening fails, return error
     if(fd<0) {
         return 0;
     }
 
-    //write blockstore into file and return the number of successful bytes written
-    size_t bytes = write(fd, bs->blocks, BLOCK_STORE_NUM_BYTES);
+    //write blockstore into file, write can come back short on big devices so keep going
+    //sharded, writers are held off so every block goes out whole
+    block_store_shard_lock_range(bs, 0, bitmap_get_bits(bs->fbm), false);
+    //a cached device's blocks are mostly in its file, write back what's dirty and copy the file over
+    size_t totalBytes = bs->blockSize * bs->blockCount;
+    size_t bytes = 0;
+    if(bs->cache!=NULL) {
+        bytes = block_store_write_back(bs) ? block_store_copy_file(bs->fd, fd, totalBytes) : 0;
+    }
+    while(bs->cache==NULL && bytes<totalBytes) {
+        ssize_t wrote = write(fd, (const uint8_t *)bs->blocks + bytes, totalBytes - bytes);
+        if(wrote<0 && errno==EINTR) {
+            continue;
+        }
+        if(wrote<=0) {
+            break;
+        }
+        bytes += (size_t)wrote;
+    }
+    block_store_shard_unlock_range(bs, 0, bitmap_get_bits(bs->fbm));
+    close(fd);
 
-    //make things actually written into file
-    if(bytes==0) {
+    //make sure everything actually got written into file
+    if(bytes!=totalBytes) {
         return 0;
     }
 
+    //return the number of successful bytes written
     return bytes;
 }
+
+///
+/// Writes what's changed since the last flush to the given file, so a checkpoint costs about as much as the churn
+///  Only blocks written since then and the FBM blocks that changed go out, with runs of them written in one go
+///  That only works on the image the last flush wrote (or the device was deserialized from), any other file,
+///  or one that's the wrong size, gets the whole device like block_store_serialize
+///  Writes through block_store_borrow_mut pointers are only seen if the block was borrowed since the last flush
+///  Flushes run one at a time under the device's flush lock, and sharded they also hold every shard shared,
+///  so reads carry on but writers wait until it's done
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_flush(block_store_t *const bs, const char *const filename) {
+    //make sure bs and filename are valid
+    if(bs==NULL || filename==NULL) {
+        return 0;
+    }
+
+    //the shard locks are only shared, this keeps two flushes from both working on the dirty blocks and the fbm copy
+    pthread_mutex_lock(&bs->flushLock);
+
+    //blocks cached in magazines are set in the fbm, give them back so the image is exact
+    block_store_flush_magazines(bs);
+
+    //no truncating, the whole point is to keep what's there
+    int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+    if(fd<0) {
+        pthread_mutex_unlock(&bs->flushLock);
+        return 0;
+    }
+
+    //anything but the file we last flushed to, at the right size, has to be written from scratch
+    size_t totalBytes = bs->blockSize * bs->blockCount;
+    struct stat st;
+    bool whole = bs->fbmCopy==NULL || fstat(fd, &st)!=0 || st.st_dev!=bs->flushDev || st.st_ino!=bs->flushIno || (size_t)st.st_size!=totalBytes;
+    size_t chunkBytes = bs->blockSize < (1 << 16) ? (1 << 16) : bs->blockSize;
+    uint8_t* chunk = bs->cache!=NULL ? malloc(chunkBytes) : NULL;
+    bool ok = (bs->cache==NULL || chunk!=NULL) && (!whole || ftruncate(fd, (off_t)totalBytes)==0);
+
+    //sharded, writers are held off so every block goes out whole
+    //a cached device's file is where its blocks come from, get it up to date first
+    size_t blocks = bitmap_get_bits(bs->fbm);
+    block_store_shard_lock_range(bs, 0, blocks, false);
+    ok = ok && (bs->cache==NULL || block_cache_flush(bs->cache));
+    size_t bytes = 0;
+    if(ok && whole) {
+        //the fbm copy and the cleared dirty blocks come first and the fbm goes out from the copy,
+        //so whatever changes while this is going on is caught next time
+        ok = block_store_set_flushed(bs, fd) && block_store_file_io(fd, bs->fbmCopy, bs->fbmBlocks * bs->blockSize, 0, true) && block_store_write_run(bs, fd, 0, blocks, chunk, chunkBytes);
+        bytes = totalBytes;
+    }
+    else if(ok) {
+        //fbm blocks that aren't what the last flush wrote, runs of them at once
+        //the copy is updated first and written out, so it's always what the file has
+        for(size_t start = 0; ok && start < bs->fbmBlocks; start++) {
+            size_t end = start;
+            while(end<bs->fbmBlocks && memcmp((uint8_t *)bs->blocks + end * bs->blockSize, bs->fbmCopy + end * bs->blockSize, bs->blockSize)!=0) {
+                end++;
+            }
+            if(end>start) {
+                size_t len = (end - start) * bs->blockSize;
+                memcpy(bs->fbmCopy + start * bs->blockSize, (uint8_t *)bs->blocks + start * bs->blockSize, len);
+                ok = block_store_file_io(fd, bs->fbmCopy + start * bs->blockSize, len, (off_t)(start * bs->blockSize), true);
+                bytes += len;
+                start = end;
+            }
+        }
+
+        //then every run of written blocks
+        size_t length = 0;
+        for(size_t start = bitmap_next_set(bs->dirty, 0); ok && start!=SIZE_MAX; start = bitmap_next_set(bs->dirty, start + length)) {
+            size_t end = bitmap_next_zero(bs->dirty, start);
+            length = (end==SIZE_MAX ? blocks : end) - start;
+            bitmap_test_and_reset_range(bs->dirty, start, length);
+            ok = block_store_write_run(bs, fd, start, length, chunk, chunkBytes);
+            bytes += length * bs->blockSize;
+        }
+    }
+    //whatever didn't make it is unknown now, so the next flush starts from scratch
+    if(!ok) {
+        free(bs->fbmCopy);
+        bs->fbmCopy = NULL;
+    }
+    block_store_shard_unlock_range(bs, 0, blocks);
+    pthread_mutex_unlock(&bs->flushLock);
+    free(chunk);
+    close(fd);
+
+    //return the number of successful bytes written
+    return ok ? bytes : 0;
+}
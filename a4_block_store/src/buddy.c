@@ -0,0 +1,170 @@
+#include "buddy.h"
+
+struct buddy {
+    size_t block_count;
+    size_t max_order;
+    // free_sets[k] bit i set means blocks [i << k, (i + 1) << k) are one free block of order k
+    // Hierarchical, so finding a free block is a summary walk rather than a scan
+    bitmap_t *free_sets[BUDDY_MAX_ORDER + 1];
+};
+
+// The order of the biggest aligned block that starts at first and fits in count blocks
+static size_t piece_order(const buddy_t *const buddy, const size_t first, const size_t count) {
+    size_t order = first ? (size_t) __builtin_ctzll(first) : buddy->max_order;
+    if (order > buddy->max_order) {
+        order = buddy->max_order;
+    }
+    while (((size_t) 1 << order) > count) {
+        --order;
+    }
+    return order;
+}
+
+// The order of the free block holding [first, first + 2^order), SIZE_MAX if it isn't all free
+// Free buddies are always merged, so an all free aligned block is inside a single free block
+static size_t containing_order(const buddy_t *const buddy, const size_t first, size_t order) {
+    for (; order <= buddy->max_order; ++order) {
+        const size_t idx = first >> order;
+        if (idx < bitmap_get_bits(buddy->free_sets[order]) && bitmap_test(buddy->free_sets[order], idx)) {
+            return order;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Frees one aligned block, merging it with its buddy for as long as the buddy is free too
+static void insert(buddy_t *const buddy, size_t first, size_t order) {
+    while (order < buddy->max_order) {
+        const size_t mate = (first >> order) ^ 1;
+        if (mate >= bitmap_get_bits(buddy->free_sets[order]) || !bitmap_test(buddy->free_sets[order], mate)) {
+            break;
+        }
+        bitmap_reset(buddy->free_sets[order], mate);
+        first &= ~((size_t) 1 << order);
+        ++order;
+    }
+    bitmap_set(buddy->free_sets[order], first >> order);
+}
+
+// Takes one aligned block that's known to be free, splitting the free block around it
+static void take(buddy_t *const buddy, const size_t first, const size_t order) {
+    size_t level = containing_order(buddy, first, order);
+    bitmap_reset(buddy->free_sets[level], first >> level);
+    // Going down, the half holding first gets split again and the other half stays free
+    while (level > order) {
+        --level;
+        bitmap_set(buddy->free_sets[level], (first >> level) ^ 1);
+    }
+}
+
+buddy_t *buddy_create(const bitmap_t *const fbm, const size_t max_order) {
+    if (!fbm || max_order > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    buddy_t *buddy = (buddy_t *) calloc(1, sizeof(buddy_t));
+    if (!buddy) {
+        return NULL;
+    }
+    buddy->block_count = bitmap_get_bits(fbm);
+    // Orders with no whole block on the device are useless
+    buddy->max_order = max_order;
+    while (buddy->max_order && !(buddy->block_count >> buddy->max_order)) {
+        --buddy->max_order;
+    }
+    for (size_t order = 0; order <= buddy->max_order; ++order) {
+        buddy->free_sets[order] = bitmap_create_hierarchical(buddy->block_count >> order);
+        if (!buddy->free_sets[order]) {
+            buddy_destroy(buddy);
+            return NULL;
+        }
+    }
+
+    // Cut each free run into the biggest aligned blocks that fit, greedily from the front
+    // Two free buddies would both sit inside one run, where we'd have taken their parent instead,
+    //  so this is already fully merged
+    for (size_t start = bitmap_next_zero(fbm, 0); start != SIZE_MAX;) {
+        size_t end = bitmap_next_set(fbm, start);
+        if (end == SIZE_MAX) {
+            end = buddy->block_count;
+        }
+        for (size_t first = start; first < end;) {
+            const size_t order = piece_order(buddy, first, end - first);
+            bitmap_set(buddy->free_sets[order], first >> order);
+            first += (size_t) 1 << order;
+        }
+        start = bitmap_next_zero(fbm, end);
+    }
+    return buddy;
+}
+
+size_t buddy_get_max_order(const buddy_t *const buddy) {
+    return buddy ? buddy->max_order : 0;
+}
+
+size_t buddy_allocate(buddy_t *const buddy, const size_t order) {
+    if (!buddy || order > buddy->max_order) {
+        return SIZE_MAX;
+    }
+    // The smallest free block that's big enough
+    size_t level = order, idx = SIZE_MAX;
+    for (; level <= buddy->max_order; ++level) {
+        idx = bitmap_ffs(buddy->free_sets[level]);
+        if (idx != SIZE_MAX) {
+            break;
+        }
+    }
+    if (idx == SIZE_MAX) {
+        return SIZE_MAX;
+    }
+    bitmap_reset(buddy->free_sets[level], idx);
+    // Split down to size, keeping the left half each time and freeing the right
+    while (level > order) {
+        --level;
+        idx <<= 1;
+        bitmap_set(buddy->free_sets[level], idx + 1);
+    }
+    return idx << order;
+}
+
+bool buddy_claim(buddy_t *const buddy, const size_t first, const size_t count) {
+    if (!buddy || !count || first >= buddy->block_count || count > buddy->block_count - first) {
+        return false;
+    }
+    // Check every piece before touching anything, so a partly free range changes nothing
+    for (size_t piece = first, left = count; left;) {
+        const size_t order = piece_order(buddy, piece, left);
+        if (containing_order(buddy, piece, order) == SIZE_MAX) {
+            return false;
+        }
+        piece += (size_t) 1 << order;
+        left -= (size_t) 1 << order;
+    }
+    for (size_t piece = first, left = count; left;) {
+        const size_t order = piece_order(buddy, piece, left);
+        take(buddy, piece, order);
+        piece += (size_t) 1 << order;
+        left -= (size_t) 1 << order;
+    }
+    return true;
+}
+
+void buddy_release(buddy_t *const buddy, const size_t first, const size_t count) {
+    if (!buddy || !count || first >= buddy->block_count || count > buddy->block_count - first) {
+        return;
+    }
+    for (size_t piece = first, left = count; left;) {
+        const size_t order = piece_order(buddy, piece, left);
+        insert(buddy, piece, order);
+        piece += (size_t) 1 << order;
+        left -= (size_t) 1 << order;
+    }
+}
+
+void buddy_destroy(buddy_t *buddy) {
+    if (buddy) {
+        for (size_t order = 0; order <= BUDDY_MAX_ORDER; ++order) {
+            bitmap_destroy(buddy->free_sets[order]);
+        }
+        free(buddy);
+    }
+}
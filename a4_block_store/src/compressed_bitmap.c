@@ -0,0 +1,706 @@
+#include "compressed_bitmap.h"
+#include <string.h>
+
+// Chunks are 2^16 bits so a position inside one fits in a uint16_t
+#define CHUNK_SHIFT 16
+#define CHUNK_BITS ((size_t) 1 << CHUNK_SHIFT)
+#define CHUNK_LOW(bit) ((uint16_t) ((bit) & (CHUNK_BITS - 1)))
+#define DENSE_WORDS (CHUNK_BITS >> 6)
+#define DENSE_BYTES (DENSE_WORDS * sizeof(uint64_t))
+
+typedef enum { ARRAY = 0, RUNS = 1, DENSE = 2 } CONTAINER_TYPE;
+
+// Both ends inclusive, so a full chunk is the one run {0, 65535}
+struct run {
+    uint16_t start, last;
+};
+
+// Past these an array or run container is bigger than a dense one
+#define ARRAY_MAX (DENSE_BYTES / sizeof(uint16_t))
+#define RUNS_MAX (DENSE_BYTES / sizeof(struct run))
+
+struct container {
+    CONTAINER_TYPE type;
+    uint32_t count;        // Entries in use: values for ARRAY, runs for RUNS, nothing for DENSE
+    uint32_t capacity;     // Entries allocated
+    uint32_t cardinality;  // Bits set, for every type
+    union {
+        uint16_t *values;  // Sorted set bits
+        struct run *runs;  // Sorted, never touching or overlapping
+        uint64_t *words;   // DENSE_WORDS words
+        void *data;
+    };
+};
+
+struct cbitmap {
+    size_t bit_count, chunk_count;
+    size_t total;  // Running count of set bits, so total_set doesn't walk the chunks
+    struct container *chunks;
+};
+
+// Serialized header, then per chunk a type byte, a uint32_t count, and the entries
+#define SERIAL_MAGIC 0x314D4243u  // "CBM1"
+#define SERIAL_HEADER (2 * sizeof(uint32_t) + sizeof(uint64_t))
+#define SERIAL_CHUNK_HEADER (sizeof(uint8_t) + sizeof(uint32_t))
+
+static inline size_t chunk_bits(const cbitmap_t *const cbitmap, const size_t chunk) {
+    return chunk == cbitmap->chunk_count - 1 ? cbitmap->bit_count - (chunk << CHUNK_SHIFT) : CHUNK_BITS;
+}
+
+// First value >= low
+static size_t array_find(const struct container *const container, const uint16_t low) {
+    size_t lo = 0, hi = container->count;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) >> 1;
+        if (container->values[mid] < low) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// First run starting after low, so the run that could hold low is the one before it
+static size_t runs_find(const struct container *const container, const uint16_t low) {
+    size_t lo = 0, hi = container->count;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) >> 1;
+        if (container->runs[mid].start <= low) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool container_reserve(struct container *const container, const size_t entries, const size_t entry_size) {
+    if (entries <= container->capacity) {
+        return true;
+    }
+    size_t capacity = container->capacity ? container->capacity : 4;
+    while (capacity < entries) {
+        capacity <<= 1;
+    }
+    void *data = realloc(container->data, capacity * entry_size);
+    if (!data) {
+        return false;
+    }
+    container->data     = data;
+    container->capacity = (uint32_t) capacity;
+    return true;
+}
+
+// Next set (or clear) bit in a dense chunk at or after from, CHUNK_BITS if there isn't one
+static size_t words_next(const uint64_t *const words, const size_t from, const bool set) {
+    if (from >= CHUNK_BITS) {
+        return CHUNK_BITS;
+    }
+    size_t idx    = from >> 6;
+    uint64_t word = (set ? words[idx] : ~words[idx]) & ~(((uint64_t) 1 << (from & 63)) - 1);
+    while (!word) {
+        if (++idx == DENSE_WORDS) {
+            return CHUNK_BITS;
+        }
+        word = set ? words[idx] : ~words[idx];
+    }
+    return (idx << 6) + (size_t) __builtin_ctzll(word);
+}
+
+static void words_set_range(uint64_t *const words, const size_t start, const size_t last) {
+    for (size_t bit = start; bit <= last; ++bit) {
+        words[bit >> 6] |= (uint64_t) 1 << (bit & 63);
+    }
+}
+
+static void container_to_words(const struct container *const container, uint64_t *const words) {
+    if (container->type == DENSE) {
+        memcpy(words, container->words, DENSE_BYTES);
+        return;
+    }
+    memset(words, 0, DENSE_BYTES);
+    for (size_t idx = 0; idx < container->count; ++idx) {
+        if (container->type == ARRAY) {
+            words[container->values[idx] >> 6] |= (uint64_t) 1 << (container->values[idx] & 63);
+        } else {
+            words_set_range(words, container->runs[idx].start, container->runs[idx].last);
+        }
+    }
+}
+
+// Number of runs of ones, a run starts at every 0 -> 1 transition
+static size_t words_runs(const uint64_t *const words) {
+    size_t runs     = 0;
+    uint64_t carry  = 0;
+    for (size_t idx = 0; idx < DENSE_WORDS; ++idx) {
+        runs += (size_t) __builtin_popcountll(words[idx] & ~((words[idx] << 1) | carry));
+        carry = words[idx] >> 63;
+    }
+    return runs;
+}
+
+static CONTAINER_TYPE best_type(const uint64_t *const words, const size_t cardinality) {
+    const size_t array_bytes = cardinality * sizeof(uint16_t);
+    const size_t runs_bytes  = words_runs(words) * sizeof(struct run);
+    if (array_bytes <= runs_bytes && array_bytes <= DENSE_BYTES) {
+        return ARRAY;
+    }
+    return runs_bytes < DENSE_BYTES ? RUNS : DENSE;
+}
+
+// Replaces the container's contents with the given dense words in the requested type, sized exactly
+static bool container_from_words(struct container *const container, const uint64_t *const words,
+                                 const CONTAINER_TYPE type) {
+    size_t cardinality = 0;
+    for (size_t idx = 0; idx < DENSE_WORDS; ++idx) {
+        cardinality += (size_t) __builtin_popcountll(words[idx]);
+    }
+    size_t count = 0;
+    void *data   = NULL;
+    if (type == DENSE) {
+        data = malloc(DENSE_BYTES);
+        if (!data) {
+            return false;
+        }
+        memcpy(data, words, DENSE_BYTES);
+    } else if (type == ARRAY) {
+        count = cardinality;
+        if (count) {
+            uint16_t *values = (uint16_t *) malloc(count * sizeof(uint16_t));
+            if (!values) {
+                return false;
+            }
+            size_t out = 0;
+            for (size_t idx = 0; idx < DENSE_WORDS; ++idx) {
+                for (uint64_t word = words[idx]; word; word &= word - 1) {
+                    values[out++] = (uint16_t) ((idx << 6) + (size_t) __builtin_ctzll(word));
+                }
+            }
+            data = values;
+        }
+    } else {
+        count = words_runs(words);
+        if (count) {
+            struct run *runs = (struct run *) malloc(count * sizeof(struct run));
+            if (!runs) {
+                return false;
+            }
+            size_t out = 0;
+            for (size_t start = words_next(words, 0, true); start < CHUNK_BITS;) {
+                const size_t end = words_next(words, start, false);
+                runs[out].start  = (uint16_t) start;
+                runs[out].last   = (uint16_t) (end - 1);
+                ++out;
+                start = words_next(words, end, true);
+            }
+            data = runs;
+        }
+    }
+    free(container->data);
+    container->type        = type;
+    container->count       = (uint32_t) count;
+    container->capacity    = (uint32_t) count;
+    container->cardinality = (uint32_t) cardinality;
+    container->data        = data;
+    return true;
+}
+
+static bool container_convert(struct container *const container, const CONTAINER_TYPE type) {
+    uint64_t words[DENSE_WORDS];
+    container_to_words(container, words);
+    return container_from_words(container, words, type);
+}
+
+bool cbitmap_set(cbitmap_t *const cbitmap, const size_t bit) {
+    const size_t chunk                = bit >> CHUNK_SHIFT;
+    struct container *const container = &cbitmap->chunks[chunk];
+    const uint16_t low                = CHUNK_LOW(bit);
+    switch (container->type) {
+        case ARRAY: {
+            const size_t idx = array_find(container, low);
+            if (idx < container->count && container->values[idx] == low) {
+                return true;
+            }
+            if (container->count == ARRAY_MAX) {
+                // One more value and we'd be bigger than dense
+                return container_convert(container, DENSE) && cbitmap_set(cbitmap, bit);
+            }
+            if (!container_reserve(container, container->count + 1, sizeof(uint16_t))) {
+                return false;
+            }
+            memmove(&container->values[idx + 1], &container->values[idx], (container->count - idx) * sizeof(uint16_t));
+            container->values[idx] = low;
+            ++container->count;
+            break;
+        }
+        case RUNS: {
+            const size_t idx = runs_find(container, low);
+            if (idx && low <= container->runs[idx - 1].last) {
+                return true;
+            }
+            const bool join_prev = idx && container->runs[idx - 1].last + 1 == low;
+            const bool join_next = idx < container->count && low + 1 == container->runs[idx].start;
+            if (join_prev && join_next) {
+                // Filled the gap between two runs
+                container->runs[idx - 1].last = container->runs[idx].last;
+                memmove(&container->runs[idx], &container->runs[idx + 1], (container->count - idx - 1) * sizeof(struct run));
+                --container->count;
+            } else if (join_prev) {
+                container->runs[idx - 1].last = low;
+            } else if (join_next) {
+                container->runs[idx].start = low;
+            } else {
+                if (container->count == RUNS_MAX) {
+                    return container_convert(container, DENSE) && cbitmap_set(cbitmap, bit);
+                }
+                if (!container_reserve(container, container->count + 1, sizeof(struct run))) {
+                    return false;
+                }
+                memmove(&container->runs[idx + 1], &container->runs[idx], (container->count - idx) * sizeof(struct run));
+                container->runs[idx].start = low;
+                container->runs[idx].last  = low;
+                ++container->count;
+            }
+            break;
+        }
+        default: {
+            const uint64_t mask = (uint64_t) 1 << (low & 63);
+            if (container->words[low >> 6] & mask) {
+                return true;
+            }
+            container->words[low >> 6] |= mask;
+            break;
+        }
+    }
+    ++container->cardinality;
+    ++cbitmap->total;
+    if (container->type == DENSE && container->cardinality == chunk_bits(cbitmap, chunk)) {
+        // A full chunk is one run, if that fails we just stay dense
+        container_convert(container, RUNS);
+    }
+    return true;
+}
+
+bool cbitmap_reset(cbitmap_t *const cbitmap, const size_t bit) {
+    struct container *const container = &cbitmap->chunks[bit >> CHUNK_SHIFT];
+    const uint16_t low                = CHUNK_LOW(bit);
+    switch (container->type) {
+        case ARRAY: {
+            const size_t idx = array_find(container, low);
+            if (idx == container->count || container->values[idx] != low) {
+                return true;
+            }
+            memmove(&container->values[idx], &container->values[idx + 1], (container->count - idx - 1) * sizeof(uint16_t));
+            --container->count;
+            break;
+        }
+        case RUNS: {
+            const size_t idx = runs_find(container, low);
+            if (!idx || low > container->runs[idx - 1].last) {
+                return true;
+            }
+            struct run *run = &container->runs[idx - 1];
+            if (run->start == run->last) {
+                memmove(run, run + 1, (container->count - idx) * sizeof(struct run));
+                --container->count;
+            } else if (low == run->start) {
+                ++run->start;
+            } else if (low == run->last) {
+                --run->last;
+            } else {
+                // Splitting a run needs a new one
+                if (container->count == RUNS_MAX) {
+                    return container_convert(container, DENSE) && cbitmap_reset(cbitmap, bit);
+                }
+                if (!container_reserve(container, container->count + 1, sizeof(struct run))) {
+                    return false;
+                }
+                run = &container->runs[idx - 1];  // reserve may have moved it
+                memmove(run + 2, run + 1, (container->count - idx) * sizeof(struct run));
+                run[1].start = low + 1;
+                run[1].last  = run->last;
+                run->last    = low - 1;
+                ++container->count;
+            }
+            break;
+        }
+        default: {
+            const uint64_t mask = (uint64_t) 1 << (low & 63);
+            if (!(container->words[low >> 6] & mask)) {
+                return true;
+            }
+            container->words[low >> 6] &= ~mask;
+            break;
+        }
+    }
+    --container->cardinality;
+    --cbitmap->total;
+    if (container->type == DENSE && container->cardinality < ARRAY_MAX / 2) {
+        // Half the threshold so a chunk hovering around it doesn't flip back and forth
+        container_convert(container, ARRAY);
+    } else if (container->type == RUNS &&
+               container->cardinality * sizeof(uint16_t) < container->count * sizeof(struct run)) {
+        // Mostly single bits now (or nothing at all), an array is smaller
+        // Sets never turn an array into runs, so this can't flip back and forth either
+        container_convert(container, ARRAY);
+    }
+    return true;
+}
+
+bool cbitmap_test(const cbitmap_t *const cbitmap, const size_t bit) {
+    const struct container *const container = &cbitmap->chunks[bit >> CHUNK_SHIFT];
+    const uint16_t low                      = CHUNK_LOW(bit);
+    switch (container->type) {
+        case ARRAY: {
+            const size_t idx = array_find(container, low);
+            return idx < container->count && container->values[idx] == low;
+        }
+        case RUNS: {
+            const size_t idx = runs_find(container, low);
+            return idx && low <= container->runs[idx - 1].last;
+        }
+        default:
+            return container->words[low >> 6] & ((uint64_t) 1 << (low & 63));
+    }
+}
+
+size_t cbitmap_ffs(const cbitmap_t *const cbitmap) {
+    if (cbitmap) {
+        for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+            const struct container *const container = &cbitmap->chunks[chunk];
+            if (!container->cardinality) {
+                continue;
+            }
+            const size_t base = chunk << CHUNK_SHIFT;
+            switch (container->type) {
+                case ARRAY:
+                    return base + container->values[0];
+                case RUNS:
+                    return base + container->runs[0].start;
+                default:
+                    return base + words_next(container->words, 0, true);
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t cbitmap_ffz(const cbitmap_t *const cbitmap) {
+    if (cbitmap) {
+        for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+            const struct container *const container = &cbitmap->chunks[chunk];
+            if (container->cardinality == chunk_bits(cbitmap, chunk)) {
+                continue;
+            }
+            // There's a zero inside the chunk, so none of these can run off its end
+            const size_t base = chunk << CHUNK_SHIFT;
+            switch (container->type) {
+                case ARRAY: {
+                    // Values are sorted and unique, so the first one out of place marks the gap
+                    size_t idx = 0;
+                    while (idx < container->count && container->values[idx] == idx) {
+                        ++idx;
+                    }
+                    return base + idx;
+                }
+                case RUNS:
+                    if (!container->count || container->runs[0].start) {
+                        return base;
+                    }
+                    return base + (size_t) container->runs[0].last + 1;
+                default:
+                    return base + words_next(container->words, 0, false);
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t cbitmap_total_set(const cbitmap_t *const cbitmap) {
+    return cbitmap ? cbitmap->total : 0;
+}
+
+size_t cbitmap_get_bits(const cbitmap_t *const cbitmap) {
+    return cbitmap->bit_count;
+}
+
+size_t cbitmap_memory_usage(const cbitmap_t *const cbitmap) {
+    if (!cbitmap) {
+        return 0;
+    }
+    size_t total = sizeof(cbitmap_t) + cbitmap->chunk_count * sizeof(struct container);
+    for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+        const struct container *const container = &cbitmap->chunks[chunk];
+        switch (container->type) {
+            case ARRAY:
+                total += container->capacity * sizeof(uint16_t);
+                break;
+            case RUNS:
+                total += container->capacity * sizeof(struct run);
+                break;
+            default:
+                total += DENSE_BYTES;
+                break;
+        }
+    }
+    return total;
+}
+
+void cbitmap_optimize(cbitmap_t *const cbitmap) {
+    if (cbitmap) {
+        uint64_t words[DENSE_WORDS];
+        for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+            struct container *const container = &cbitmap->chunks[chunk];
+            container_to_words(container, words);
+            // Rebuilding also trims any spare capacity, on failure the old container stays
+            container_from_words(container, words, best_type(words, container->cardinality));
+        }
+    }
+}
+
+cbitmap_t *cbitmap_create(const size_t n_bits) {
+    if (n_bits) {  // must be non-zero
+        cbitmap_t *cbitmap = (cbitmap_t *) malloc(sizeof(cbitmap_t));
+        if (cbitmap) {
+            cbitmap->bit_count   = n_bits;
+            cbitmap->chunk_count = (n_bits + CHUNK_BITS - 1) >> CHUNK_SHIFT;
+            cbitmap->total       = 0;
+            // Zeroed containers are empty arrays
+            cbitmap->chunks = (struct container *) calloc(cbitmap->chunk_count, sizeof(struct container));
+            if (cbitmap->chunks) {
+                return cbitmap;
+            }
+            free(cbitmap);
+        }
+    }
+    return NULL;
+}
+
+cbitmap_t *cbitmap_from_bitmap(const bitmap_t *const bitmap) {
+    if (!bitmap) {
+        return NULL;
+    }
+    cbitmap_t *cbitmap = cbitmap_create(bitmap_get_bits(bitmap));
+    if (!cbitmap) {
+        return NULL;
+    }
+    const uint8_t *bytes    = bitmap_export(bitmap);
+    const size_t byte_count = bitmap_get_bytes(bitmap);
+    uint64_t words[DENSE_WORDS];
+    for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+        const size_t offset = chunk * DENSE_BYTES;
+        const size_t length = byte_count - offset < DENSE_BYTES ? byte_count - offset : DENSE_BYTES;
+        memset(words, 0, DENSE_BYTES);
+        memcpy(words, bytes + offset, length);
+        // The last byte can have junk past the bit count
+        const size_t bits = chunk_bits(cbitmap, chunk);
+        if (bits & 63) {
+            words[bits >> 6] &= ((uint64_t) 1 << (bits & 63)) - 1;
+        }
+        size_t cardinality = 0;
+        for (size_t idx = 0; idx < DENSE_WORDS; ++idx) {
+            cardinality += (size_t) __builtin_popcountll(words[idx]);
+        }
+        if (!container_from_words(&cbitmap->chunks[chunk], words, best_type(words, cardinality))) {
+            cbitmap_destroy(cbitmap);
+            return NULL;
+        }
+        cbitmap->total += cardinality;
+    }
+    return cbitmap;
+}
+
+bitmap_t *cbitmap_to_bitmap(const cbitmap_t *const cbitmap) {
+    if (!cbitmap) {
+        return NULL;
+    }
+    const size_t byte_count = (cbitmap->bit_count + 7) >> 3;
+    uint8_t *bytes          = (uint8_t *) malloc(byte_count);
+    if (!bytes) {
+        return NULL;
+    }
+    uint64_t words[DENSE_WORDS];
+    for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+        const size_t offset = chunk * DENSE_BYTES;
+        const size_t length = byte_count - offset < DENSE_BYTES ? byte_count - offset : DENSE_BYTES;
+        container_to_words(&cbitmap->chunks[chunk], words);
+        memcpy(bytes + offset, words, length);
+    }
+    bitmap_t *bitmap = bitmap_import(cbitmap->bit_count, bytes);
+    free(bytes);
+    return bitmap;
+}
+
+// Payload bytes for a chunk, and the count that goes in front of it
+static size_t chunk_payload(const struct container *const container, uint32_t *const count) {
+    switch (container->type) {
+        case ARRAY:
+            *count = container->count;
+            return container->count * sizeof(uint16_t);
+        case RUNS:
+            *count = container->count;
+            return container->count * sizeof(struct run);
+        default:
+            *count = container->cardinality;
+            return DENSE_BYTES;
+    }
+}
+
+size_t cbitmap_serialized_size(const cbitmap_t *const cbitmap) {
+    if (!cbitmap) {
+        return 0;
+    }
+    size_t total = SERIAL_HEADER;
+    uint32_t count;
+    for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+        total += SERIAL_CHUNK_HEADER + chunk_payload(&cbitmap->chunks[chunk], &count);
+    }
+    return total;
+}
+
+size_t cbitmap_serialize(const cbitmap_t *const cbitmap, void *const buffer, const size_t size) {
+    if (!cbitmap || !buffer || size < cbitmap_serialized_size(cbitmap)) {
+        return 0;
+    }
+    uint8_t *out             = (uint8_t *) buffer;
+    const uint32_t magic     = SERIAL_MAGIC;
+    const uint32_t reserved  = 0;
+    const uint64_t bit_count = cbitmap->bit_count;
+    memcpy(out, &magic, sizeof(magic));
+    memcpy(out + sizeof(magic), &reserved, sizeof(reserved));
+    memcpy(out + sizeof(magic) + sizeof(reserved), &bit_count, sizeof(bit_count));
+    out += SERIAL_HEADER;
+
+    for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+        const struct container *const container = &cbitmap->chunks[chunk];
+        uint32_t count;
+        const size_t payload = chunk_payload(container, &count);
+        const uint8_t type   = (uint8_t) container->type;
+        memcpy(out, &type, sizeof(type));
+        memcpy(out + sizeof(type), &count, sizeof(count));
+        out += SERIAL_CHUNK_HEADER;
+        if (payload) {
+            memcpy(out, container->data, payload);
+            out += payload;
+        }
+    }
+    return (size_t) (out - (uint8_t *) buffer);
+}
+
+// Checks a deserialized container is one we could have built ourselves
+static bool container_valid(const struct container *const container, const size_t bits) {
+    size_t cardinality = 0;
+    for (size_t idx = 0; idx < container->count; ++idx) {
+        if (container->type == ARRAY) {
+            if (container->values[idx] >= bits || (idx && container->values[idx] <= container->values[idx - 1])) {
+                return false;
+            }
+            ++cardinality;
+        } else if (container->type == RUNS) {
+            const struct run *const run = &container->runs[idx];
+            if (run->start > run->last || run->last >= bits || (idx && run->start <= (size_t) run[-1].last + 1)) {
+                return false;
+            }
+            cardinality += (size_t) run->last - run->start + 1;
+        }
+    }
+    if (container->type == DENSE) {
+        for (size_t idx = 0; idx < DENSE_WORDS; ++idx) {
+            cardinality += (size_t) __builtin_popcountll(container->words[idx]);
+        }
+        if (words_next(container->words, bits, true) != CHUNK_BITS) {
+            return false;
+        }
+    }
+    return cardinality == container->cardinality;
+}
+
+cbitmap_t *cbitmap_deserialize(const void *const buffer, const size_t size) {
+    if (!buffer || size < SERIAL_HEADER) {
+        return NULL;
+    }
+    const uint8_t *in = (const uint8_t *) buffer;
+    const uint8_t *end = in + size;
+    uint32_t magic;
+    uint64_t bit_count;
+    memcpy(&magic, in, sizeof(magic));
+    memcpy(&bit_count, in + 2 * sizeof(uint32_t), sizeof(bit_count));
+    if (magic != SERIAL_MAGIC || bit_count > SIZE_MAX) {
+        return NULL;
+    }
+    in += SERIAL_HEADER;
+
+    cbitmap_t *cbitmap = cbitmap_create((size_t) bit_count);
+    if (!cbitmap) {
+        return NULL;
+    }
+    for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+        struct container *const container = &cbitmap->chunks[chunk];
+        uint8_t type;
+        uint32_t count;
+        if ((size_t) (end - in) < SERIAL_CHUNK_HEADER) {
+            break;
+        }
+        memcpy(&type, in, sizeof(type));
+        memcpy(&count, in + sizeof(type), sizeof(count));
+        in += SERIAL_CHUNK_HEADER;
+
+        size_t payload;
+        if (type == ARRAY && count <= ARRAY_MAX) {
+            payload = count * sizeof(uint16_t);
+        } else if (type == RUNS && count <= RUNS_MAX) {
+            payload = count * sizeof(struct run);
+        } else if (type == DENSE && count <= CHUNK_BITS) {
+            payload = DENSE_BYTES;
+        } else {
+            break;
+        }
+        if ((size_t) (end - in) < payload) {
+            break;
+        }
+        container->type = (CONTAINER_TYPE) type;
+        if (payload) {
+            container->data = malloc(payload);
+            if (!container->data) {
+                break;
+            }
+            memcpy(container->data, in, payload);
+        }
+        in += payload;
+        container->count       = type == DENSE ? 0 : count;
+        container->capacity    = container->count;
+        container->cardinality = type == DENSE ? count : 0;
+        if (type == RUNS) {
+            for (size_t idx = 0; idx < count; ++idx) {
+                container->cardinality += (uint32_t) (container->runs[idx].last - container->runs[idx].start + 1);
+            }
+        } else if (type == ARRAY) {
+            container->cardinality = count;
+        }
+        if (!container_valid(container, chunk_bits(cbitmap, chunk))) {
+            break;
+        }
+        if (type == RUNS && !count) {
+            // Older versions could leave an empty run container behind, it's just an empty array
+            container->type = ARRAY;
+        }
+        cbitmap->total += container->cardinality;
+        if (chunk == cbitmap->chunk_count - 1) {
+            return cbitmap;
+        }
+    }
+    // Fell out of the loop early, it's malformed
+    cbitmap_destroy(cbitmap);
+    return NULL;
+}
+
+void cbitmap_destroy(cbitmap_t *cbitmap) {
+    if (cbitmap) {
+        for (size_t chunk = 0; chunk < cbitmap->chunk_count; ++chunk) {
+            free(cbitmap->chunks[chunk].data);
+        }
+        free(cbitmap->chunks);
+        free(cbitmap);
+    }
+}
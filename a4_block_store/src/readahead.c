@@ -0,0 +1,104 @@
+#include "readahead.h"
+
+// Marks a stream nobody has read through yet
+#define NO_BLOCK SIZE_MAX
+
+struct stream {
+    size_t last;    // Last block read, NO_BLOCK while the stream is unused
+    size_t stride;  // Distance between its reads, 0 until it has two
+    size_t window;  // Size of the last window it fetched, 0 if there isn't one in flight
+    size_t marker;  // Reading this block sends the next window
+    size_t next;    // The block after the last window
+    uint64_t used;  // When it was last read through, 0 if never, for replacement
+};
+
+struct readahead {
+    size_t block_count;
+    size_t max_window;
+    size_t stream_count;
+    uint64_t clock;
+    struct stream streams[];
+};
+
+readahead_t *readahead_create(const size_t block_count, const size_t streams, const size_t max_window) {
+    if (!block_count || !streams || max_window < READAHEAD_MIN_WINDOW) {
+        return NULL;
+    }
+    readahead_t *ra = (readahead_t *) calloc(1, sizeof(readahead_t) + streams * sizeof(struct stream));
+    if (!ra) {
+        return NULL;
+    }
+    ra->block_count  = block_count;
+    ra->max_window   = max_window;
+    ra->stream_count = streams;
+    for (size_t s = 0; s < streams; ++s) {
+        ra->streams[s].last = NO_BLOCK;
+    }
+    return ra;
+}
+
+// Fills in the window of size blocks starting at first along the stream's stride, clipped to the device
+static bool send_window(readahead_t *const ra, struct stream *const s, const size_t first, const size_t size,
+                        readahead_window_t *const window) {
+    if (first >= ra->block_count) {
+        return false;
+    }
+    const size_t fits = (ra->block_count - first + s->stride - 1) / s->stride;
+    s->window = size;
+    s->marker = first;
+    s->next   = first + size * s->stride;
+    *window   = (readahead_window_t){first, s->stride, size < fits ? size : fits};
+    return true;
+}
+
+bool readahead_access(readahead_t *const ra, const size_t block, readahead_window_t *const window) {
+    if (!ra || !window || block >= ra->block_count) {
+        return false;
+    }
+    ++ra->clock;
+
+    // Another read of the same block, or one stride on, is the same stream
+    // Failing that, the closest stream a short way behind it picks up a new stride
+    struct stream *found = NULL, *near = NULL, *oldest = &ra->streams[0];
+    for (size_t i = 0; i < ra->stream_count && !found; ++i) {
+        struct stream *const s = &ra->streams[i];
+        if (s->used < oldest->used) {
+            oldest = s;
+        }
+        if (s->last == NO_BLOCK) {
+            continue;
+        }
+        if (block == s->last || (s->stride && block == s->last + s->stride)) {
+            found = s;
+        } else if (block > s->last && block - s->last <= READAHEAD_MAX_STRIDE &&
+                   (!near || block - s->last < block - near->last)) {
+            near = s;
+        }
+    }
+
+    if (!found) {
+        // A new stride, or a read that fits no pattern taking over a stream
+        struct stream *const s = near ? near : oldest;
+        *s = (struct stream){block, near ? block - near->last : 0, 0, 0, 0, ra->clock};
+        // Sequential reads get going straight away, a longer stride waits for a second read to confirm it
+        return s->stride == 1 && send_window(ra, s, block + 1, READAHEAD_MIN_WINDOW, window);
+    }
+
+    found->used = ra->clock;
+    if (block == found->last) {
+        return false;
+    }
+    found->last = block;
+    if (!found->window) {
+        return send_window(ra, found, block + found->stride, READAHEAD_MIN_WINDOW, window);
+    }
+    if (block == found->marker) {
+        const size_t size = found->window * 2 < ra->max_window ? found->window * 2 : ra->max_window;
+        return send_window(ra, found, found->next, size, window);
+    }
+    return false;
+}
+
+void readahead_destroy(readahead_t *ra) {
+    free(ra);
+}
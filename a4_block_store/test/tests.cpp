@@ -8,7 +8,15 @@
 */
 
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
 #include "../include/block_store.h"
+#include "../include/bitmap.h"
+#include "../include/compressed_bitmap.h"
+#include "../include/buddy.h"
+#include "../include/readahead.h"
 
 // Helpful constants...
 #define BITMAP_SIZE_BYTES 32         // 2^8 blocks.
@@ -241,7 +249,7 @@ TEST(block_store_write_read, valid_write) {
 TEST(block_store_write_read, null_bs_write) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_write(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
 
@@ -328,6 +336,1689 @@ TEST(block_store_write_read, valid_write_and_read) {
     score += 20;
 }
 
+// The bitmap isn't graded, but the block store leans on it, so it gets a few tests of its own
+
+TEST(bitmap, ffs_ffz_across_words) {
+    // Not a multiple of 64 so the last word is partial
+    bitmap_t *bitmap = bitmap_create(1000);
+    ASSERT_NE(nullptr, bitmap);
+
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+    ASSERT_EQ(0, bitmap_ffz(bitmap));
+
+    bitmap_set(bitmap, 130);
+    ASSERT_EQ(130, bitmap_ffs(bitmap));
+    bitmap_set(bitmap, 64);
+    ASSERT_EQ(64, bitmap_ffs(bitmap));
+
+    bitmap_format(bitmap, 0xFF);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_EQ(1000, bitmap_total_set(bitmap));
+    bitmap_reset(bitmap, 999);
+    ASSERT_EQ(999, bitmap_ffz(bitmap));
+    bitmap_reset(bitmap, 63);
+    ASSERT_EQ(63, bitmap_ffz(bitmap));
+
+    // Bits past the end must never be reported
+    bitmap_format(bitmap, 0x00);
+    bitmap_invert(bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_EQ(1000, bitmap_total_set(bitmap));
+
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, overlay_and_export) {
+    uint64_t storage[4] = {0};
+    bitmap_t *bitmap = bitmap_overlay(255, storage);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set(bitmap, 9);
+    // Byte layout is the same as it was with uint8_t storage
+    ASSERT_EQ(0x02, bitmap_export(bitmap)[1]);
+    ASSERT_EQ(9, bitmap_ffs(bitmap));
+    bitmap_destroy(bitmap);
+
+    // Word access can't work on a misaligned buffer
+    ASSERT_EQ(nullptr, bitmap_overlay(64, (uint8_t *) storage + 1));
+}
+
+TEST(bitmap, hierarchical_matches_flat) {
+    // Big enough for three summary levels, with a partial last word
+    const size_t bits = 300000;
+    bitmap_t *flat = bitmap_create(bits);
+    bitmap_t *hier = bitmap_create_hierarchical(bits);
+    ASSERT_NE(nullptr, flat);
+    ASSERT_NE(nullptr, hier);
+
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(hier));
+    ASSERT_EQ(0, bitmap_ffz(hier));
+
+    srand(4);
+    for (int round = 0; round < 20000; ++round) {
+        const size_t bit = (size_t) rand() % bits;
+        if (rand() & 1) {
+            bitmap_set(flat, bit);
+            bitmap_set(hier, bit);
+        } else {
+            bitmap_reset(flat, bit);
+            bitmap_reset(hier, bit);
+        }
+        ASSERT_EQ(bitmap_ffs(flat), bitmap_ffs(hier));
+    }
+
+    // Fill it so ffz has to find the stragglers
+    bitmap_format(hier, 0xFF);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(hier));
+    bitmap_reset(hier, bits - 1);
+    ASSERT_EQ(bits - 1, bitmap_ffz(hier));
+    bitmap_reset(hier, 70000);
+    ASSERT_EQ(70000, bitmap_ffz(hier));
+    bitmap_set(hier, 70000);
+    bitmap_flip(hier, bits - 1);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(hier));
+
+    bitmap_invert(hier);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(hier));
+    ASSERT_EQ(0, bitmap_ffz(hier));
+
+    bitmap_destroy(flat);
+    bitmap_destroy(hier);
+}
+
+TEST(bitmap, hierarchical_overlay_refresh) {
+    uint64_t storage[8] = {0};
+    bitmap_t *bitmap = bitmap_overlay_hierarchical(500, storage);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+
+    // Changed behind the bitmap's back, the summaries don't know until refreshed
+    storage[3] = 0x10;
+    bitmap_refresh(bitmap);
+    ASSERT_EQ(196, bitmap_ffs(bitmap));
+
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, total_set_masks_leftover) {
+    // Every size around a word boundary, with junk in the padding bits from format
+    for (size_t bits = 1; bits < 600; bits += 7) {
+        bitmap_t *bitmap = bitmap_create(bits);
+        ASSERT_NE(nullptr, bitmap);
+        bitmap_format(bitmap, 0xFF);
+        ASSERT_EQ(bits, bitmap_total_set(bitmap));
+
+        size_t expected = 0;
+        for (size_t bit = 0; bit < bits; ++bit) {
+            if ((bit * 2654435761u) & 0x100) {
+                bitmap_reset(bitmap, bit);
+            } else {
+                ++expected;
+            }
+        }
+        ASSERT_EQ(expected, bitmap_total_set(bitmap));
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap, zero_runs_and_ranges) {
+    bitmap_t *bitmap = bitmap_create(1000);
+    ASSERT_NE(nullptr, bitmap);
+
+    ASSERT_EQ(0, bitmap_find_zero_run(bitmap, 1000, 0));
+    ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(bitmap, 1001, 0));
+    ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(bitmap, 0, 0));
+
+    // Range crossing two word boundaries
+    bitmap_set_range(bitmap, 10, 200);
+    ASSERT_EQ(200, bitmap_total_set(bitmap));
+    ASSERT_FALSE(bitmap_test(bitmap, 9));
+    ASSERT_TRUE(bitmap_test(bitmap, 10));
+    ASSERT_TRUE(bitmap_test(bitmap, 209));
+    ASSERT_FALSE(bitmap_test(bitmap, 210));
+
+    ASSERT_EQ(0, bitmap_find_zero_run(bitmap, 10, 0));
+    ASSERT_EQ(210, bitmap_find_zero_run(bitmap, 11, 0));
+    ASSERT_EQ(300, bitmap_find_zero_run(bitmap, 5, 300));
+
+    // Punch a hole in the middle and fill the rest
+    bitmap_reset_range(bitmap, 100, 70);
+    bitmap_set_range(bitmap, 210, 790);
+    ASSERT_EQ(100, bitmap_find_zero_run(bitmap, 70, 0));
+    ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(bitmap, 71, 0));
+    // Wraps around past the hint
+    ASSERT_EQ(100, bitmap_find_zero_run(bitmap, 64, 500));
+    ASSERT_EQ(5, bitmap_find_zero_run(bitmap, 3, 5));
+    ASSERT_EQ(0, bitmap_find_zero_run(bitmap, 10, 200));
+
+    bitmap_destroy(bitmap);
+
+    // Ranges keep hierarchical summaries current
+    bitmap = bitmap_create_hierarchical(5000);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set_range(bitmap, 0, 5000);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    bitmap_reset_range(bitmap, 4000, 3);
+    ASSERT_EQ(4000, bitmap_ffz(bitmap));
+    ASSERT_EQ(0, bitmap_ffs(bitmap));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap, atomic_claims_are_unique) {
+    const size_t bits = 10000;
+    bitmap_t *bitmap = bitmap_create(bits);
+    ASSERT_NE(nullptr, bitmap);
+
+    ASSERT_FALSE(bitmap_test_and_set(bitmap, 5));
+    ASSERT_TRUE(bitmap_test_and_set(bitmap, 5));
+    ASSERT_TRUE(bitmap_test_and_reset(bitmap, 5));
+    ASSERT_FALSE(bitmap_test_and_reset(bitmap, 5));
+
+    // Four threads drain the bitmap, every bit must go to exactly one of them
+    std::vector<std::vector<size_t>> claimed(4);
+    std::vector<std::thread> threads;
+    for (size_t idx = 0; idx < claimed.size(); ++idx) {
+        threads.emplace_back([bitmap, &claimed, idx]() {
+            size_t bit;
+            while ((bit = bitmap_find_zero_and_set(bitmap, 0)) != SIZE_MAX) {
+                claimed[idx].push_back(bit);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    std::vector<bool> seen(bits, false);
+    size_t claims = 0;
+    for (auto &list : claimed) {
+        for (size_t bit : list) {
+            ASSERT_LT(bit, bits);
+            ASSERT_FALSE(seen[bit]);
+            seen[bit] = true;
+            ++claims;
+        }
+    }
+    ASSERT_EQ(bits, claims);
+    ASSERT_EQ(bits, bitmap_total_set(bitmap));
+
+    // Wraps around from the hint
+    bitmap_reset(bitmap, 3);
+    ASSERT_EQ(3, bitmap_find_zero_and_set(bitmap, 9000));
+    bitmap_destroy(bitmap);
+}
+
+static void collect_bit(size_t bit, void *arg) {
+    static_cast<std::vector<size_t> *>(arg)->push_back(bit);
+}
+
+static void collect_batch(const size_t *bits, size_t count, void *arg) {
+    static_cast<std::vector<size_t> *>(arg)->insert(static_cast<std::vector<size_t> *>(arg)->end(), bits, bits + count);
+}
+
+TEST(bitmap, iterate_set_bits) {
+    const size_t bits = 200000;
+    bitmap_t *flat = bitmap_create(bits);
+    bitmap_t *hier = bitmap_create_hierarchical(bits);
+    ASSERT_NE(nullptr, flat);
+    ASSERT_NE(nullptr, hier);
+
+    std::vector<size_t> expected;
+    for (size_t bit = 3; bit < bits; bit += 997) {
+        bitmap_set(flat, bit);
+        bitmap_set(hier, bit);
+        expected.push_back(bit);
+    }
+    // Padding bits must not show up
+    bitmap_set_range(flat, bits - 10, 10);
+    bitmap_set_range(hier, bits - 10, 10);
+    for (size_t bit = bits - 10; bit < bits; ++bit) {
+        expected.push_back(bit);
+    }
+
+    for (bitmap_t *bitmap : {flat, hier}) {
+        std::vector<size_t> walked;
+        for (size_t bit = bitmap_next_set(bitmap, 0); bit != SIZE_MAX; bit = bitmap_next_set(bitmap, bit + 1)) {
+            walked.push_back(bit);
+        }
+        ASSERT_EQ(expected, walked);
+
+        std::vector<size_t> each, batched;
+        bitmap_for_each(bitmap, collect_bit, &each);
+        bitmap_for_each_batch(bitmap, collect_batch, &batched);
+        ASSERT_EQ(expected, each);
+        ASSERT_EQ(expected, batched);
+
+        ASSERT_EQ(4, bitmap_next_zero(bitmap, 3));
+        ASSERT_EQ(bits - 11, bitmap_next_zero(bitmap, bits - 11));
+        ASSERT_EQ(SIZE_MAX, bitmap_next_zero(bitmap, bits - 10));
+        ASSERT_EQ(SIZE_MAX, bitmap_next_set(bitmap, bits));
+    }
+
+    bitmap_destroy(flat);
+    bitmap_destroy(hier);
+}
+
+TEST(bitmap, bulk_operations) {
+    // 1003 bits, so the last word is partial and the leftover byte is too
+    const size_t bits = 1003;
+    bitmap_t *a   = bitmap_create(bits);
+    bitmap_t *b   = bitmap_create(bits);
+    bitmap_t *dst = bitmap_create(bits);
+    bitmap_t *odd = bitmap_create(bits + 1);
+    ASSERT_NE(nullptr, a);
+    ASSERT_NE(nullptr, b);
+    ASSERT_NE(nullptr, dst);
+    ASSERT_NE(nullptr, odd);
+
+    // Junk past the end of both operands must not leak into counts
+    bitmap_format(a, 0xFF);
+    bitmap_format(b, 0xFF);
+    for (size_t bit = 0; bit < bits; ++bit) {
+        if (bit % 3) {
+            bitmap_reset(a, bit);
+        }
+        if (bit % 5) {
+            bitmap_reset(b, bit);
+        }
+    }
+    size_t and_bits = 0, or_bits = 0, xor_bits = 0, andnot_bits = 0;
+    for (size_t bit = 0; bit < bits; ++bit) {
+        const bool in_a = !(bit % 3), in_b = !(bit % 5);
+        and_bits += in_a && in_b;
+        or_bits += in_a || in_b;
+        xor_bits += in_a != in_b;
+        andnot_bits += in_a && !in_b;
+    }
+
+    ASSERT_EQ(and_bits, bitmap_and_count(a, b));
+    ASSERT_EQ(or_bits, bitmap_or_count(a, b));
+    ASSERT_EQ(xor_bits, bitmap_xor_count(a, b));
+    ASSERT_EQ(andnot_bits, bitmap_andnot_count(a, b));
+    ASSERT_EQ(0, bitmap_xor_count(a, a));
+
+    ASSERT_TRUE(bitmap_and(dst, a, b));
+    ASSERT_EQ(and_bits, bitmap_total_set(dst));
+    ASSERT_TRUE(bitmap_test(dst, 15));
+    ASSERT_FALSE(bitmap_test(dst, 5));
+    ASSERT_TRUE(bitmap_or(dst, a, b));
+    ASSERT_EQ(or_bits, bitmap_total_set(dst));
+    ASSERT_TRUE(bitmap_andnot(dst, a, b));
+    ASSERT_EQ(andnot_bits, bitmap_total_set(dst));
+    // In place
+    ASSERT_TRUE(bitmap_xor(a, a, b));
+    ASSERT_EQ(xor_bits, bitmap_total_set(a));
+
+    ASSERT_FALSE(bitmap_and(dst, a, odd));
+    ASSERT_EQ(SIZE_MAX, bitmap_xor_count(a, odd));
+
+    bitmap_destroy(a);
+    bitmap_destroy(b);
+    bitmap_destroy(dst);
+    bitmap_destroy(odd);
+}
+
+TEST(bitmap, rank_select) {
+    const size_t bits = 100003;
+    bitmap_t *plain  = bitmap_create(bits);
+    bitmap_t *ranked = bitmap_create(bits);
+    ASSERT_NE(nullptr, plain);
+    ASSERT_NE(nullptr, ranked);
+    // Padding junk from format must not be counted
+    bitmap_format(plain, 0xFF);
+    bitmap_format(ranked, 0xFF);
+    ASSERT_TRUE(bitmap_enable_rank(ranked));
+    ASSERT_EQ(bits, bitmap_total_set(ranked));
+
+    srand(8);
+    for (int round = 0; round < 30000; ++round) {
+        const size_t bit = (size_t) rand() % bits;
+        if (rand() % 3) {
+            bitmap_reset(plain, bit);
+            bitmap_reset(ranked, bit);
+        } else {
+            bitmap_set(plain, bit);
+            bitmap_set(ranked, bit);
+        }
+    }
+    bitmap_reset_range(plain, 5000, 3000);
+    bitmap_reset_range(ranked, 5000, 3000);
+
+    const size_t set_bits = bitmap_total_set(plain);
+    ASSERT_EQ(set_bits, bitmap_total_set(ranked));
+    ASSERT_EQ(0, bitmap_rank(ranked, 0));
+    ASSERT_EQ(set_bits, bitmap_rank(ranked, bits));
+    for (size_t bit = 0; bit < bits; bit += 331) {
+        ASSERT_EQ(bitmap_rank(plain, bit), bitmap_rank(ranked, bit));
+    }
+    // select is the inverse of rank on set bits
+    for (size_t k = 0; k < set_bits; k += 97) {
+        const size_t bit = bitmap_select(ranked, k);
+        ASSERT_EQ(bitmap_select(plain, k), bit);
+        ASSERT_TRUE(bitmap_test(ranked, bit));
+        ASSERT_EQ(k, bitmap_rank(ranked, bit));
+    }
+    ASSERT_EQ(SIZE_MAX, bitmap_select(ranked, set_bits));
+    ASSERT_EQ(SIZE_MAX, bitmap_select(plain, set_bits));
+
+    bitmap_destroy(plain);
+    bitmap_destroy(ranked);
+}
+
+TEST(cbitmap, matches_plain_bitmap) {
+    // Three full chunks and a partial one, so the tail chunk's bounds get exercised
+    const size_t bits = 3 * 65536 + 1234;
+    bitmap_t *plain   = bitmap_create(bits);
+    cbitmap_t *cb     = cbitmap_create(bits);
+    ASSERT_NE(nullptr, plain);
+    ASSERT_NE(nullptr, cb);
+    ASSERT_EQ(SIZE_MAX, cbitmap_ffs(cb));
+    ASSERT_EQ(0, cbitmap_ffz(cb));
+
+    // Chunk 0 sparse, chunk 1 random and dense-ish, chunk 2 filled, tail clustered
+    srand(9);
+    for (int round = 0; round < 200; ++round) {
+        const size_t bit = (size_t) rand() % 65536;
+        bitmap_set(plain, bit);
+        ASSERT_TRUE(cbitmap_set(cb, bit));
+    }
+    for (int round = 0; round < 60000; ++round) {
+        const size_t bit = 65536 + (size_t) rand() % 65536;
+        if (rand() % 4) {
+            bitmap_set(plain, bit);
+            ASSERT_TRUE(cbitmap_set(cb, bit));
+        } else {
+            bitmap_reset(plain, bit);
+            ASSERT_TRUE(cbitmap_reset(cb, bit));
+        }
+    }
+    for (size_t bit = 2 * 65536; bit < 3 * 65536; ++bit) {
+        bitmap_set(plain, bit);
+        ASSERT_TRUE(cbitmap_set(cb, bit));
+    }
+    for (size_t bit = 3 * 65536; bit < bits; bit += 100) {
+        for (size_t run = bit; run < bit + 40 && run < bits; ++run) {
+            bitmap_set(plain, run);
+            ASSERT_TRUE(cbitmap_set(cb, run));
+        }
+    }
+    // Punch holes in the full chunk so its run gets split
+    for (size_t bit = 2 * 65536 + 7; bit < 3 * 65536; bit += 4099) {
+        bitmap_reset(plain, bit);
+        ASSERT_TRUE(cbitmap_reset(cb, bit));
+    }
+
+    const size_t before = cbitmap_memory_usage(cb);
+    cbitmap_optimize(cb);
+    ASSERT_GE(before, cbitmap_memory_usage(cb));
+    ASSERT_GT(bitmap_get_bytes(plain), cbitmap_memory_usage(cb));
+
+    ASSERT_EQ(bits, cbitmap_get_bits(cb));
+    ASSERT_EQ(bitmap_total_set(plain), cbitmap_total_set(cb));
+    ASSERT_EQ(bitmap_ffs(plain), cbitmap_ffs(cb));
+    ASSERT_EQ(bitmap_ffz(plain), cbitmap_ffz(cb));
+    for (size_t bit = 0; bit < bits; ++bit) {
+        ASSERT_EQ(bitmap_test(plain, bit), cbitmap_test(cb, bit));
+    }
+
+    // Round trips through the plain bitmap
+    bitmap_t *back = cbitmap_to_bitmap(cb);
+    ASSERT_NE(nullptr, back);
+    ASSERT_EQ(0, memcmp(bitmap_export(plain), bitmap_export(back), bitmap_get_bytes(plain)));
+    cbitmap_t *copy = cbitmap_from_bitmap(plain);
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(cbitmap_memory_usage(cb), cbitmap_memory_usage(copy));
+    ASSERT_EQ(cbitmap_total_set(cb), cbitmap_total_set(copy));
+
+    bitmap_destroy(back);
+    cbitmap_destroy(copy);
+    bitmap_destroy(plain);
+    cbitmap_destroy(cb);
+}
+
+TEST(cbitmap, drained_runs) {
+    // A full chunk is one run, emptying it from the top down leaves nothing behind
+    cbitmap_t *cb = cbitmap_create(65536);
+    ASSERT_NE(nullptr, cb);
+    for (size_t bit = 0; bit < 65536; ++bit) {
+        ASSERT_TRUE(cbitmap_set(cb, bit));
+    }
+    ASSERT_EQ(SIZE_MAX, cbitmap_ffz(cb));
+    for (size_t bit = 65536; bit-- > 0;) {
+        ASSERT_TRUE(cbitmap_reset(cb, bit));
+    }
+    ASSERT_EQ(0, cbitmap_total_set(cb));
+    ASSERT_EQ(0, cbitmap_ffz(cb));
+    ASSERT_EQ(SIZE_MAX, cbitmap_ffs(cb));
+
+    // An empty run container in serialized data reads back as an empty chunk
+    const size_t size = cbitmap_serialized_size(cb);
+    std::vector<uint8_t> buffer(size);
+    ASSERT_EQ(size, cbitmap_serialize(cb, buffer.data(), size));
+    buffer[size - 5] = 1;  // the only chunk's type, count 0 and no payload
+    cbitmap_t *copy = cbitmap_deserialize(buffer.data(), size);
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(0, cbitmap_ffz(copy));
+    ASSERT_EQ(SIZE_MAX, cbitmap_ffs(copy));
+    ASSERT_TRUE(cbitmap_set(copy, 5));
+    ASSERT_TRUE(cbitmap_test(copy, 5));
+    ASSERT_EQ(0, cbitmap_ffz(copy));
+    cbitmap_destroy(copy);
+
+    // Runs broken up into single bits switch to an array, and still read back the same
+    for (size_t bit = 0; bit < 65536; ++bit) {
+        ASSERT_TRUE(cbitmap_set(cb, bit));
+    }
+    for (size_t bit = 65536; bit-- > 10;) {
+        ASSERT_TRUE(cbitmap_reset(cb, bit));
+    }
+    const size_t one_run = cbitmap_memory_usage(cb);
+    for (size_t bit = 1; bit < 8; bit += 2) {
+        ASSERT_TRUE(cbitmap_reset(cb, bit));
+    }
+    ASSERT_EQ(6, cbitmap_total_set(cb));
+    ASSERT_EQ(1, cbitmap_ffz(cb));
+    for (size_t bit = 0; bit < 12; ++bit) {
+        ASSERT_EQ(bit == 8 || bit == 9 || (bit < 8 && bit % 2 == 0), cbitmap_test(cb, bit));
+    }
+    ASSERT_GE(one_run + 6 * sizeof(uint16_t), cbitmap_memory_usage(cb));
+    cbitmap_destroy(cb);
+}
+
+TEST(cbitmap, serialize) {
+    const size_t bits = 2 * 65536 + 77;
+    cbitmap_t *cb     = cbitmap_create(bits);
+    ASSERT_NE(nullptr, cb);
+    for (size_t bit = 0; bit < 65536; bit += 3) {
+        cbitmap_set(cb, bit);
+    }
+    for (size_t bit = 65536; bit < bits; ++bit) {
+        cbitmap_set(cb, bit);
+    }
+    cbitmap_reset(cb, bits - 1);
+    cbitmap_optimize(cb);
+
+    const size_t size = cbitmap_serialized_size(cb);
+    std::vector<uint8_t> buffer(size);
+    ASSERT_EQ(0, cbitmap_serialize(cb, buffer.data(), size - 1));
+    ASSERT_EQ(size, cbitmap_serialize(cb, buffer.data(), size));
+    // Dense first chunk, a run for the rest
+    ASSERT_GT(size, 8192);
+    ASSERT_LT(size, 8192 + 64);
+
+    cbitmap_t *copy = cbitmap_deserialize(buffer.data(), size);
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(bits, cbitmap_get_bits(copy));
+    ASSERT_EQ(cbitmap_total_set(cb), cbitmap_total_set(copy));
+    for (size_t bit = 0; bit < bits; ++bit) {
+        ASSERT_EQ(cbitmap_test(cb, bit), cbitmap_test(copy, bit));
+    }
+    cbitmap_destroy(copy);
+
+    // Truncated or corrupted data is refused
+    ASSERT_EQ(nullptr, cbitmap_deserialize(buffer.data(), size - 1));
+    ASSERT_EQ(nullptr, cbitmap_deserialize(buffer.data(), 8));
+    buffer[0] ^= 1;
+    ASSERT_EQ(nullptr, cbitmap_deserialize(buffer.data(), size));
+    buffer[0] ^= 1;
+    buffer[size - 1] = 0xFF;  // run past the end of the bitmap
+    ASSERT_EQ(nullptr, cbitmap_deserialize(buffer.data(), size));
+
+    cbitmap_destroy(cb);
+}
+
+TEST(block_store_geometry, create_ex) {
+    // Bad geometry is refused
+    ASSERT_EQ(nullptr, block_store_create_ex(100, 1024));
+    ASSERT_EQ(nullptr, block_store_create_ex(32, 1024));
+    ASSERT_EQ(nullptr, block_store_create_ex(2 << 20, 1024));
+    ASSERT_EQ(nullptr, block_store_create_ex(4096, 1));
+    ASSERT_EQ(nullptr, block_store_create_ex(4096, ((size_t) 1 << 32) + 1));
+
+    // The default is the same device as block_store_create
+    block_store_t *bs = block_store_create_ex(256, BLOCK_STORE_NUM_BLOCKS);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_block_count(bs));
+    ASSERT_EQ(256, block_store_get_block_size(bs));
+    block_store_destroy(bs);
+
+    // 100000 512 byte blocks need 25 blocks of FBM
+    const size_t block_size = 512;
+    const size_t blocks     = 100000 - 25;
+    bs = block_store_create_ex(block_size, 100000);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(blocks, block_store_get_block_count(bs));
+    ASSERT_EQ(block_size, block_store_get_block_size(bs));
+    ASSERT_EQ(blocks, block_store_get_free_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, blocks));
+
+    // Block 0 and the last block are user data, writing them must not touch the FBM
+    std::vector<uint8_t> write_buffer(block_size, 0xFF), read_buffer(block_size);
+    ASSERT_TRUE(block_store_request(bs, 0));
+    ASSERT_TRUE(block_store_request(bs, blocks - 1));
+    ASSERT_EQ(block_size, block_store_write(bs, 0, write_buffer.data()));
+    write_buffer[0] = 0x42;
+    ASSERT_EQ(block_size, block_store_write(bs, blocks - 1, write_buffer.data()));
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    ASSERT_EQ(1, block_store_allocate(bs));
+
+    ASSERT_EQ(block_size * 100000, block_store_serialize(bs, "geometry.bs"));
+    block_store_destroy(bs);
+
+    // The image only loads with the geometry it was written with
+    ASSERT_EQ(nullptr, block_store_deserialize("geometry.bs"));
+    ASSERT_EQ(nullptr, block_store_deserialize_ex("geometry.bs", block_size, 200000));
+    bs = block_store_deserialize_ex("geometry.bs", block_size, 100000);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(3, block_store_get_used_blocks(bs));
+    ASSERT_EQ(block_size, block_store_read(bs, blocks - 1, read_buffer.data()));
+    ASSERT_EQ(write_buffer, read_buffer);
+    block_store_destroy(bs);
+    remove("geometry.bs");
+}
+
+TEST(block_store_geometry, legacy_image) {
+    // An image in the original layout: the FBM's bits at the front of block 0, block id k at physical block k
+    std::vector<uint8_t> image(BLOCK_STORE_NUM_BYTES, 0);
+    const size_t ids[] = {0, 3, 254};
+    for (size_t id : ids) {
+        image[id / 8] |= (uint8_t) (1 << (id % 8));
+        if (id) {
+            memset(&image[id * BLOCK_SIZE_BYTES], (int) id, BLOCK_SIZE_BYTES);
+        }
+    }
+    image[BLOCK_STORE_NUM_BYTES - 1] = 0xee;  // physical block 255, which no id reached
+    FILE *file = fopen("legacy.bs", "wb");
+    ASSERT_NE(nullptr, file);
+    ASSERT_EQ(image.size(), fwrite(image.data(), 1, image.size(), file));
+    fclose(file);
+
+    ASSERT_EQ(nullptr, block_store_deserialize_legacy(NULL));
+    ASSERT_EQ(nullptr, block_store_deserialize_legacy("no_such_legacy.bs"));
+    block_store_t *bs = block_store_deserialize_legacy("legacy.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(3, block_store_get_used_blocks(bs));
+    std::vector<uint8_t> expected(BLOCK_SIZE_BYTES), read_buffer(BLOCK_SIZE_BYTES);
+    for (size_t id : ids) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, read_buffer.data()));
+        if (id) {
+            memset(expected.data(), (int) id, BLOCK_SIZE_BYTES);
+        } else {
+            // Block 0 used to share its start with the FBM, that's what reading it gave back
+            memcpy(expected.data(), image.data(), BLOCK_SIZE_BYTES);
+        }
+        ASSERT_EQ(expected, read_buffer);
+    }
+    ASSERT_TRUE(block_store_request(bs, 4));
+
+    // Saved again it's a current image, so the plain loader gets the same device
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "legacy_current.bs"));
+    block_store_t *copy = block_store_deserialize("legacy_current.bs");
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(4, block_store_get_used_blocks(copy));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(copy, 254, read_buffer.data()));
+    memset(expected.data(), 254, BLOCK_SIZE_BYTES);
+    ASSERT_EQ(expected, read_buffer);
+    block_store_destroy(copy);
+
+    // The plain loader takes the old layout as a current one, with the blocks one id off
+    copy = block_store_deserialize("legacy.bs");
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(copy, 3, read_buffer.data()));
+    memset(expected.data(), 3, BLOCK_SIZE_BYTES);
+    ASSERT_NE(expected, read_buffer);
+    block_store_destroy(copy);
+    block_store_destroy(bs);
+    remove("legacy.bs");
+    remove("legacy_current.bs");
+}
+
+TEST(block_store_open, mapped_file) {
+    remove("mapped.bs");
+    // Missing files need CREATE
+    ASSERT_EQ(nullptr, block_store_open("mapped.bs", 0));
+    block_store_t *bs = block_store_open("mapped.bs", BLOCK_STORE_OPEN_CREATE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_free_blocks(bs));
+
+    std::vector<uint8_t> write_buffer(BLOCK_SIZE_BYTES, '~'), read_buffer(BLOCK_SIZE_BYTES);
+    ASSERT_TRUE(block_store_request(bs, 10));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, write_buffer.data()));
+    ASSERT_TRUE(block_store_sync(bs));
+    block_store_destroy(bs);
+
+    // The file is an ordinary image, and the changes are in it
+    bs = block_store_deserialize("mapped.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_sync(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, read_buffer.data()));
+    ASSERT_EQ(write_buffer, read_buffer);
+    block_store_destroy(bs);
+
+    // Reopening maps the same device, wrong geometry is refused
+    ASSERT_EQ(nullptr, block_store_open_ex("mapped.bs", 0, BLOCK_SIZE_BYTES, 2 * BLOCK_STORE_NUM_BLOCKS));
+    bs = block_store_open("mapped.bs", 0);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, 10));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, read_buffer.data()));
+    ASSERT_EQ(write_buffer, read_buffer);
+    block_store_destroy(bs);
+
+    // Truncating starts over
+    bs = block_store_open("mapped.bs", BLOCK_STORE_OPEN_TRUNCATE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+    remove("mapped.bs");
+}
+
+TEST(block_store_write_read, vectored) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    for (size_t id = 0; id < 10; ++id) {
+        ASSERT_TRUE(block_store_request(bs, id));
+    }
+    ASSERT_TRUE(block_store_request(bs, 20));
+
+    // 3-5 coalesce, 300 is out of range, 11 isn't in use
+    const size_t ids[] = {3, 4, 5, 20, 300, 7, 11};
+    const size_t count = sizeof(ids) / sizeof(ids[0]);
+    std::vector<uint8_t> source(count * BLOCK_SIZE_BYTES);
+    for (size_t idx = 0; idx < source.size(); ++idx) {
+        source[idx] = (uint8_t) (idx * 7 + idx / BLOCK_SIZE_BYTES);
+    }
+    // Split the source at an odd spot so runs cross buffers
+    struct iovec write_iov[] = {{source.data(), 300}, {source.data() + 300, source.size() - 300}};
+    size_t status[count];
+    ASSERT_EQ(5 * BLOCK_SIZE_BYTES, block_store_writev(bs, ids, count, write_iov, 2, status));
+    const size_t expect[] = {BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES, 0, BLOCK_SIZE_BYTES, 0};
+    for (size_t idx = 0; idx < count; ++idx) {
+        ASSERT_EQ(expect[idx], status[idx]);
+    }
+
+    // Each block holds its slice of the source
+    std::vector<uint8_t> block(BLOCK_SIZE_BYTES);
+    for (size_t idx = 0; idx < count; ++idx) {
+        if (expect[idx]) {
+            ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, ids[idx], block.data()));
+            ASSERT_EQ(0, memcmp(block.data(), source.data() + idx * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES));
+        }
+    }
+
+    // Reading them back gives the source again, skipped blocks' slices untouched
+    std::vector<uint8_t> dest(count * BLOCK_SIZE_BYTES, 0xAA);
+    struct iovec read_iov[] = {{dest.data(), 1000}, {dest.data() + 1000, 0}, {dest.data() + 1000, dest.size() - 1000}};
+    ASSERT_EQ(5 * BLOCK_SIZE_BYTES, block_store_readv(bs, ids, count, read_iov, 3, NULL));
+    for (size_t idx = 0; idx < count; ++idx) {
+        if (expect[idx]) {
+            ASSERT_EQ(0, memcmp(dest.data() + idx * BLOCK_SIZE_BYTES, source.data() + idx * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES));
+        } else {
+            ASSERT_EQ(0xAA, dest[idx * BLOCK_SIZE_BYTES]);
+        }
+    }
+
+    // Buffers too small for every block are refused
+    read_iov[2].iov_len -= 1;
+    ASSERT_EQ(0, block_store_readv(bs, ids, count, read_iov, 3, status));
+    ASSERT_EQ(0, block_store_readv(NULL, ids, count, read_iov, 3, status));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, partial_blocks) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 5));
+    std::vector<uint8_t> block(BLOCK_SIZE_BYTES, 'a');
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 5, block.data()));
+
+    // Only the range changes
+    const char patch[] = "patched";
+    ASSERT_EQ(7, block_store_pwrite(bs, 5, 100, 7, patch));
+    memcpy(block.data() + 100, patch, 7);
+    std::vector<uint8_t> read_buffer(BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, read_buffer.data()));
+    ASSERT_EQ(block, read_buffer);
+
+    char small[16] = {0};
+    ASSERT_EQ(9, block_store_pread(bs, 5, 99, 9, small));
+    ASSERT_STREQ("apatcheda", small);
+    // The last byte is fine, one past it isn't
+    ASSERT_EQ(1, block_store_pread(bs, 5, BLOCK_SIZE_BYTES - 1, 1, small));
+    ASSERT_EQ(0, block_store_pread(bs, 5, BLOCK_SIZE_BYTES - 1, 2, small));
+    ASSERT_EQ(0, block_store_pwrite(bs, 5, BLOCK_SIZE_BYTES, 1, small));
+    ASSERT_EQ(0, block_store_pwrite(bs, 5, 1, SIZE_MAX, small));
+    // Blocks not in use and bad arguments
+    ASSERT_EQ(0, block_store_pread(bs, 6, 0, 1, small));
+    ASSERT_EQ(0, block_store_pwrite(bs, 6, 0, 1, small));
+    ASSERT_EQ(0, block_store_pread(NULL, 5, 0, 1, small));
+    ASSERT_EQ(0, block_store_pwrite(bs, 5, 0, 1, NULL));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, borrow) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(nullptr, block_store_borrow(bs, 3));
+    ASSERT_EQ(nullptr, block_store_borrow_mut(bs, BLOCK_STORE_AVAIL_BLOCKS));
+    ASSERT_EQ(nullptr, block_store_borrow(NULL, 3));
+    ASSERT_TRUE(block_store_request(bs, 3));
+
+    // Writes through the pointer are the block's contents, and the other way around
+    uint8_t *data = (uint8_t *) block_store_borrow_mut(bs, 3);
+    ASSERT_NE(nullptr, data);
+    memset(data, 'x', BLOCK_SIZE_BYTES);
+    std::vector<uint8_t> buffer(BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 3, buffer.data()));
+    ASSERT_EQ(std::vector<uint8_t>(BLOCK_SIZE_BYTES, 'x'), buffer);
+    const uint8_t *view = (const uint8_t *) block_store_borrow(bs, 3);
+    ASSERT_EQ(data, view);
+    buffer[0] = 'y';
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 3, buffer.data()));
+    ASSERT_EQ('y', view[0]);
+
+#ifdef BLOCK_STORE_DEBUG_BORROW
+    // Still borrowed twice, releasing is refused until both are handed back
+    block_store_release(bs, 3);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    block_store_unborrow(bs, 3);
+    block_store_release(bs, 3);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    block_store_unborrow(bs, 3);
+#else
+    block_store_unborrow(bs, 3);
+    block_store_unborrow(bs, 3);
+#endif
+    block_store_release(bs, 3);
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(bitmap, claim_many) {
+    const size_t bits = 1000;
+    bitmap_t *bitmap  = bitmap_create(bits);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set_range(bitmap, 0, 100);
+    bitmap_set(bitmap, 150);
+
+    // Claims skip what's taken and come back in sweep order
+    std::vector<size_t> claimed(300);
+    ASSERT_TRUE(bitmap_find_zeros_and_set(bitmap, 300, claimed.data(), 0));
+    for (size_t idx = 0; idx < 300; ++idx) {
+        ASSERT_EQ(100 + idx + (idx >= 50), claimed[idx]);
+    }
+    ASSERT_EQ(401, bitmap_total_set(bitmap));
+
+    // Starts at the hint's word and wraps around
+    ASSERT_TRUE(bitmap_find_zeros_and_set(bitmap, 50, claimed.data(), 995));
+    ASSERT_EQ(960, claimed[0]);
+    ASSERT_EQ(999, claimed[39]);
+    ASSERT_EQ(401, claimed[40]);
+    ASSERT_EQ(410, claimed[49]);
+
+    // Not enough left, nothing changes
+    const size_t free_bits = bits - bitmap_total_set(bitmap);
+    std::vector<size_t> too_many(free_bits + 1);
+    ASSERT_FALSE(bitmap_find_zeros_and_set(bitmap, free_bits + 1, too_many.data(), 0));
+    ASSERT_EQ(451, bitmap_total_set(bitmap));
+    ASSERT_TRUE(bitmap_find_zeros_and_set(bitmap, free_bits, too_many.data(), 0));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_TRUE(bitmap_find_zeros_and_set(bitmap, 0, NULL, 0));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_alloc_free_req, allocate_and_release_many) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 2));
+
+    size_t ids[BLOCK_STORE_AVAIL_BLOCKS];
+    ASSERT_TRUE(block_store_allocate_n(bs, 100, ids));
+    for (size_t idx = 0; idx < 100; ++idx) {
+        ASSERT_EQ(idx + (idx >= 2), ids[idx]);
+    }
+    ASSERT_EQ(101, block_store_get_used_blocks(bs));
+
+    // All or nothing
+    ASSERT_FALSE(block_store_allocate_n(bs, BLOCK_STORE_AVAIL_BLOCKS - 100, ids));
+    ASSERT_EQ(101, block_store_get_used_blocks(bs));
+    ASSERT_FALSE(block_store_allocate_n(NULL, 1, ids));
+    ASSERT_FALSE(block_store_allocate_n(bs, 1, NULL));
+
+    // Bad ids in the list are skipped
+    const size_t release[] = {0, 1, 2, 500, 3};
+    block_store_release_n(bs, release, 5);
+    ASSERT_EQ(97, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_allocate(bs));
+    block_store_destroy(bs);
+}
+
+TEST(bitmap, claim_range) {
+    bitmap_t *bitmap = bitmap_create(300);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_TRUE(bitmap_test_and_set_range(bitmap, 60, 100));
+    ASSERT_EQ(100, bitmap_total_set(bitmap));
+    // Overlapping claims fail and leave the map alone, even when the clash is past the first word
+    ASSERT_FALSE(bitmap_test_and_set_range(bitmap, 0, 61));
+    ASSERT_FALSE(bitmap_test_and_set_range(bitmap, 159, 2));
+    bitmap_set(bitmap, 250);
+    ASSERT_FALSE(bitmap_test_and_set_range(bitmap, 160, 100));
+    ASSERT_EQ(101, bitmap_total_set(bitmap));
+    ASSERT_EQ(160, bitmap_next_zero(bitmap, 60));
+    ASSERT_FALSE(bitmap_test_and_set_range(bitmap, 290, 11));
+    ASSERT_TRUE(bitmap_test_and_set_range(bitmap, 290, 10));
+
+    ASSERT_TRUE(bitmap_test_and_reset_range(bitmap, 60, 100));
+    ASSERT_FALSE(bitmap_test_and_reset_range(bitmap, 249, 2));
+    ASSERT_EQ(10, bitmap_total_set(bitmap));
+    ASSERT_FALSE(bitmap_test_and_reset_range(bitmap, 0, 0));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_alloc_free_req, extents) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    // Free runs: [0, 10), [11, 15), [16, 100), [101, 255)
+    ASSERT_TRUE(block_store_request(bs, 10));
+    ASSERT_TRUE(block_store_request(bs, 15));
+    ASSERT_TRUE(block_store_request(bs, 100));
+
+    size_t first = SIZE_MAX;
+    ASSERT_TRUE(block_store_allocate_extent(bs, 4, &first));
+    ASSERT_EQ(0, first);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 7, &first));
+    ASSERT_EQ(16, first);
+
+    // Best fit takes the exact run over the earlier bigger one
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_BEST_FIT));
+    ASSERT_TRUE(block_store_allocate_extent(bs, 4, &first));
+    ASSERT_EQ(11, first);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 100, &first));
+    ASSERT_EQ(101, first);
+    ASSERT_FALSE(block_store_allocate_extent(bs, 100, &first));
+    ASSERT_FALSE(block_store_set_policy(bs, (BLOCK_STORE_POLICY) 42));
+    ASSERT_FALSE(block_store_allocate_extent(bs, 0, &first));
+
+    block_store_release_extent(bs, 101, 100);
+    ASSERT_EQ(4 + 7 + 4 + 3, block_store_get_used_blocks(bs));
+    block_store_release_extent(bs, 250, 10);
+    ASSERT_EQ(4 + 7 + 4 + 3, block_store_get_used_blocks(bs));
+    ASSERT_TRUE(block_store_allocate_extent(bs, 154, &first));
+    ASSERT_EQ(101, first);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_alloc_free_req, policies_and_fragmentation) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    block_store_fragmentation_t stats;
+    ASSERT_TRUE(block_store_fragmentation_stats(bs, &stats));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, stats.free_blocks);
+    ASSERT_EQ(1, stats.free_runs);
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, stats.largest_free_run);
+    ASSERT_EQ(1, stats.run_histogram[7]);
+
+    // Free runs: [0, 10), [11, 13), [14, 200), [201, 255)
+    ASSERT_TRUE(block_store_request(bs, 10));
+    ASSERT_TRUE(block_store_request(bs, 13));
+    ASSERT_TRUE(block_store_request(bs, 200));
+    ASSERT_TRUE(block_store_fragmentation_stats(bs, &stats));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 3, stats.free_blocks);
+    ASSERT_EQ(4, stats.free_runs);
+    ASSERT_EQ(186, stats.largest_free_run);
+    ASSERT_EQ(1, stats.run_histogram[1]);
+    ASSERT_EQ(1, stats.run_histogram[3]);
+    ASSERT_EQ(1, stats.run_histogram[5]);
+    ASSERT_EQ(1, stats.run_histogram[7]);
+
+    // Best fit fills the smallest hole, worst fit the biggest run
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_BEST_FIT));
+    ASSERT_EQ(11, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_WORST_FIT));
+    ASSERT_EQ(14, block_store_allocate(bs));
+
+    // Next fit carries on from the last allocation and wraps around at the end
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_NEXT_FIT));
+    size_t first = 0;
+    ASSERT_TRUE(block_store_allocate_extent(bs, 50, &first));
+    ASSERT_EQ(15, first);
+    ASSERT_EQ(65, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_allocate_extent(bs, 134, &first));
+    ASSERT_EQ(66, first);
+    size_t ids[3];
+    ASSERT_TRUE(block_store_allocate_n(bs, 3, ids));
+    ASSERT_EQ(201, ids[0]);
+    ASSERT_EQ(203, ids[2]);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 51, &first));
+    ASSERT_EQ(204, first);
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(1, block_store_allocate(bs));
+
+    ASSERT_FALSE(block_store_fragmentation_stats(bs, NULL));
+    ASSERT_FALSE(block_store_fragmentation_stats(NULL, &stats));
+    block_store_destroy(bs);
+}
+
+TEST(buddy, split_and_merge) {
+    bitmap_t *fbm = bitmap_create(64);
+    ASSERT_NE(nullptr, fbm);
+    bitmap_set(fbm, 5);
+    ASSERT_EQ(nullptr, buddy_create(NULL, 6));
+    ASSERT_EQ(nullptr, buddy_create(fbm, BUDDY_MAX_ORDER + 1));
+    buddy_t *buddy = buddy_create(fbm, 20);
+    ASSERT_NE(nullptr, buddy);
+    // Clamped to the map, and the free space is [0, 4) [4] [6, 8) [8, 16) [16, 32) [32, 64)
+    ASSERT_EQ(6, buddy_get_max_order(buddy));
+    ASSERT_EQ(SIZE_MAX, buddy_allocate(buddy, 6));
+    ASSERT_EQ(16, buddy_allocate(buddy, 4));
+    ASSERT_EQ(32, buddy_allocate(buddy, 5));
+    // Smallest free block first, splitting the next one up when a size runs out
+    ASSERT_EQ(4, buddy_allocate(buddy, 0));
+    ASSERT_EQ(6, buddy_allocate(buddy, 0));
+    ASSERT_EQ(7, buddy_allocate(buddy, 0));
+    ASSERT_EQ(0, buddy_allocate(buddy, 0));
+    ASSERT_EQ(2, buddy_allocate(buddy, 1));
+    ASSERT_EQ(1, buddy_allocate(buddy, 0));
+    ASSERT_EQ(8, buddy_allocate(buddy, 0));
+
+    // Claims are all or nothing
+    ASSERT_FALSE(buddy_claim(buddy, 8, 8));
+    ASSERT_TRUE(buddy_claim(buddy, 12, 4));
+    ASSERT_FALSE(buddy_claim(buddy, 12, 1));
+    ASSERT_FALSE(buddy_claim(buddy, 60, 8));
+    ASSERT_EQ(9, buddy_allocate(buddy, 0));
+    ASSERT_EQ(10, buddy_allocate(buddy, 1));
+    ASSERT_EQ(SIZE_MAX, buddy_allocate(buddy, 0));
+
+    // Giving it all back merges everything into one block again
+    buddy_release(buddy, 0, 5);
+    buddy_release(buddy, 6, 58);
+    ASSERT_EQ(SIZE_MAX, buddy_allocate(buddy, 6));
+    buddy_release(buddy, 5, 1);
+    ASSERT_EQ(0, buddy_allocate(buddy, 6));
+
+    buddy_destroy(buddy);
+    buddy_destroy(NULL);
+    bitmap_destroy(fbm);
+}
+
+TEST(block_store_alloc_free_req, buddy) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_enable_buddy(NULL, 4));
+    ASSERT_FALSE(block_store_enable_buddy(bs, 33));
+    ASSERT_TRUE(block_store_request(bs, 5));
+    ASSERT_TRUE(block_store_enable_buddy(bs, 4));
+
+    // 4 blocks come from the smallest buddy that fits, rounding up and giving back the tail
+    size_t first = 0;
+    ASSERT_TRUE(block_store_allocate_extent(bs, 4, &first));
+    ASSERT_EQ(0, first);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 3, &first));
+    ASSERT_EQ(248, first);
+    ASSERT_EQ(4, block_store_allocate(bs));
+    ASSERT_EQ(251, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_allocate_extent(bs, 16, &first));
+    ASSERT_EQ(16, first);
+    ASSERT_FALSE(block_store_request(bs, 16));
+    ASSERT_TRUE(block_store_request(bs, 12));
+    ASSERT_TRUE(block_store_allocate_extent(bs, 2, &first));
+    ASSERT_EQ(6, first);
+
+    // Bigger than the biggest buddy falls back to the fbm
+    ASSERT_TRUE(block_store_allocate_extent(bs, 100, &first));
+    ASSERT_EQ(32, first);
+    ASSERT_EQ(13, block_store_allocate(bs));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 130, block_store_get_free_blocks(bs));
+
+    // Freed buddies merge back, the partly used range only gives back what was in use
+    block_store_release(bs, 5);
+    block_store_release_extent(bs, 0, 32);
+    block_store_release_extent(bs, 0, 32);
+    block_store_release_extent(bs, 32, 100);
+    block_store_release_extent(bs, 248, 4);
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_free_blocks(bs));
+    ASSERT_TRUE(block_store_allocate_extent(bs, 16, &first));
+    ASSERT_EQ(0, first);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 16, &first));
+    ASSERT_EQ(16, first);
+    size_t ids[3];
+    ASSERT_TRUE(block_store_allocate_n(bs, 3, ids));
+    ASSERT_EQ(32, ids[0]);
+    ASSERT_EQ(34, ids[2]);
+    ASSERT_EQ(35, block_store_allocate(bs));
+
+    // The fbm is the source of truth, a rebuilt index agrees with it
+    ASSERT_TRUE(block_store_enable_buddy(bs, 7));
+    ASSERT_TRUE(block_store_allocate_extent(bs, 64, &first));
+    ASSERT_EQ(64, first);
+    ASSERT_TRUE(block_store_allocate_extent(bs, 4, &first));
+    ASSERT_EQ(36, first);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_alloc_free_req, magazine_caches) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_enable_caches(NULL, 8));
+    ASSERT_FALSE(block_store_enable_caches(bs, 0));
+    ASSERT_TRUE(block_store_enable_caches(bs, 8));
+    ASSERT_FALSE(block_store_enable_caches(bs, 8));
+    ASSERT_FALSE(block_store_enable_buddy(bs, 4));
+
+    // The first allocate pulls in 0-3, the rest stay cached but count as free
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 1, block_store_get_free_blocks(bs));
+    ASSERT_EQ(1, block_store_allocate(bs));
+    // A request takes a cached block from under the magazine
+    ASSERT_TRUE(block_store_request(bs, 2));
+    ASSERT_FALSE(block_store_request(bs, 2));
+    ASSERT_EQ(3, block_store_allocate(bs));
+    ASSERT_EQ(4, block_store_allocate(bs));
+    // Released blocks come straight back, releasing twice doesn't cache it twice
+    block_store_release(bs, 1);
+    block_store_release(bs, 1);
+    ASSERT_EQ(4, block_store_get_used_blocks(bs));
+    // A cached block is free, none of the data paths will touch it
+    std::vector<uint8_t> buffer(BLOCK_SIZE_BYTES, '~');
+    struct iovec iov = {buffer.data(), BLOCK_SIZE_BYTES};
+    const size_t freed = 1;
+    ASSERT_EQ(0, block_store_read(bs, 1, buffer.data()));
+    ASSERT_EQ(0, block_store_write(bs, 1, buffer.data()));
+    ASSERT_EQ(0, block_store_pread(bs, 1, 0, 8, buffer.data()));
+    ASSERT_EQ(0, block_store_pwrite(bs, 1, 0, 8, buffer.data()));
+    ASSERT_EQ(0, block_store_readv(bs, &freed, 1, &iov, 1, NULL));
+    ASSERT_EQ(0, block_store_writev(bs, &freed, 1, &iov, 1, NULL));
+    ASSERT_EQ(nullptr, block_store_borrow(bs, 1));
+    ASSERT_EQ(nullptr, block_store_borrow_mut(bs, 1));
+    ASSERT_EQ(1, block_store_allocate(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 1, buffer.data()));
+    ASSERT_NE(1, block_store_allocate(bs));
+
+    // Serialize flushes the magazines, so the image only has what's really in use
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "caches.bs"));
+    block_store_t *copy = block_store_deserialize("caches.bs");
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(6, block_store_get_used_blocks(copy));
+    ASSERT_EQ(6, block_store_allocate(copy));
+    block_store_destroy(copy);
+    remove("caches.bs");
+
+    // Four threads allocate from their own magazines, every block goes to exactly one of them
+    std::vector<std::vector<size_t>> claimed(4);
+    std::vector<std::thread> threads;
+    for (size_t idx = 0; idx < claimed.size(); ++idx) {
+        threads.emplace_back([bs, &claimed, idx]() {
+            for (size_t i = 0; i < 40; ++i) {
+                size_t id = block_store_allocate(bs);
+                claimed[idx].push_back(id);
+                if (i % 3 == 0) {
+                    block_store_release(bs, id);
+                    claimed[idx].pop_back();
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    std::vector<bool> seen(BLOCK_STORE_AVAIL_BLOCKS, false);
+    size_t claims = 0;
+    for (auto &list : claimed) {
+        for (size_t id : list) {
+            ASSERT_LT(id, BLOCK_STORE_AVAIL_BLOCKS);
+            ASSERT_FALSE(seen[id]);
+            seen[id] = true;
+            ++claims;
+        }
+    }
+    ASSERT_EQ(6 + claims, block_store_get_used_blocks(bs));
+    block_store_flush_caches(bs);
+    block_store_fragmentation_t stats;
+    ASSERT_TRUE(block_store_fragmentation_stats(bs, &stats));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 6 - claims, stats.free_blocks);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, sharded) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_enable_sharding(NULL, 4));
+    ASSERT_FALSE(block_store_enable_sharding(bs, 0));
+    ASSERT_TRUE(block_store_enable_sharding(bs, 4));
+    ASSERT_FALSE(block_store_enable_sharding(bs, 4));
+    ASSERT_FALSE(block_store_enable_caches(bs, 8));
+    ASSERT_FALSE(block_store_enable_buddy(bs, 4));
+
+    // A block everyone reads while the workers churn their own shards
+    const size_t shared = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, shared);
+    std::vector<uint8_t> pattern(BLOCK_SIZE_BYTES, 0x5a);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, shared, pattern.data()));
+
+    // Four threads land in four different shards, each 64 blocks
+    std::vector<std::vector<size_t>> claimed(4);
+    std::vector<size_t> failures(4, 0);
+    std::vector<std::thread> threads;
+    for (size_t idx = 0; idx < claimed.size(); ++idx) {
+        threads.emplace_back([bs, &claimed, &failures, shared, idx]() {
+            std::vector<uint8_t> out(BLOCK_SIZE_BYTES), in(BLOCK_SIZE_BYTES);
+            for (size_t i = 0; i < 30; ++i) {
+                size_t id = block_store_allocate(bs);
+                memset(out.data(), (int) (idx * 30 + i), BLOCK_SIZE_BYTES);
+                if (block_store_write(bs, id, out.data()) != BLOCK_SIZE_BYTES ||
+                    block_store_read(bs, id, in.data()) != BLOCK_SIZE_BYTES || in != out ||
+                    block_store_read(bs, shared, in.data()) != BLOCK_SIZE_BYTES || in[0] != 0x5a) {
+                    ++failures[idx];
+                }
+                claimed[idx].push_back(id);
+                if (i % 2) {
+                    block_store_release(bs, id);
+                    claimed[idx].pop_back();
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    std::vector<bool> shards(4, false);
+    size_t claims = 0;
+    for (size_t idx = 0; idx < claimed.size(); ++idx) {
+        ASSERT_EQ(0, failures[idx]);
+        ASSERT_EQ(15, claimed[idx].size());
+        for (size_t id : claimed[idx]) {
+            ASSERT_EQ(claimed[idx][0] / 64, id / 64);
+        }
+        shards[claimed[idx][0] / 64] = true;
+        claims += claimed[idx].size();
+    }
+    ASSERT_EQ(std::vector<bool>(4, true), shards);
+    ASSERT_EQ(1 + claims, block_store_get_used_blocks(bs));
+
+    // Vectored writes only lock the shards their ids are in, so each thread's run through its own shard goes on
+    //  at the same time as the others, and an id past the end is just skipped
+    threads.clear();
+    for (size_t idx = 0; idx < claimed.size(); ++idx) {
+        threads.emplace_back([bs, &claimed, &failures, idx]() {
+            std::vector<size_t> ids(claimed[idx]);
+            ids.push_back(SIZE_MAX);
+            const size_t bytes = claimed[idx].size() * BLOCK_SIZE_BYTES;
+            std::vector<uint8_t> out(ids.size() * BLOCK_SIZE_BYTES), in(out.size());
+            std::vector<size_t> status(ids.size());
+            for (size_t i = 0; i < 200; ++i) {
+                memset(out.data(), (int) (idx * 200 + i), out.size());
+                struct iovec out_iov = {out.data(), out.size()}, in_iov = {in.data(), in.size()};
+                if (block_store_writev(bs, ids.data(), ids.size(), &out_iov, 1, status.data()) != bytes ||
+                    status.back() != 0 || block_store_readv(bs, ids.data(), ids.size(), &in_iov, 1, NULL) != bytes ||
+                    memcmp(in.data(), out.data(), bytes) != 0) {
+                    ++failures[idx];
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    ASSERT_EQ(std::vector<size_t>(4, 0), failures);
+
+    // Extents lock every shard they cover
+    size_t first = 0;
+    ASSERT_TRUE(block_store_allocate_extent(bs, 30, &first));
+    block_store_release_extent(bs, first, 30);
+    ASSERT_EQ(1 + claims, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, seqlock) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_enable_seqlock(NULL, 1));
+    ASSERT_FALSE(block_store_enable_seqlock(bs, 0));
+    ASSERT_TRUE(block_store_enable_seqlock(bs, 2));
+    ASSERT_FALSE(block_store_enable_seqlock(bs, 2));
+    ASSERT_TRUE(block_store_enable_sharding(bs, 2));
+
+    // A small hot set, one writer keeps rewriting every block with a single repeated byte
+    const size_t hot = 4;
+    std::vector<uint8_t> buffer(BLOCK_SIZE_BYTES, 0);
+    for (size_t id = 0; id < hot; ++id) {
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer.data()));
+    }
+    ASSERT_EQ(0, block_store_read(bs, hot, buffer.data()));
+    ASSERT_EQ(0, block_store_pread(bs, hot, 0, 1, buffer.data()));
+
+    // Readers must only ever see whole writes, never a block that's half one byte and half another
+    bool stop = false;
+    std::vector<size_t> torn(3, 0);
+    std::vector<std::thread> readers;
+    for (size_t idx = 0; idx < torn.size(); ++idx) {
+        readers.emplace_back([bs, &stop, &torn, hot, idx]() {
+            std::vector<uint8_t> in(BLOCK_SIZE_BYTES);
+            for (size_t i = 0; !__atomic_load_n(&stop, __ATOMIC_ACQUIRE) || i < 1000; ++i) {
+                const size_t id = i % hot;
+                const bool whole = idx % 2 == 0;
+                const size_t got = whole ? block_store_read(bs, id, in.data())
+                                         : block_store_pread(bs, id, 16, BLOCK_SIZE_BYTES - 32, in.data());
+                const size_t len = whole ? BLOCK_SIZE_BYTES : BLOCK_SIZE_BYTES - 32;
+                if (got != len || std::count(in.begin(), in.begin() + len, in[0]) != (long) len) {
+                    ++torn[idx];
+                }
+            }
+        });
+    }
+    std::vector<uint8_t> out(BLOCK_SIZE_BYTES);
+    for (size_t i = 1; i < 20000; ++i) {
+        memset(out.data(), (int) (i & 0xff), BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, i % hot, out.data()));
+    }
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (auto &thread : readers) {
+        thread.join();
+    }
+    ASSERT_EQ(std::vector<size_t>(3, 0), torn);
+
+    // Releases bump the sequence too, so a freed block reads as not in use
+    block_store_release(bs, 1);
+    ASSERT_EQ(0, block_store_read(bs, 1, buffer.data()));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 0, buffer.data()));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_open, cached_file) {
+    const size_t block_size = 512, blocks = 1000, cached = 4;
+    remove("cached.bs");
+    ASSERT_EQ(nullptr, block_store_open_cached("cached.bs", 0, block_size, blocks, cached));
+    ASSERT_EQ(nullptr, block_store_open_cached("cached.bs", BLOCK_STORE_OPEN_CREATE, block_size, blocks, 0));
+    block_store_t *bs = block_store_open_cached("cached.bs", BLOCK_STORE_OPEN_CREATE, block_size, blocks, cached);
+    ASSERT_NE(nullptr, bs);
+    block_store_cache_stats_t stats;
+    ASSERT_FALSE(block_store_get_cache_stats(NULL, &stats));
+    ASSERT_FALSE(block_store_get_cache_stats(bs, NULL));
+
+    // Frames can be evicted under a borrower, and optimistic reads would race the cache
+    ASSERT_TRUE(block_store_request(bs, 0));
+    ASSERT_EQ(nullptr, block_store_borrow(bs, 0));
+    block_store_release(bs, 0);
+    ASSERT_FALSE(block_store_enable_seqlock(bs, 1));
+
+    // Far more blocks than frames, every one of them has to be written back and read in again
+    const size_t used = 64;
+    std::vector<uint8_t> write_buffer(block_size), read_buffer(block_size);
+    for (size_t id = 0; id < used; ++id) {
+        ASSERT_TRUE(block_store_request(bs, id));
+        memset(write_buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, write_buffer.data()));
+    }
+    for (size_t id = 0; id < used; ++id) {
+        memset(write_buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_read(bs, id, read_buffer.data()));
+        ASSERT_EQ(write_buffer, read_buffer);
+    }
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(2 * used, stats.misses);
+    ASSERT_EQ(2 * used - cached, stats.evictions);
+    ASSERT_EQ(used, stats.writebacks);
+
+    // A hot block stays cached
+    for (size_t i = 0; i < 10; ++i) {
+        ASSERT_EQ(8, block_store_pwrite(bs, used - 1, 8, 8, write_buffer.data()));
+    }
+    block_store_cache_stats_t hot;
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &hot));
+    ASSERT_EQ(stats.hits + 10, hot.hits);
+    ASSERT_EQ(stats.misses, hot.misses);
+    ASSERT_TRUE(block_store_sync(bs));
+
+    // Serializing goes through the file, so it has the cached changes too
+    ASSERT_EQ(block_size * blocks, block_store_serialize(bs, "cached_image.bs"));
+    block_store_destroy(bs);
+
+    block_store_t *image = block_store_deserialize_ex("cached_image.bs", block_size, blocks);
+    ASSERT_NE(nullptr, image);
+    bs = block_store_open_ex("cached.bs", 0, block_size, blocks);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    ASSERT_EQ(used, block_store_get_used_blocks(image));
+    for (size_t id = 0; id < used; ++id) {
+        memset(write_buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_read(bs, id, read_buffer.data()));
+        ASSERT_EQ(write_buffer, read_buffer);
+        ASSERT_EQ(block_size, block_store_read(image, id, read_buffer.data()));
+        ASSERT_EQ(write_buffer, read_buffer);
+    }
+    block_store_destroy(image);
+    block_store_destroy(bs);
+
+    // Wrong geometry is refused, same as a mapped open
+    ASSERT_EQ(nullptr, block_store_open_cached("cached.bs", 0, block_size, 2 * blocks, cached));
+
+    // Whole-block writes take a frame without reading the block in, so they work with the blocks cut off the file
+    bs = block_store_open_cached("cached.bs", 0, block_size, blocks, cached);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, truncate("cached.bs", block_size));
+    ASSERT_EQ(0, block_store_pwrite(bs, 0, 0, 8, write_buffer.data()));
+    for (size_t id = 0; id < used; ++id) {
+        memset(write_buffer.data(), (int) id + 1, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, write_buffer.data()));
+    }
+    const size_t first_two[] = {0, 1};
+    std::vector<uint8_t> two_blocks(2 * block_size, 0xee);
+    const struct iovec iov = {two_blocks.data(), two_blocks.size()};
+    ASSERT_EQ(2 * block_size, block_store_writev(bs, first_two, 2, &iov, 1, NULL));
+    for (size_t id = 0; id < used; ++id) {
+        memset(write_buffer.data(), id < 2 ? 0xee : (int) id + 1, block_size);
+        ASSERT_EQ(block_size, block_store_read(bs, id, read_buffer.data()));
+        ASSERT_EQ(write_buffer, read_buffer);
+    }
+    block_store_destroy(bs);
+    remove("cached.bs");
+    remove("cached_image.bs");
+}
+
+static void expect_window(readahead_t *ra, size_t block, size_t first, size_t stride, size_t count) {
+    readahead_window_t window;
+    ASSERT_TRUE(readahead_access(ra, block, &window)) << "block " << block;
+    ASSERT_EQ(first, window.first) << "block " << block;
+    ASSERT_EQ(stride, window.stride) << "block " << block;
+    ASSERT_EQ(count, window.count) << "block " << block;
+}
+
+TEST(readahead, windows) {
+    ASSERT_EQ(nullptr, readahead_create(0, 2, 16));
+    ASSERT_EQ(nullptr, readahead_create(1000, 0, 16));
+    ASSERT_EQ(nullptr, readahead_create(1000, 2, READAHEAD_MIN_WINDOW - 1));
+    readahead_t *ra = readahead_create(1000, 2, 16);
+    ASSERT_NE(nullptr, ra);
+    readahead_window_t window;
+    ASSERT_FALSE(readahead_access(NULL, 10, &window));
+    ASSERT_FALSE(readahead_access(ra, 10, NULL));
+    ASSERT_FALSE(readahead_access(ra, 1000, &window));
+
+    // Sequential starts on the second read, then each window is twice the last up to the cap,
+    //  sent when the reader gets to the start of the one before
+    ASSERT_FALSE(readahead_access(ra, 10, &window));
+    expect_window(ra, 11, 12, 1, 4);
+    ASSERT_FALSE(readahead_access(ra, 11, &window));
+    expect_window(ra, 12, 16, 1, 8);
+    for (size_t block = 13; block < 16; ++block) {
+        ASSERT_FALSE(readahead_access(ra, block, &window));
+    }
+    expect_window(ra, 16, 24, 1, 16);
+    for (size_t block = 17; block < 24; ++block) {
+        ASSERT_FALSE(readahead_access(ra, block, &window));
+    }
+    expect_window(ra, 24, 40, 1, 16);
+
+    // A strided stream needs a second stride to confirm it, and doesn't disturb the sequential one
+    ASSERT_FALSE(readahead_access(ra, 500, &window));
+    ASSERT_FALSE(readahead_access(ra, 503, &window));
+    expect_window(ra, 506, 509, 3, 4);
+    ASSERT_FALSE(readahead_access(ra, 25, &window));
+    expect_window(ra, 509, 521, 3, 8);
+
+    // A far off read takes the least recently used stream, and windows stop at the end of the device
+    ASSERT_FALSE(readahead_access(ra, 995, &window));
+    expect_window(ra, 996, 997, 1, 3);
+    ASSERT_FALSE(readahead_access(ra, 997, &window));
+    ASSERT_FALSE(readahead_access(ra, 26, &window));
+    expect_window(ra, 27, 28, 1, 4);
+    readahead_destroy(ra);
+}
+
+TEST(block_store_open, readahead) {
+    const size_t block_size = 512, blocks = 1000, cached = 64, used = 256;
+    ASSERT_FALSE(block_store_enable_readahead(NULL, 16));
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_enable_readahead(bs, 16));
+    block_store_destroy(bs);
+
+    remove("readahead.bs");
+    bs = block_store_open_cached("readahead.bs", BLOCK_STORE_OPEN_CREATE, block_size, blocks, cached);
+    ASSERT_NE(nullptr, bs);
+    std::vector<uint8_t> write_buffer(block_size), read_buffer(block_size);
+    for (size_t id = 0; id < used; ++id) {
+        ASSERT_TRUE(block_store_request(bs, id));
+        memset(write_buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, write_buffer.data()));
+    }
+    ASSERT_FALSE(block_store_enable_readahead(bs, READAHEAD_MIN_WINDOW - 1));
+    ASSERT_TRUE(block_store_enable_readahead(bs, 16));
+    ASSERT_FALSE(block_store_enable_readahead(bs, 16));
+
+    // Reading 0 to 2 sends 2-5 and then 6-13 to the worker, once it's had time the rest are all hits
+    for (size_t id = 0; id < 3; ++id) {
+        ASSERT_EQ(block_size, block_store_read(bs, id, read_buffer.data()));
+    }
+    block_store_cache_stats_t stats;
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    for (size_t wait = 0; wait < 5000 && stats.prefetched < 10; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    }
+    ASSERT_GE(stats.prefetched, 10);
+    for (size_t id = 3; id < 14; ++id) {
+        ASSERT_EQ(block_size, block_store_read(bs, id, read_buffer.data()));
+    }
+    block_store_cache_stats_t after;
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &after));
+    ASSERT_EQ(stats.misses, after.misses);
+    ASSERT_GE(after.prefetch_hits, 10);
+
+    // Prefetching never changes what's read, wherever the worker has got to
+    for (size_t id = 0; id < used; ++id) {
+        memset(write_buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_read(bs, id, read_buffer.data()));
+        ASSERT_EQ(write_buffer, read_buffer);
+    }
+    block_store_destroy(bs);
+
+    // Mapped devices just hint the kernel
+    bs = block_store_open_ex("readahead.bs", 0, block_size, blocks);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_enable_readahead(bs, 16));
+    for (size_t id = 0; id < used; ++id) {
+        memset(write_buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_read(bs, id, read_buffer.data()));
+        ASSERT_EQ(write_buffer, read_buffer);
+    }
+    block_store_destroy(bs);
+    remove("readahead.bs");
+}
+
+TEST(block_store_serialize, incremental_flush) {
+    const size_t block_size = 512, blocks = 1000, used = 100;
+    const size_t image_bytes = block_size * blocks;
+    remove("flush.bs");
+    remove("flush_other.bs");
+    block_store_t *bs = block_store_create_ex(block_size, blocks);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_flush(NULL, "flush.bs"));
+    ASSERT_EQ(0, block_store_flush(bs, NULL));
+
+    std::vector<uint8_t> write_buffer(block_size), read_buffer(block_size);
+    for (size_t id = 0; id < used; ++id) {
+        ASSERT_TRUE(block_store_request(bs, id));
+        memset(write_buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, write_buffer.data()));
+    }
+    // A new file gets everything, after that only what changed
+    ASSERT_EQ(image_bytes, block_store_flush(bs, "flush.bs"));
+    ASSERT_EQ(0, block_store_flush(bs, "flush.bs"));
+
+    // Two neighbours and one on its own, only the data changes
+    memset(write_buffer.data(), 0xaa, block_size);
+    ASSERT_EQ(block_size, block_store_write(bs, 10, write_buffer.data()));
+    ASSERT_EQ(8, block_store_pwrite(bs, 11, 0, 8, write_buffer.data()));
+    ASSERT_EQ(block_size, block_store_write(bs, 50, write_buffer.data()));
+    ASSERT_EQ(3 * block_size, block_store_flush(bs, "flush.bs"));
+
+    // Allocating and freeing changes the fbm block but no data
+    ASSERT_TRUE(block_store_request(bs, 500));
+    block_store_release(bs, 20);
+    ASSERT_EQ(block_size, block_store_flush(bs, "flush.bs"));
+
+    // Writes through a borrowed pointer count from the borrow
+    uint8_t *data = (uint8_t *) block_store_borrow_mut(bs, 30);
+    ASSERT_NE(nullptr, data);
+    data[0] = 0x55;
+    block_store_unborrow(bs, 30);
+    ASSERT_EQ(block_size, block_store_flush(bs, "flush.bs"));
+
+    // Another file starts from scratch, and then it's the one being patched
+    ASSERT_EQ(image_bytes, block_store_flush(bs, "flush_other.bs"));
+    ASSERT_EQ(block_size, block_store_write(bs, 40, write_buffer.data()));
+    ASSERT_EQ(block_size, block_store_flush(bs, "flush_other.bs"));
+    ASSERT_EQ(image_bytes, block_store_flush(bs, "flush.bs"));
+
+    // The patched image is the device
+    block_store_t *image = block_store_deserialize_ex("flush.bs", block_size, blocks);
+    ASSERT_NE(nullptr, image);
+    ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(image));
+    for (size_t id = 0; id < blocks - 1; ++id) {
+        size_t got = block_store_read(bs, id, write_buffer.data());
+        ASSERT_EQ(got, block_store_read(image, id, read_buffer.data()));
+        if (got) {
+            ASSERT_EQ(write_buffer, read_buffer);
+        }
+    }
+
+    // A deserialized device patches the file it came from, but not one that's been cut short
+    ASSERT_EQ(block_size, block_store_write(image, 60, write_buffer.data()));
+    ASSERT_EQ(block_size, block_store_flush(image, "flush.bs"));
+    ASSERT_EQ(0, truncate("flush.bs", image_bytes / 2));
+    ASSERT_EQ(image_bytes, block_store_flush(image, "flush.bs"));
+    block_store_destroy(image);
+    image = block_store_deserialize_ex("flush.bs", block_size, blocks);
+    ASSERT_NE(nullptr, image);
+    ASSERT_EQ(block_size, block_store_read(image, 60, read_buffer.data()));
+    ASSERT_EQ(write_buffer, read_buffer);
+    block_store_destroy(image);
+    block_store_destroy(bs);
+
+    // Cached devices flush from their own file
+    remove("flush_cached.bs");
+    bs = block_store_open_cached("flush_cached.bs", BLOCK_STORE_OPEN_CREATE, block_size, blocks, 4);
+    ASSERT_NE(nullptr, bs);
+    for (size_t id = 0; id < used; ++id) {
+        ASSERT_TRUE(block_store_request(bs, id));
+        memset(write_buffer.data(), (int) id, block_size);
+        ASSERT_EQ(block_size, block_store_write(bs, id, write_buffer.data()));
+    }
+    ASSERT_EQ(image_bytes, block_store_flush(bs, "flush_other.bs"));
+    memset(write_buffer.data(), 0xcc, block_size);
+    ASSERT_EQ(block_size, block_store_write(bs, 0, write_buffer.data()));
+    ASSERT_EQ(block_size, block_store_flush(bs, "flush_other.bs"));
+    block_store_destroy(bs);
+    image = block_store_deserialize_ex("flush_other.bs", block_size, blocks);
+    ASSERT_NE(nullptr, image);
+    ASSERT_EQ(used, block_store_get_used_blocks(image));
+    for (size_t id = 0; id < used; ++id) {
+        memset(write_buffer.data(), id ? (int) id : 0xcc, block_size);
+        ASSERT_EQ(block_size, block_store_read(image, id, read_buffer.data()));
+        ASSERT_EQ(write_buffer, read_buffer);
+    }
+    block_store_destroy(image);
+    remove("flush.bs");
+    remove("flush_other.bs");
+    remove("flush_cached.bs");
+}
+
+TEST(block_store_alloc_free_req, release_many_scattered) {
+    // Plain, sharded and buddy devices all sweep the same list
+    for (int mode = 0; mode < 3; ++mode) {
+        block_store_t *bs = block_store_create_ex(256, 16384);
+        ASSERT_NE(nullptr, bs);
+        if (mode == 1) {
+            ASSERT_TRUE(block_store_enable_sharding(bs, 4));
+        } else if (mode == 2) {
+            ASSERT_TRUE(block_store_enable_buddy(bs, 4));
+        }
+        const size_t avail = block_store_get_free_blocks(bs);
+        std::vector<size_t> ids(avail);
+        ASSERT_TRUE(block_store_allocate_n(bs, avail, ids.data()));
+        ASSERT_EQ(0, block_store_get_free_blocks(bs));
+
+        // A few thousand scattered ids, some runs, repeats, and ids off the end of the device
+        std::vector<size_t> release;
+        std::vector<bool> freed(avail);
+        size_t unique = 0;
+        for (size_t idx = 0; idx < avail; idx += (idx * 7919) % 5 + 1) {
+            release.push_back(idx);
+            unique += !freed[idx];
+            freed[idx] = true;
+        }
+        ASSERT_GT(unique, 3000);
+        release.push_back(release[10]);
+        release.push_back(release[0]);
+        release.push_back(avail);
+        release.push_back(SIZE_MAX);
+        std::reverse(release.begin(), release.end());
+        block_store_release_n(bs, release.data(), release.size());
+        ASSERT_EQ(unique, block_store_get_free_blocks(bs));
+
+        // Releasing them again changes nothing
+        block_store_release_n(bs, release.data(), release.size());
+        ASSERT_EQ(unique, block_store_get_free_blocks(bs));
+
+        // And exactly the listed blocks came free
+        for (size_t idx = 0; idx < avail; idx += 97) {
+            ASSERT_EQ(freed[idx], block_store_request(bs, idx));
+        }
+        block_store_destroy(bs);
+    }
+}
+
+TEST(block_store_serialize, concurrent_flush) {
+    const size_t block_size = 512, blocks = 1000, used = 200;
+    remove("flush_a.bs");
+    remove("flush_b.bs");
+    remove("flush_c.bs");
+    block_store_t *bs = block_store_create_ex(block_size, blocks);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_enable_sharding(bs, 4));
+    for (size_t id = 0; id < used; ++id) {
+        ASSERT_TRUE(block_store_request(bs, id));
+    }
+
+    // Two flushers swapping files keep throwing the dirty tracking away while a writer keeps dirtying it
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; ++t) {
+        threads.emplace_back([bs, t]() {
+            for (int round = 0; round < 20; ++round) {
+                block_store_flush(bs, (round + t) % 2 ? "flush_a.bs" : "flush_b.bs");
+            }
+        });
+    }
+    threads.emplace_back([bs, block_size, used]() {
+        std::vector<uint8_t> buffer(block_size);
+        for (size_t round = 0; round < 2000; ++round) {
+            memset(buffer.data(), (int) round, block_size);
+            block_store_write(bs, round % used, buffer.data());
+        }
+    });
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    // The flushers left the dirty tracking consistent, a fresh file gets all of it and the next flush patches it
+    ASSERT_EQ(block_size * blocks, block_store_flush(bs, "flush_c.bs"));
+    ASSERT_EQ(0, block_store_flush(bs, "flush_c.bs"));
+    block_store_t *image = block_store_deserialize_ex("flush_c.bs", block_size, blocks);
+    ASSERT_NE(nullptr, image);
+    std::vector<uint8_t> want(block_size), got(block_size);
+    for (size_t id = 0; id < used; ++id) {
+        ASSERT_EQ(block_size, block_store_read(bs, id, want.data()));
+        ASSERT_EQ(block_size, block_store_read(image, id, got.data()));
+        ASSERT_EQ(want, got);
+    }
+    block_store_destroy(image);
+    block_store_destroy(bs);
+    remove("flush_a.bs");
+    remove("flush_b.bs");
+    remove("flush_c.bs");
+}
 
 #if GRAD_TESTS
 